@@ -0,0 +1,69 @@
+-- Measures how fast each engine runs a couple of tight loops.
+--
+-- Usage: lua benchmark.lua [millions of instructions per run]
+--
+-- The "predecode" and "block" engines fuse common instruction pairs (like
+-- LDA/STA and DEX/BNE) into one handler. They're timed with and without
+-- fusion (the `fuse` option of M6502.new), so comparing the two lines of an
+-- engine shows what the saved dispatches are worth.
+
+local M6 = require('M6502')
+local utils = require('M6502.utils')
+
+local INSNS = (tonumber(arg and arg[1]) or 50) * 1e6
+
+local LOOPS = {
+
+  -- Copies a page, over and over.
+  copy = utils.parse_hex [[
+    a2 00       ; start: LDX #0
+    bd 00 10    ; loop:  LDA $1000,X
+    9d 00 20    ;        STA $2000,X
+    e8          ;        INX
+    d0 f7       ;        BNE loop
+    4c 00 06    ;        JMP start
+  ]],
+
+  -- Searches a page for a byte that isn't there, over and over.
+  compare = utils.parse_hex [[
+    a0 00       ; start: LDY #0
+    a9 ff       ;        LDA #$FF
+    c8          ; loop:  INY
+    c0 00       ;        CPY #0
+    f0 05       ;        BEQ done
+    d9 00 10    ;        CMP $1000,Y
+    d0 f6       ;        BNE loop
+    4c 00 06    ; done:  JMP start
+  ]],
+
+  -- Adds up a page, counting down.
+  sum = utils.parse_hex [[
+    a2 00       ; start: LDX #0
+    18          ; loop:  CLC
+    7d 00 10    ;        ADC $1000,X
+    ca          ;        DEX
+    d0 f9       ;        BNE loop
+    4c 00 06    ;        JMP start
+  ]],
+
+}
+
+local SETUPS = {
+  { "interpret",          { engine = "interpret" } },
+  { "predecode",          { engine = "predecode" } },
+  { "predecode unfused",  { engine = "predecode", fuse = false } },
+  { "block",              { engine = "block" } },
+  { "block unfused",      { engine = "block", fuse = false } },
+}
+
+for _, name in ipairs { "copy", "compare", "sum" } do
+  for _, setup in ipairs(SETUPS) do
+    local mpu = M6.new(setup[2])
+    mpu:pokes(0x600, LOOPS[name])
+    mpu:pc(0x600)
+    local start = os.clock()
+    local _, count = mpu:run { instructions = INSNS }
+    local elapsed = os.clock() - start
+    print(('%-8s %-18s %7.1f M insns/s'):format(name, setup[1], count / elapsed / 1e6))
+  end
+end
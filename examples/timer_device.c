@@ -0,0 +1,90 @@
+/*
+ * A native device, for use with mpu:attach().
+ *
+ * It's a timer that interrupts the processor every so many cycles. It
+ * has one register:
+ *
+ *   write: 1 enables the interrupts, 0 disables them.
+ *   read:  the number of interrupts raised since the last read (this also
+ *          acknowledges them).
+ *
+ * Build it as a Lua module, "timer_device", and use it like this:
+ *
+ *    local timer = require('timer_device').new(1000000 / 60)
+ *    mpu:attach(timer, 0xd000, 0xd000)
+ */
+
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "../src/m6502_device.h"
+
+typedef struct
+{
+    M6502_Device dev;           /* Must come first. */
+    int enabled;
+    uint8_t pending;
+} Timer;
+
+static uint8_t
+timer_read(void *state, uint16_t addr)
+{
+    Timer *t = state;
+    uint8_t n = t->pending;
+
+    (void) addr;
+    t->pending = 0;
+    return n;
+}
+
+static void
+timer_write(void *state, uint16_t addr, uint8_t byte)
+{
+    Timer *t = state;
+
+    (void) addr;
+    t->enabled = (byte & 1);
+}
+
+static int
+timer_tick(void *state, uint64_t now)
+{
+    Timer *t = state;
+
+    (void) now;
+    if (!t->enabled)
+        return 0;
+    t->pending++;
+    return M6502_DEVICE_IRQ;
+}
+
+static int
+l_new(lua_State * L)
+{
+    lua_Integer period = luaL_checkinteger(L, 1);
+    Timer *t;
+
+    luaL_argcheck(L, period > 0, 1, "the period must be positive");
+
+    t = lua_newuserdata(L, sizeof *t);
+    memset(t, 0, sizeof *t);
+    M6502_DEVICE_INIT(&t->dev, "timer");
+    t->dev.state = t;
+    t->dev.read = timer_read;
+    t->dev.write = timer_write;
+    t->dev.tick = timer_tick;
+    t->dev.period = period;
+
+    return 1;
+}
+
+int
+luaopen_timer_device(lua_State * L)
+{
+    lua_newtable(L);
+    lua_pushcfunction(L, l_new);
+    lua_setfield(L, -2, "new");
+    return 1;
+}
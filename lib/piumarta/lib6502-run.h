@@ -0,0 +1,271 @@
+/* lib6502-run.h -- the instruction dispatch loop	-*- C -*- */
+
+/* this file is included by lib6502.c once for each engine variant, after
+ * it has defined RUN (the name of the function to generate), PREDECODED
+ * (true if operands come from the instruction cache rather than from
+ * memory), BLOCKS (true if limits are checked once per basic block;
+ * implies PREDECODED) and HOOKS (0 to ignore read and write callbacks, 1
+ * to honour write callbacks only, 2 to honour both).  the addressing-mode
+ * macros in force at the point of inclusion are the ones the generated
+ * loop uses. */
+
+static int RUN(M6502 *mpu, unsigned long insns, uint64_t limit, unsigned long *executed)
+{
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+
+  static void *itab[]=    { &&_00, &&_01, &&_02, &&_03, &&_04, &&_05, &&_06, &&_07, &&_08, &&_09, &&_0a, &&_0b, &&_0c, &&_0d, &&_0e, &&_0f,
+			    &&_10, &&_11, &&_12, &&_13, &&_14, &&_15, &&_16, &&_17, &&_18, &&_19, &&_1a, &&_1b, &&_1c, &&_1d, &&_1e, &&_1f,
+			    &&_20, &&_21, &&_22, &&_23, &&_24, &&_25, &&_26, &&_27, &&_28, &&_29, &&_2a, &&_2b, &&_2c, &&_2d, &&_2e, &&_2f,
+			    &&_30, &&_31, &&_32, &&_33, &&_34, &&_35, &&_36, &&_37, &&_38, &&_39, &&_3a, &&_3b, &&_3c, &&_3d, &&_3e, &&_3f,
+			    &&_40, &&_41, &&_42, &&_43, &&_44, &&_45, &&_46, &&_47, &&_48, &&_49, &&_4a, &&_4b, &&_4c, &&_4d, &&_4e, &&_4f,
+			    &&_50, &&_51, &&_52, &&_53, &&_54, &&_55, &&_56, &&_57, &&_58, &&_59, &&_5a, &&_5b, &&_5c, &&_5d, &&_5e, &&_5f,
+			    &&_60, &&_61, &&_62, &&_63, &&_64, &&_65, &&_66, &&_67, &&_68, &&_69, &&_6a, &&_6b, &&_6c, &&_6d, &&_6e, &&_6f,
+			    &&_70, &&_71, &&_72, &&_73, &&_74, &&_75, &&_76, &&_77, &&_78, &&_79, &&_7a, &&_7b, &&_7c, &&_7d, &&_7e, &&_7f,
+			    &&_80, &&_81, &&_82, &&_83, &&_84, &&_85, &&_86, &&_87, &&_88, &&_89, &&_8a, &&_8b, &&_8c, &&_8d, &&_8e, &&_8f,
+			    &&_90, &&_91, &&_92, &&_93, &&_94, &&_95, &&_96, &&_97, &&_98, &&_99, &&_9a, &&_9b, &&_9c, &&_9d, &&_9e, &&_9f,
+			    &&_a0, &&_a1, &&_a2, &&_a3, &&_a4, &&_a5, &&_a6, &&_a7, &&_a8, &&_a9, &&_aa, &&_ab, &&_ac, &&_ad, &&_ae, &&_af,
+			    &&_b0, &&_b1, &&_b2, &&_b3, &&_b4, &&_b5, &&_b6, &&_b7, &&_b8, &&_b9, &&_ba, &&_bb, &&_bc, &&_bd, &&_be, &&_bf,
+			    &&_c0, &&_c1, &&_c2, &&_c3, &&_c4, &&_c5, &&_c6, &&_c7, &&_c8, &&_c9, &&_ca, &&_cb, &&_cc, &&_cd, &&_ce, &&_cf,
+			    &&_d0, &&_d1, &&_d2, &&_d3, &&_d4, &&_d5, &&_d6, &&_d7, &&_d8, &&_d9, &&_da, &&_db, &&_dc, &&_dd, &&_de, &&_df,
+			    &&_e0, &&_e1, &&_e2, &&_e3, &&_e4, &&_e5, &&_e6, &&_e7, &&_e8, &&_e9, &&_ea, &&_eb, &&_ec, &&_ed, &&_ee, &&_ef,
+			    &&_f0, &&_f1, &&_f2, &&_f3, &&_f4, &&_f5, &&_f6, &&_f7, &&_f8, &&_f9, &&_fa, &&_fb, &&_fc, &&_fd, &&_fe, &&_ff,
+# if PREDECODED
+#  define fusedLabel(a, name, mode, cycles, b)	&&_##a##_##b,
+			    do_fusions(fusedLabel)
+#  undef fusedLabel
+# endif
+			  };
+
+  register void **itabp= &itab[0];
+  register void  *tpc;
+
+# if PREDECODED
+#  define fetch()				dc= &cache->insn[PC++]
+#  define refetch()				(void)0
+#  define jump()				if (!(tpc= dc->handler)) tpc= decode(mpu, PC - 1, itabp);  goto *tpc
+# else
+#  define fetch()				tpc= itabp[memory[PC++]]
+#  define refetch()				(void)(tpc= itabp[memory[PC - 1]])	/* after a callout: it may have changed the next insn */
+#  define jump()				goto *tpc
+# endif
+# define prefetched(ADDR)			((word)(ADDR) == (word)(PC - 1) ? refetch() : (void)0)	/* a store over the fetched insn */
+# if BLOCKS
+#  define begin()				fetch();  goto enter
+#  define check()				if (!--run) goto boundary
+# else
+#  define begin()				fetch();  jump()
+#  define check()				if (expired()) goto yield
+# endif
+# define next()					check();  jump()
+# define resume()				begin()
+# define dispatch(num, name, mode, cycles)	_##num: name(cycles, mode) oops();  next()
+# define end()
+# define rewind()				--PC
+
+#else /* (!__GNUC__) || (__STRICT_ANSI__) */
+
+# define begin()				resume: for (;;) { switch (memory[PC++]) {
+# define resume()				goto resume
+# define fetch()
+# define refetch()				(void)0
+# define prefetched(ADDR)			(void)0
+# define next()					break
+# define dispatch(num, name, mode, cycles)	case 0x##num: name(cycles, mode);  next()
+# define end()					} if (expired()) goto yield; }
+# define rewind()
+
+#endif
+
+  register byte  *memory= mpu->memory;
+  register word   PC;
+  word		  ea;
+  byte		  A, X, Y, P, S;
+  uint64_t	  clk;
+  unsigned long	  left= insns;
+  int		  stop= 0;
+  M6502_CallbackPage **readCallback=  mpu->callbacks->read;
+  M6502_CallbackPage **writeCallback= mpu->callbacks->write;
+#if HOOKS > 1
+  uint8_t	      *readPages=     mpu->callbacks->readPages;
+# define readHooked(ADDR)	(M6502_pageHooked(readPages, ADDR) && M6502_callbackAt(readCallback, ADDR))
+#else
+# define readHooked(ADDR)	0	/* (the callback branch is compiled, never taken) */
+#endif
+#if HOOKS > 0
+  uint8_t	      *writePages=    mpu->callbacks->writePages;
+# define writeHooked(ADDR)	(M6502_pageHooked(writePages, ADDR) && M6502_callbackAt(writeCallback, ADDR))
+#else
+# define writeHooked(ADDR)	0
+#endif
+
+  /* after calling out: have callbacks this variant ignores been installed? */
+#if HOOKS < 2
+# define rehooked()	(hookLevel(mpu) > HOOKS)
+#else
+# define rehooked()	0
+#endif
+# define rehook()	(void)(rehooked() ? (mpu->deadline= 0, calledOut()) : (void)0)
+#if PREDECODED
+  M6502_Cache	 *cache= mpu->cache;
+  M6502_Decoded	 *dc;
+#endif
+#if BLOCKS
+  unsigned long	  run= 0, ran= 0;	/* insns left before the next check, out of RAN */
+#endif
+
+  /* other mpus sharing our memory may have decoded what we overwrite */
+# define shared(ADDR)	(mpu->sharer ? wroteShared(mpu, ADDR) : (void)0)
+
+#if BLOCKS
+  /* a callout or a write to code may move the limits or change the rest of
+   * the block: cut the run short so that limits are checked after this insn */
+# define calledOut()	(void)(ran -= run - 1, run= 1)
+# define settle()	(left -= ran - run, ran= run)
+# define retire()	--run
+# define remaining()	(left - (ran - run) - 1)
+# define written(ADDR)	(void)(cache->code[(word)(ADDR) >> 8] ? (invalidate(cache, ADDR), calledOut()) : (void)0, shared(ADDR))
+#elif PREDECODED
+# define calledOut()	(void)0
+# define settle()
+# define retire()	--left
+# define remaining()	(left - 1)
+# define written(ADDR)	(void)(cache->code[(word)(ADDR) >> 8] ? invalidate(cache, ADDR) : (void)0, shared(ADDR))
+#else
+# define calledOut()	(void)0
+# define settle()
+# define retire()	--left
+# define remaining()	(left - 1)
+# define written(ADDR)	(void)(prefetched(ADDR), shared(ADDR))
+#endif
+
+  /* skip K iterations of an idle loop of N insns taking T cycles, ending
+   * before the deadline and within the budget (remaining() is the number
+   * of insns left after this one).  with neither limit there's nothing
+   * to wait for, so the loop just runs.  nor can we skip a loop polling
+   * memory that changes by itself. */
+# define fastForward(T, N)						\
+  if (clk < mpu->deadline && (insns || mpu->deadline != UINT64_MAX)	\
+      && !(mpu->flags & M6502_VolatileMemory))				\
+    {									\
+      uint64_t k= (mpu->deadline - 1 - clk) / (T);			\
+      if (k > remaining() / (N)) k= remaining() / (N);			\
+      clk  += k * (T);							\
+      left -= k * (N);							\
+      calledOut();							\
+    }
+
+# define internalise()	A= mpu->registers->a;  X= mpu->registers->x;  Y= mpu->registers->y;  P= mpu->registers->p;  S= mpu->registers->s;  PC= mpu->registers->pc;  clk= mpu->ticks
+# define externalise()	mpu->registers->a= A;  mpu->registers->x= X;  mpu->registers->y= Y;  mpu->registers->p= P;  mpu->registers->s= S;  mpu->registers->pc= PC;  mpu->ticks= clk
+
+  /* both limits are tested after every insn: a zero INSNS wraps round and never expires */
+# define expired()	((!--left) | (clk >= mpu->deadline))
+
+#if PREDECODED
+  if (cache->owner != (void *)itab) flush(cache, itab);
+#endif
+  internalise();
+  if (mpu->waiting) goto idle;
+
+  begin();
+  do_insns(dispatch);
+  end();
+
+#if PREDECODED
+  /* superinstructions: the first insn's next() lands on the check that
+   * follows it, after which the second insn is entered directly */
+# undef next
+# define next()		goto second
+# define fused(a, name, mode, cycles, b)	\
+  _##a##_##b:					\
+  {						\
+    __label__ second;				\
+    name(cycles, mode);				\
+  second:					\
+    check();					\
+    if (dc->handler == &&_##b) goto _##b;	\
+    jump();					\
+  }
+  do_fusions(fused)
+# undef fused
+#endif
+
+#if BLOCKS
+ boundary:
+  settle();
+  if (!left || clk >= mpu->deadline)
+    goto yield;
+ enter:
+  /* run the whole block unchecked if it fits within both limits */
+  if (!dc->insns) measure(mpu, PC - 1, itabp);
+  run= ((unsigned long)dc->insns - 1 <= left - 1 && clk + dc->ticks <= mpu->deadline) ? dc->insns : 1;
+  ran= run;
+  jump();
+#endif
+
+ yield:
+  rewind();
+  externalise();
+  if (insns && !left)
+    stop= mpu->stop ? mpu->stop : M6502_StopBudget;
+  else if (!(stop= service(mpu, limit)))
+    {
+      if (rehooked())
+	{
+	  stop= RESELECT;
+	  goto leave;
+	}
+      internalise();
+      if (mpu->waiting) goto idle;
+      resume();
+    }
+ leave:
+  settle();
+  externalise();
+  if (executed) *executed= insns - left;
+  return stop;
+
+ sleep:
+  /* WAI: nothing happens until an event raises an interrupt (or until the
+   * caller does, if no event is pending) */
+  settle();
+  if (!left)
+    {
+      fetch();
+      goto yield;
+    }
+ idle:
+  if (mpu->deadline == UINT64_MAX)
+    {
+      stop= M6502_StopWaiting;
+      goto leave;
+    }
+  if (clk < mpu->deadline) clk= mpu->deadline;
+  fetch();
+  goto yield;
+
+# undef begin
+# undef resume
+# undef internalise
+# undef externalise
+# undef expired
+# undef written
+# undef shared
+# undef calledOut
+# undef settle
+# undef retire
+# undef readHooked
+# undef writeHooked
+# undef rehooked
+# undef rehook
+# undef remaining
+# undef fastForward
+# undef fetch
+# undef refetch
+# undef prefetched
+# undef jump
+# undef check
+# undef next
+# undef dispatch
+# undef end
+# undef rewind
+}
@@ -29,6 +29,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+# include <sys/mman.h>
+#endif
 
 #include "lib6502.h"
 
@@ -62,24 +67,29 @@ enum {
 
 #define NAND(P, Q)	(!((P) & (Q)))
 
-#define tick(n)
-#define tickIf(p)
+#define tick(n)		(clk += (n))
+#define tickIf(p)	(clk += !!(p))
 
-/* memory access (indirect if callback installed) -- ARGUMENTS ARE EVALUATED MORE THAN ONCE! */
+/* memory access (indirect if callback installed) -- ARGUMENTS ARE EVALUATED MORE THAN ONCE!
+ * the clock is stored before calling out so that callbacks can read it, and
+ * the engine is told about direct stores and callouts (see written(),
+ * calledOut(), rehook() and refetch() in lib6502-run.h) */
 
-#define putMemory(ADDR, BYTE)			\
-  ( writeCallback[ADDR]				\
-      ? writeCallback[ADDR](mpu, ADDR, BYTE)	\
-      : (memory[ADDR]= BYTE) )
+#define putMemory(ADDR, BYTE)													\
+  ( writeHooked(ADDR)														\
+      ? (void)(mpu->ticks= clk, calledOut(), M6502_callbackAt(writeCallback, ADDR)(mpu, ADDR, BYTE), rehook(), refetch())	\
+      : (void)(memory[ADDR]= BYTE, written(ADDR)) )
 
-#define getMemory(ADDR)				\
-  ( readCallback[ADDR]				\
-      ?  readCallback[ADDR](mpu, ADDR, 0)	\
+#define getMemory(ADDR)								\
+  ( readHooked(ADDR)								\
+      ? (mpu->ticks= clk, calledOut(), M6502_callbackAt(readCallback, ADDR)(mpu, ADDR, 0))	\
       :  memory[ADDR] )
 
+#define callHooked(ADDR)	(M6502_getCallback(mpu, call, ADDR) != 0)
+
 /* stack access (always direct) */
 
-#define push(BYTE)		(memory[0x0100 + S--]= (BYTE))
+#define push(BYTE)		(memory[0x0100 + S]= (BYTE), written(0x0100 + S), S--)
 #define pop()			(memory[++S + 0x0100])
 
 /* adressing modes (memory access direct) */
@@ -100,7 +110,7 @@ enum {
   tick(ticks);					\
   ea= memory[PC++];				\
   if (ea & 0x80) ea -= 0x100;			\
-  tickIf((ea >> 8) != (PC >> 8));
+  tickIf(((PC + ea) ^ PC) & 0xff00);
 
 #define indirect(ticks)				\
   tick(ticks);					\
@@ -470,6 +480,7 @@ enum {
       adrmode(ticks);				\
       PC += ea;					\
       tick(1);					\
+      idling(PC - ea - 2);			\
     }						\
   else						\
     {						\
@@ -491,23 +502,33 @@ enum {
 #define bra(ticks, adrmode)			\
   adrmode(ticks);				\
   PC += ea;					\
-  fetch();					\
   tick(1);					\
+  idling(PC - ea - 2);				\
+  fetch();					\
   next();
 
 #define jmp(ticks, adrmode)				\
   adrmode(ticks);					\
-  PC= ea;						\
-  if (mpu->callbacks->call[ea])				\
+  if (callHooked(ea))					\
     {							\
       word addr;					\
+      PC= ea;						\
       externalise();					\
-      if ((addr= mpu->callbacks->call[ea](mpu, ea, 0x4c)))\
+      addr= M6502_callbackAt(mpu->callbacks->call, ea)(mpu, ea, 0x4c);	\
+      rehook();						\
+      if (addr)						\
 	{						\
 	  internalise();				\
 	  PC= addr;					\
 	}						\
     }							\
+  else if (ticks == 3 && ea == (word)(PC - 3))		\
+    {							\
+      PC= ea;	/* JMP * */				\
+      fastForward(3, 1);				\
+    }							\
+  else							\
+    PC= ea;						\
   fetch();						\
   next();
 
@@ -517,11 +538,13 @@ enum {
   push(PC & 0xff);					\
   PC--;							\
   adrmode(ticks);					\
-  if (mpu->callbacks->call[ea])				\
+  if (callHooked(ea))					\
     {							\
       word addr;					\
       externalise();					\
-      if ((addr= mpu->callbacks->call[ea](mpu, ea, 0x20)))\
+      addr= M6502_callbackAt(mpu->callbacks->call, ea)(mpu, ea, 0x20);	\
+      rehook();						\
+      if (addr)						\
 	{						\
 	  internalise();				\
 	  PC= addr;					\
@@ -550,12 +573,15 @@ enum {
   push(P | flagX);						\
   P |= flagI;							\
   {								\
-    word hdlr= getMemory(0xfffe) + (getMemory(0xffff) << 8);	\
-    if (mpu->callbacks->call[hdlr])				\
+    word hdlr= getMemory(0xfffe);				\
+    hdlr |= getMemory(0xffff) << 8;				\
+    if (callHooked(hdlr))					\
       {								\
 	word addr;						\
 	externalise();						\
-	if ((addr= mpu->callbacks->call[hdlr](mpu, PC - 2, 0x00)))\
+	addr= M6502_callbackAt(mpu->callbacks->call, hdlr)(mpu, PC - 2, 0x00);	\
+	rehook();						\
+	if (addr)						\
 	  {							\
 	    internalise();					\
 	    hdlr= addr;						\
@@ -579,12 +605,21 @@ enum {
   tick(ticks);					\
   next();
 
-#define ill(ticks, adrmode)						\
-  fetch();								\
-  tick(ticks);								\
-  fflush(stdout);							\
-  fprintf(stderr, "\nundefined instruction %02X\n", memory[PC-1]);	\
-  return;
+#define ill(ticks, adrmode)			\
+  --PC;						\
+  stop= M6502_StopIllegal;			\
+  goto leave;
+
+#define wai(ticks, adrmode)			\
+  tick(ticks);					\
+  mpu->waiting= 1;				\
+  retire();					\
+  goto sleep;
+
+#define stp(ticks, adrmode)			\
+  --PC;						\
+  stop= M6502_StopHalted;			\
+  goto leave;
 
 #define phR(ticks, adrmode, R)			\
   fetch();					\
@@ -637,74 +672,102 @@ enum {
 
 #define do_insns(_)												\
   _(00, brk, implied,   7);  _(01, ora, indx,      6);  _(02, ill, implied,   2);  _(03, ill, implied, 2);      \
-  _(04, tsb, zp,        3);  _(05, ora, zp,        3);  _(06, asl, zp,        5);  _(07, ill, implied, 2);      \
-  _(08, php, implied,   3);  _(09, ora, immediate, 3);  _(0a, asla,implied,   2);  _(0b, ill, implied, 2);      \
-  _(0c, tsb, abs,       4);  _(0d, ora, abs,       4);  _(0e, asl, abs,       6);  _(0f, ill, implied, 2);      \
-  _(10, bpl, relative,  2);  _(11, ora, indy,      5);  _(12, ora, indzp,     3);  _(13, ill, implied, 2);      \
-  _(14, trb, zp,        3);  _(15, ora, zpx,       4);  _(16, asl, zpx,       6);  _(17, ill, implied, 2);      \
+  _(04, tsb, zp,        5);  _(05, ora, zp,        3);  _(06, asl, zp,        5);  _(07, ill, implied, 2);      \
+  _(08, php, implied,   3);  _(09, ora, immediate, 2);  _(0a, asla,implied,   2);  _(0b, ill, implied, 2);      \
+  _(0c, tsb, abs,       6);  _(0d, ora, abs,       4);  _(0e, asl, abs,       6);  _(0f, ill, implied, 2);      \
+  _(10, bpl, relative,  2);  _(11, ora, indy,      5);  _(12, ora, indzp,     5);  _(13, ill, implied, 2);      \
+  _(14, trb, zp,        5);  _(15, ora, zpx,       4);  _(16, asl, zpx,       6);  _(17, ill, implied, 2);      \
   _(18, clc, implied,   2);  _(19, ora, absy,      4);  _(1a, ina, implied,   2);  _(1b, ill, implied, 2);      \
-  _(1c, trb, abs,       4);  _(1d, ora, absx,      4);  _(1e, asl, absx,      7);  _(1f, ill, implied, 2);      \
+  _(1c, trb, abs,       6);  _(1d, ora, absx,      4);  _(1e, asl, absx,      7);  _(1f, ill, implied, 2);      \
   _(20, jsr, abs,       6);  _(21, and, indx,      6);  _(22, ill, implied,   2);  _(23, ill, implied, 2);      \
   _(24, bit, zp,        3);  _(25, and, zp,        3);  _(26, rol, zp,        5);  _(27, ill, implied, 2);      \
-  _(28, plp, implied,   4);  _(29, and, immediate, 3);  _(2a, rola,implied,   2);  _(2b, ill, implied, 2);      \
+  _(28, plp, implied,   4);  _(29, and, immediate, 2);  _(2a, rola,implied,   2);  _(2b, ill, implied, 2);      \
   _(2c, bit, abs,       4);  _(2d, and, abs,       4);  _(2e, rol, abs,       6);  _(2f, ill, implied, 2);      \
-  _(30, bmi, relative,  2);  _(31, and, indy,      5);  _(32, and, indzp,     3);  _(33, ill, implied, 2);      \
+  _(30, bmi, relative,  2);  _(31, and, indy,      5);  _(32, and, indzp,     5);  _(33, ill, implied, 2);      \
   _(34, bit, zpx,       4);  _(35, and, zpx,       4);  _(36, rol, zpx,       6);  _(37, ill, implied, 2);      \
   _(38, sec, implied,   2);  _(39, and, absy,      4);  _(3a, dea, implied,   2);  _(3b, ill, implied, 2);      \
   _(3c, bit, absx,      4);  _(3d, and, absx,      4);  _(3e, rol, absx,      7);  _(3f, ill, implied, 2);      \
   _(40, rti, implied,   6);  _(41, eor, indx,      6);  _(42, ill, implied,   2);  _(43, ill, implied, 2);      \
   _(44, ill, implied,   2);  _(45, eor, zp,        3);  _(46, lsr, zp,        5);  _(47, ill, implied, 2);      \
-  _(48, pha, implied,   3);  _(49, eor, immediate, 3);  _(4a, lsra,implied,   2);  _(4b, ill, implied, 2);      \
+  _(48, pha, implied,   3);  _(49, eor, immediate, 2);  _(4a, lsra,implied,   2);  _(4b, ill, implied, 2);      \
   _(4c, jmp, abs,       3);  _(4d, eor, abs,       4);  _(4e, lsr, abs,       6);  _(4f, ill, implied, 2);      \
-  _(50, bvc, relative,  2);  _(51, eor, indy,      5);  _(52, eor, indzp,     3);  _(53, ill, implied, 2);      \
+  _(50, bvc, relative,  2);  _(51, eor, indy,      5);  _(52, eor, indzp,     5);  _(53, ill, implied, 2);      \
   _(54, ill, implied,   2);  _(55, eor, zpx,       4);  _(56, lsr, zpx,       6);  _(57, ill, implied, 2);      \
   _(58, cli, implied,   2);  _(59, eor, absy,      4);  _(5a, phy, implied,   3);  _(5b, ill, implied, 2);      \
   _(5c, ill, implied,   2);  _(5d, eor, absx,      4);  _(5e, lsr, absx,      7);  _(5f, ill, implied, 2);      \
   _(60, rts, implied,   6);  _(61, adc, indx,      6);  _(62, ill, implied,   2);  _(63, ill, implied, 2);      \
   _(64, stz, zp,        3);  _(65, adc, zp,        3);  _(66, ror, zp,        5);  _(67, ill, implied, 2);      \
-  _(68, pla, implied,   4);  _(69, adc, immediate, 3);  _(6a, rora,implied,   2);  _(6b, ill, implied, 2);      \
+  _(68, pla, implied,   4);  _(69, adc, immediate, 2);  _(6a, rora,implied,   2);  _(6b, ill, implied, 2);      \
   _(6c, jmp, indirect,  5);  _(6d, adc, abs,       4);  _(6e, ror, abs,       6);  _(6f, ill, implied, 2);      \
-  _(70, bvs, relative,  2);  _(71, adc, indy,      5);  _(72, adc, indzp,     3);  _(73, ill, implied, 2);      \
+  _(70, bvs, relative,  2);  _(71, adc, indy,      5);  _(72, adc, indzp,     5);  _(73, ill, implied, 2);      \
   _(74, stz, zpx,       4);  _(75, adc, zpx,       4);  _(76, ror, zpx,       6);  _(77, ill, implied, 2);      \
   _(78, sei, implied,   2);  _(79, adc, absy,      4);  _(7a, ply, implied,   4);  _(7b, ill, implied, 2);      \
   _(7c, jmp, indabsx,   6);  _(7d, adc, absx,      4);  _(7e, ror, absx,      7);  _(7f, ill, implied, 2);      \
   _(80, bra, relative,  2);  _(81, sta, indx,      6);  _(82, ill, implied,   2);  _(83, ill, implied, 2);      \
-  _(84, sty, zp,        2);  _(85, sta, zp,        2);  _(86, stx, zp,        2);  _(87, ill, implied, 2);      \
+  _(84, sty, zp,        3);  _(85, sta, zp,        3);  _(86, stx, zp,        3);  _(87, ill, implied, 2);      \
   _(88, dey, implied,   2);  _(89, bit, immediate, 2);  _(8a, txa, implied,   2);  _(8b, ill, implied, 2);      \
   _(8c, sty, abs,       4);  _(8d, sta, abs,       4);  _(8e, stx, abs,       4);  _(8f, ill, implied, 2);      \
-  _(90, bcc, relative,  2);  _(91, sta, indy,      6);  _(92, sta, indzp,     3);  _(93, ill, implied, 2);      \
+  _(90, bcc, relative,  2);  _(91, sta, indy,      6);  _(92, sta, indzp,     5);  _(93, ill, implied, 2);      \
   _(94, sty, zpx,       4);  _(95, sta, zpx,       4);  _(96, stx, zpy,       4);  _(97, ill, implied, 2);      \
   _(98, tya, implied,   2);  _(99, sta, absy,      5);  _(9a, txs, implied,   2);  _(9b, ill, implied, 2);      \
   _(9c, stz, abs,       4);  _(9d, sta, absx,      5);  _(9e, stz, absx,      5);  _(9f, ill, implied, 2);      \
-  _(a0, ldy, immediate, 3);  _(a1, lda, indx,      6);  _(a2, ldx, immediate, 3);  _(a3, ill, implied, 2);      \
+  _(a0, ldy, immediate, 2);  _(a1, lda, indx,      6);  _(a2, ldx, immediate, 2);  _(a3, ill, implied, 2);      \
   _(a4, ldy, zp,        3);  _(a5, lda, zp,        3);  _(a6, ldx, zp,        3);  _(a7, ill, implied, 2);      \
-  _(a8, tay, implied,   2);  _(a9, lda, immediate, 3);  _(aa, tax, implied,   2);  _(ab, ill, implied, 2);      \
+  _(a8, tay, implied,   2);  _(a9, lda, immediate, 2);  _(aa, tax, implied,   2);  _(ab, ill, implied, 2);      \
   _(ac, ldy, abs,       4);  _(ad, lda, abs,       4);  _(ae, ldx, abs,       4);  _(af, ill, implied, 2);      \
-  _(b0, bcs, relative,  2);  _(b1, lda, indy,      5);  _(b2, lda, indzp,     3);  _(b3, ill, implied, 2);      \
+  _(b0, bcs, relative,  2);  _(b1, lda, indy,      5);  _(b2, lda, indzp,     5);  _(b3, ill, implied, 2);      \
   _(b4, ldy, zpx,       4);  _(b5, lda, zpx,       4);  _(b6, ldx, zpy,       4);  _(b7, ill, implied, 2);      \
   _(b8, clv, implied,   2);  _(b9, lda, absy,      4);  _(ba, tsx, implied,   2);  _(bb, ill, implied, 2);      \
   _(bc, ldy, absx,      4);  _(bd, lda, absx,      4);  _(be, ldx, absy,      4);  _(bf, ill, implied, 2);      \
-  _(c0, cpy, immediate, 3);  _(c1, cmp, indx,      6);  _(c2, ill, implied,   2);  _(c3, ill, implied, 2);      \
+  _(c0, cpy, immediate, 2);  _(c1, cmp, indx,      6);  _(c2, ill, implied,   2);  _(c3, ill, implied, 2);      \
   _(c4, cpy, zp,        3);  _(c5, cmp, zp,        3);  _(c6, dec, zp,        5);  _(c7, ill, implied, 2);      \
-  _(c8, iny, implied,   2);  _(c9, cmp, immediate, 3);  _(ca, dex, implied,   2);  _(cb, ill, implied, 2);      \
+  _(c8, iny, implied,   2);  _(c9, cmp, immediate, 2);  _(ca, dex, implied,   2);  _(cb, wai, implied, 3);      \
   _(cc, cpy, abs,       4);  _(cd, cmp, abs,       4);  _(ce, dec, abs,       6);  _(cf, ill, implied, 2);      \
-  _(d0, bne, relative,  2);  _(d1, cmp, indy,      5);  _(d2, cmp, indzp,     3);  _(d3, ill, implied, 2);      \
+  _(d0, bne, relative,  2);  _(d1, cmp, indy,      5);  _(d2, cmp, indzp,     5);  _(d3, ill, implied, 2);      \
   _(d4, ill, implied,   2);  _(d5, cmp, zpx,       4);  _(d6, dec, zpx,       6);  _(d7, ill, implied, 2);      \
-  _(d8, cld, implied,   2);  _(d9, cmp, absy,      4);  _(da, phx, implied,   3);  _(db, ill, implied, 2);      \
+  _(d8, cld, implied,   2);  _(d9, cmp, absy,      4);  _(da, phx, implied,   3);  _(db, stp, implied, 3);      \
   _(dc, ill, implied,   2);  _(dd, cmp, absx,      4);  _(de, dec, absx,      7);  _(df, ill, implied, 2);      \
-  _(e0, cpx, immediate, 3);  _(e1, sbc, indx,      6);  _(e2, ill, implied,   2);  _(e3, ill, implied, 2);      \
+  _(e0, cpx, immediate, 2);  _(e1, sbc, indx,      6);  _(e2, ill, implied,   2);  _(e3, ill, implied, 2);      \
   _(e4, cpx, zp,        3);  _(e5, sbc, zp,        3);  _(e6, inc, zp,        5);  _(e7, ill, implied, 2);      \
-  _(e8, inx, implied,   2);  _(e9, sbc, immediate, 3);  _(ea, nop, implied,   2);  _(eb, ill, implied, 2);      \
+  _(e8, inx, implied,   2);  _(e9, sbc, immediate, 2);  _(ea, nop, implied,   2);  _(eb, ill, implied, 2);      \
   _(ec, cpx, abs,       4);  _(ed, sbc, abs,       4);  _(ee, inc, abs,       6);  _(ef, ill, implied, 2);      \
-  _(f0, beq, relative,  2);  _(f1, sbc, indy,      5);  _(f2, sbc, indzp,     3);  _(f3, ill, implied, 2);      \
+  _(f0, beq, relative,  2);  _(f1, sbc, indy,      5);  _(f2, sbc, indzp,     5);  _(f3, ill, implied, 2);      \
   _(f4, ill, implied,   2);  _(f5, sbc, zpx,       4);  _(f6, inc, zpx,       6);  _(f7, ill, implied, 2);      \
   _(f8, sed, implied,   2);  _(f9, sbc, absy,      4);  _(fa, plx, implied,   4);  _(fb, ill, implied, 2);      \
   _(fc, ill, implied,   2);  _(fd, sbc, absx,      4);  _(fe, inc, absx,      7);  _(ff, ill, implied, 2);
 
-
+/* superinstructions: pairs of insns that the predecoding engines fuse into a
+ * single handler.  the handler runs the first insn (opcode, name, mode and
+ * cycles as in do_insns), checks limits as usual, and then goes straight to
+ * the second (opcode) if the next cache entry still holds it, sparing an
+ * indirect dispatch.  (no separators: the list is also used in initialisers.) */
+
+#define do_fusions(_)                                                                          \
+  _(a9, lda, immediate, 2, 85)   _(a9, lda, immediate, 2, 8d)   _(a9, lda, immediate, 2, 9d)   \
+  _(a9, lda, immediate, 2, 99)   _(a9, lda, immediate, 2, 91)   _(a5, lda, zp,        3, 85)   \
+  _(a5, lda, zp,        3, 8d)   _(a5, lda, zp,        3, 9d)   _(a5, lda, zp,        3, 99)   \
+  _(a5, lda, zp,        3, 91)   _(ad, lda, abs,       4, 85)   _(ad, lda, abs,       4, 8d)   \
+  _(ad, lda, abs,       4, 9d)   _(ad, lda, abs,       4, 99)   _(ad, lda, abs,       4, 91)   \
+  _(bd, lda, absx,      4, 85)   _(bd, lda, absx,      4, 8d)   _(bd, lda, absx,      4, 9d)   \
+  _(bd, lda, absx,      4, 99)   _(bd, lda, absx,      4, 91)   _(b9, lda, absy,      4, 85)   \
+  _(b9, lda, absy,      4, 8d)   _(b9, lda, absy,      4, 9d)   _(b9, lda, absy,      4, 99)   \
+  _(b9, lda, absy,      4, 91)   _(b1, lda, indy,      5, 85)   _(b1, lda, indy,      5, 8d)   \
+  _(b1, lda, indy,      5, 9d)   _(b1, lda, indy,      5, 99)   _(b1, lda, indy,      5, 91)   \
+  _(c9, cmp, immediate, 2, d0)   _(c5, cmp, zp,        3, d0)   _(cd, cmp, abs,       4, d0)   \
+  _(dd, cmp, absx,      4, d0)   _(d9, cmp, absy,      4, d0)   _(d1, cmp, indy,      5, d0)   \
+  _(ca, dex, implied,   2, d0)   _(88, dey, implied,   2, d0)   _(c8, iny, implied,   2, c0)   \
+  _(c8, iny, implied,   2, c4)   _(c8, iny, implied,   2, cc)   _(18, clc, implied,   2, 69)   \
+  _(18, clc, implied,   2, 65)   _(18, clc, implied,   2, 6d)   _(18, clc, implied,   2, 7d)   \
+  _(18, clc, implied,   2, 79)   _(18, clc, implied,   2, 71)                                 
+
+
+
+/* an interrupt ends WAI even if it is masked (execution then carries on
+ * after the WAI) */
 
 void M6502_irq(M6502 *mpu)
 {
+  mpu->waiting= 0;
   if (!(mpu->registers->p & flagI))
     {
       mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc >> 8);
@@ -713,23 +776,27 @@ void M6502_irq(M6502 *mpu)
       mpu->registers->p &= ~flagB;
       mpu->registers->p |=  flagI;
       mpu->registers->pc = M6502_getVector(mpu, IRQ);
+      mpu->ticks += 7;
     }
 }
 
 
 void M6502_nmi(M6502 *mpu)
 {
+  mpu->waiting= 0;
   mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc >> 8);
   mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc & 0xff);
   mpu->memory[0x0100 + mpu->registers->s--] = mpu->registers->p;
   mpu->registers->p &= ~flagB;
   mpu->registers->p |=  flagI;
   mpu->registers->pc = M6502_getVector(mpu, NMI);
+  mpu->ticks += 7;
 }
 
 
 void M6502_reset(M6502 *mpu)
 {
+  mpu->waiting= 0;
   mpu->registers->p &= ~flagD;
   mpu->registers->p |=  flagI;
   mpu->registers->pc = M6502_getVector(mpu, RST);
@@ -744,74 +811,724 @@ static void oops(void)
 }
 
 
-void M6502_run(M6502 *mpu)
+int M6502_run(M6502 *mpu)
+{
+  return M6502_execute(mpu, 0, 0, 0);
+}
+
+
+/* run INSNS instructions (at least one), leaving the new state in mpu->registers */
+
+int M6502_step(M6502 *mpu, unsigned long insns)
+{
+  return M6502_execute(mpu, insns ? insns : 1, 0, 0);
+}
+
+
+void M6502_stop(M6502 *mpu, int reason)
+{
+  mpu->stop= reason;
+  mpu->deadline= 0;
+}
+
+
+/* timed events.  the pending events are kept in a binary min-heap ordered
+ * on their due cycle (ties broken by id, so events due together fire in
+ * the order they were scheduled).  the run loop only has to compare the
+ * clock with the deadline, which is the earliest of the heap's top and the
+ * end of the cycle budget. */
+
+static void outOfMemory(void);
+
+#define eventBefore(E, F)	((E)->when < (F)->when || ((E)->when == (F)->when && (E)->id < (F)->id))
+
+static void siftUp(M6502_Event *heap, int i)
+{
+  M6502_Event e= heap[i];
+  while (i > 0 && eventBefore(&e, &heap[(i - 1) / 2]))
+    {
+      heap[i]= heap[(i - 1) / 2];
+      i= (i - 1) / 2;
+    }
+  heap[i]= e;
+}
+
+static void siftDown(M6502_Event *heap, int n, int i)
+{
+  M6502_Event e= heap[i];
+  for (;;)
+    {
+      int c= 2 * i + 1;
+      if (c >= n) break;
+      if (c + 1 < n && eventBefore(&heap[c + 1], &heap[c])) ++c;
+      if (!eventBefore(&heap[c], &e)) break;
+      heap[i]= heap[c];
+      i= c;
+    }
+  heap[i]= e;
+}
+
+static void removeEvent(M6502 *mpu, int i)
+{
+  if (--mpu->nevents == i) return;
+  mpu->events[i]= mpu->events[mpu->nevents];
+  siftDown(mpu->events, mpu->nevents, i);
+  siftUp(mpu->events, i);
+}
+
+
+/* call HANDLER when the clock reaches WHEN and then, if PERIOD is not zero,
+ * every PERIOD cycles after that.  returns an id for M6502_cancel(). */
+
+int M6502_schedule(M6502 *mpu, uint64_t when, uint64_t period, M6502_EventHandler handler, void *data)
+{
+  return M6502_scheduleAs(mpu, ++mpu->lastEvent, when, period, handler, data);
+}
+
+
+/* as above, but under a given id (e.g. one saved with the rest of the
+ * machine's state).  no other pending event may have it. */
+
+int M6502_scheduleAs(M6502 *mpu, int id, uint64_t when, uint64_t period, M6502_EventHandler handler, void *data)
+{
+  M6502_Event *e;
+  if (mpu->nevents == mpu->maxevents)
+    {
+      int max= mpu->maxevents ? 2 * mpu->maxevents : 8;
+      M6502_Event *events= realloc(mpu->events, max * sizeof(M6502_Event));
+      if (!events) outOfMemory();
+      mpu->events= events;
+      mpu->maxevents= max;
+    }
+  e= &mpu->events[mpu->nevents];
+  e->when= when;
+  e->period= period;
+  e->handler= handler;
+  e->data= data;
+  e->id= id;
+  siftUp(mpu->events, mpu->nevents++);
+  if (when < mpu->deadline) mpu->deadline= when;	/* scheduled from a callback */
+  return id;
+}
+
+
+/* remove a pending event.  returns its data, or null if there's no such event. */
+
+void *M6502_cancel(M6502 *mpu, int id)
+{
+  int i;
+  for (i= 0;  i < mpu->nevents;  ++i)
+    if (mpu->events[i].id == id)
+      {
+	void *data= mpu->events[i].data;
+	removeEvent(mpu, i);
+	return data;
+      }
+  return 0;
+}
+
+
+/* called between instructions, with the registers externalised, once the
+ * clock reaches the deadline.  fires the events that are due and sets the
+ * next deadline.  returns a reason to stop, or 0 to carry on. */
+
+static int service(M6502 *mpu, uint64_t limit)
+{
+  while (!mpu->stop && mpu->nevents && mpu->events[0].when <= mpu->ticks)
+    {
+      M6502_Event e= mpu->events[0];
+      if (e.period)
+	{
+	  mpu->events[0].when += e.period;
+	  siftDown(mpu->events, mpu->nevents, 0);
+	}
+      else
+	removeEvent(mpu, 0);
+      e.handler(mpu, e.when, e.data);
+    }
+  if (mpu->stop)		return mpu->stop;
+  if (mpu->ticks >= limit)	return M6502_StopBudget;
+  mpu->deadline= limit;
+  if (mpu->nevents && mpu->events[0].when < limit)
+    mpu->deadline= mpu->events[0].when;
+  return 0;
+}
+
+
+/* predecoded instructions.  the cache holds, for each address, the
+ * dispatch label of the instruction found there along with its operand
+ * bytes, so that the predecoding engine neither fetches the opcode nor
+ * assembles the operand from memory.  writes to a page holding decoded
+ * instructions invalidate the entries that might cover the written byte.
+ *
+ * the block engine also records, for each insn it enters by a control
+ * transfer, the length of the straight-line run (basic block) starting
+ * there and the most cycles the run can take.  it checks its limits once
+ * per block if the whole block fits within them, and once per insn
+ * otherwise.  a block is at most MAXBLOCK bytes long, so a write can
+ * only affect the blocks starting up to MAXBLOCK+1 bytes before it. */
+
+#define MAXBLOCK	32
+
+struct _M6502_Decoded
+{
+  void	*handler;	/* the engine's dispatch label, or null if not decoded */
+  word	 operand;	/* operand bytes (sign-extended for relative branches) */
+  byte	 length;
+  byte	 insns;		/* number of insns in the block starting here, or 0 if not measured */
+  word	 ticks;		/* upper bound on the cycles they take */
+};
+
+struct _M6502_Cache
+{
+  M6502_Decoded	insn[0x10000];
+  byte		code[0x100];	/* non-zero for each page holding decoded insns */
+  int		blocks;		/* non-zero if the cache belongs to the block engine */
+  int		unfused;	/* non-zero if insn pairs aren't to be fused (see M6502_setFusion()) */
+  void	       *owner;		/* itab of the engine variant whose labels it holds */
+};
+
+/* the cache is big (1MB) but sparsely used, so we get it straight from
+ * the system where we can: its pages are then zeroed lazily, as they're
+ * touched, instead of all at once by calloc() (which matters to programs
+ * creating many mpus). */
+
+#if defined(MAP_ANONYMOUS)
+
+static M6502_Cache *newCache(void)
+{
+  void *cache= mmap(0, sizeof(M6502_Cache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return (cache == MAP_FAILED) ? 0 : cache;
+}
+
+static void freeCache(M6502_Cache *cache)
+{
+  if (cache) munmap(cache, sizeof(M6502_Cache));
+}
+
+#else
+
+# define newCache()		calloc(1, sizeof(M6502_Cache))
+# define freeCache(CACHE)	free(CACHE)
+
+#endif
+
+#define invalidate(CACHE, ADDR)								\
+  ( (CACHE)->insn[(word)(ADDR)].handler= (CACHE)->insn[(word)((ADDR) - 1)].handler=	\
+    (CACHE)->insn[(word)((ADDR) - 2)].handler= 0,					\
+    (CACHE)->blocks ? invalidateBlocks(CACHE, ADDR) : (void)0 )
+
+static void invalidateBlocks(M6502_Cache *cache, word addr)
+{
+  int i;
+  for (i= 0;  i < MAXBLOCK + 2;  ++i)
+    cache->insn[(word)(addr - i)].insns= 0;
+}
+
+/* mpus sharing memory are linked in a ring (see M6502_share()).  a write
+ * by one of them must invalidate what the others have decoded from it. */
+
+static void wroteShared(M6502 *mpu, word addr)
 {
+  M6502 *m;
+  for (m= mpu->sharer;  m != mpu;  m= m->sharer)
+    if (m->cache && m->cache->code[addr >> 8])
+      invalidate(m->cache, addr);
+}
+
+#define length_implied		1
+#define length_immediate	2
+#define length_zp		2
+#define length_zpx		2
+#define length_zpy		2
+#define length_relative		2
+#define length_indzp		2
+#define length_indx		2
+#define length_indy		2
+#define length_abs		3
+#define length_absx		3
+#define length_absy		3
+#define length_indirect		3
+#define length_indabsx		3
+
 #if defined(__GNUC__) && !defined(__STRICT_ANSI__)
 
-  static void *itab[256]= { &&_00, &&_01, &&_02, &&_03, &&_04, &&_05, &&_06, &&_07, &&_08, &&_09, &&_0a, &&_0b, &&_0c, &&_0d, &&_0e, &&_0f,
-			    &&_10, &&_11, &&_12, &&_13, &&_14, &&_15, &&_16, &&_17, &&_18, &&_19, &&_1a, &&_1b, &&_1c, &&_1d, &&_1e, &&_1f,
-			    &&_20, &&_21, &&_22, &&_23, &&_24, &&_25, &&_26, &&_27, &&_28, &&_29, &&_2a, &&_2b, &&_2c, &&_2d, &&_2e, &&_2f,
-			    &&_30, &&_31, &&_32, &&_33, &&_34, &&_35, &&_36, &&_37, &&_38, &&_39, &&_3a, &&_3b, &&_3c, &&_3d, &&_3e, &&_3f,
-			    &&_40, &&_41, &&_42, &&_43, &&_44, &&_45, &&_46, &&_47, &&_48, &&_49, &&_4a, &&_4b, &&_4c, &&_4d, &&_4e, &&_4f,
-			    &&_50, &&_51, &&_52, &&_53, &&_54, &&_55, &&_56, &&_57, &&_58, &&_59, &&_5a, &&_5b, &&_5c, &&_5d, &&_5e, &&_5f,
-			    &&_60, &&_61, &&_62, &&_63, &&_64, &&_65, &&_66, &&_67, &&_68, &&_69, &&_6a, &&_6b, &&_6c, &&_6d, &&_6e, &&_6f,
-			    &&_70, &&_71, &&_72, &&_73, &&_74, &&_75, &&_76, &&_77, &&_78, &&_79, &&_7a, &&_7b, &&_7c, &&_7d, &&_7e, &&_7f,
-			    &&_80, &&_81, &&_82, &&_83, &&_84, &&_85, &&_86, &&_87, &&_88, &&_89, &&_8a, &&_8b, &&_8c, &&_8d, &&_8e, &&_8f,
-			    &&_90, &&_91, &&_92, &&_93, &&_94, &&_95, &&_96, &&_97, &&_98, &&_99, &&_9a, &&_9b, &&_9c, &&_9d, &&_9e, &&_9f,
-			    &&_a0, &&_a1, &&_a2, &&_a3, &&_a4, &&_a5, &&_a6, &&_a7, &&_a8, &&_a9, &&_aa, &&_ab, &&_ac, &&_ad, &&_ae, &&_af,
-			    &&_b0, &&_b1, &&_b2, &&_b3, &&_b4, &&_b5, &&_b6, &&_b7, &&_b8, &&_b9, &&_ba, &&_bb, &&_bc, &&_bd, &&_be, &&_bf,
-			    &&_c0, &&_c1, &&_c2, &&_c3, &&_c4, &&_c5, &&_c6, &&_c7, &&_c8, &&_c9, &&_ca, &&_cb, &&_cc, &&_cd, &&_ce, &&_cf,
-			    &&_d0, &&_d1, &&_d2, &&_d3, &&_d4, &&_d5, &&_d6, &&_d7, &&_d8, &&_d9, &&_da, &&_db, &&_dc, &&_dd, &&_de, &&_df,
-			    &&_e0, &&_e1, &&_e2, &&_e3, &&_e4, &&_e5, &&_e6, &&_e7, &&_e8, &&_e9, &&_ea, &&_eb, &&_ec, &&_ed, &&_ee, &&_ef,
-			    &&_f0, &&_f1, &&_f2, &&_f3, &&_f4, &&_f5, &&_f6, &&_f7, &&_f8, &&_f9, &&_fa, &&_fb, &&_fc, &&_fd, &&_fe, &&_ff };
-
-  register void **itabp= &itab[0];
-  register void  *tpc;
-
-# define begin()				fetch();  next()
-# define fetch()				tpc= itabp[memory[PC++]]
-# define next()					goto *tpc
-# define dispatch(num, name, mode, cycles)	_##num: name(cycles, mode) oops();  next()
-# define end()
-
-#else /* (!__GNUC__) || (__STRICT_ANSI__) */
-
-# define begin()				for (;;) switch (memory[PC++]) {
-# define fetch()
-# define next()					break
-# define dispatch(num, name, mode, cycles)	case 0x##num: name(cycles, mode);  next()
-# define end()					}
+/* discard everything, when a different variant of the engine takes over */
+
+static void flush(M6502_Cache *cache, void *owner)
+{
+  int page;
+  for (page= 0;  page < 0x100;  ++page)
+    if (cache->code[page])
+      {
+	memset(&cache->insn[page << 8], 0, 0x100 * sizeof(M6502_Decoded));
+	cache->code[page]= 0;
+      }
+  cache->owner= owner;
+}
+
+/* the labels of fused handlers follow the 256 insn labels in itab */
+
+enum {
+# define fusionIndex(a, name, mode, cycles, b)	fuse_##a##_##b,
+  do_fusions(fusionIndex)
+# undef fusionIndex
+  fusions
+};
+
+static void *decode(M6502 *mpu, word pc, void **itab)
+{
+  M6502_Cache	*cache= mpu->cache;
+  M6502_Decoded	*dc= &cache->insn[pc];
+  byte		*m= mpu->memory;
+  int		 i;
+
+  switch (m[pc])
+    {
+#     define decodeLength(num, name, mode, cycles) case 0x##num: dc->length= length_##mode;  break;
+      do_insns(decodeLength);
+#     undef decodeLength
+    }
+  if      (dc->length == 3)		dc->operand= m[(word)(pc + 1)] | (m[(word)(pc + 2)] << 8);
+  else if (dc->length == 2)		dc->operand= m[(word)(pc + 1)];
+  else					dc->operand= 0;
+  if ((m[pc] & 0x1f) == 0x10 || m[pc] == 0x80)	/* Bxx and BRA */
+    dc->operand= (int8_t)dc->operand;
+  for (i= 0;  i < dc->length;  ++i)
+    cache->code[(word)(pc + i) >> 8]= 1;
+  if (!cache->unfused)
+    switch ((m[pc] << 8) | m[(word)(pc + dc->length)])
+      {
+#       define fusionLabel(a, name, mode, cycles, b) case 0x##a##b: return dc->handler= itab[256 + fuse_##a##_##b];
+	do_fusions(fusionLabel)
+#       undef fusionLabel
+      }
+  return dc->handler= itab[m[pc]];
+}
+
+/* insns after which control may not fall through to the next address */
+
+#define endsBlock(op)								\
+  (   ((op) & 0x1f) == 0x10 || (op) == 0x80	/* Bxx, BRA */			\
+   || (op) == 0x4c || (op) == 0x6c || (op) == 0x7c	/* JMP */			\
+   || (op) == 0x20 || (op) == 0x60 || (op) == 0x40	/* JSR, RTS, RTI */		\
+   || (op) == 0x00 || (op) == 0xcb || (op) == 0xdb )	/* BRK, WAI, STP */
+
+/* measure the block starting at PC.  the bound on cycles allows two more
+ * than the base count per insn: for a page crossing plus a taken branch,
+ * or a page crossing plus decimal mode. */
+
+static void measure(M6502 *mpu, word pc, void **itab)
+{
+  M6502_Cache	*cache= mpu->cache;
+  word		 addr= pc;
+  int		 insns= 0, ticks= 0;
+
+  for (;;)
+    {
+      M6502_Decoded *dc= &cache->insn[addr];
+      byte	     op= mpu->memory[addr];
+      if (!dc->handler) decode(mpu, addr, itab);
+      switch (op)
+	{
+#	  define insnTicks(num, name, mode, cycles) case 0x##num: ticks += cycles + 2;  break;
+	  do_insns(insnTicks);
+#	  undef insnTicks
+	}
+      ++insns;
+      addr += dc->length;
+      if (endsBlock(op) || (word)(addr - pc) >= MAXBLOCK || M6502_getCallback(mpu, call, addr))
+	break;
+    }
+  cache->insn[pc].insns= insns;
+  cache->insn[pc].ticks= ticks;
+}
 
 #endif
 
-  register byte  *memory= mpu->memory;
-  register word   PC;
-  word		  ea;
-  byte		  A, X, Y, P, S;
-  M6502_Callback *readCallback=  mpu->callbacks->read;
-  M6502_Callback *writeCallback= mpu->callbacks->write;
 
-# define internalise()	A= mpu->registers->a;  X= mpu->registers->x;  Y= mpu->registers->y;  P= mpu->registers->p;  S= mpu->registers->s;  PC= mpu->registers->pc
-# define externalise()	mpu->registers->a= A;  mpu->registers->x= X;  mpu->registers->y= Y;  mpu->registers->p= P;  mpu->registers->s= S;  mpu->registers->pc= PC
+/* idle loops.  a branch taken back to itself, or to a load from a byte
+ * that has no read callback, repeats the same insns with the same outcome
+ * until something outside the loop changes memory: that is, until the
+ * next event.  the engines skip whole iterations of such loops, stopping
+ * short of the deadline so that the loop still ends where it would have. */
+
+#define idling(FROM)					\
+  if ((word)(ea + 5) <= 3)				\
+    {							\
+      int n, t= idleLoop(mpu, PC, FROM, &n);		\
+      if (t) { fastForward(t, n); }			\
+    }
+
+/* return the cycles taken by one iteration of the loop closed by the taken
+ * branch at FROM to TARGET, storing its number of insns in INSNS, or 0 if
+ * the loop isn't idle */
+
+static int idleLoop(M6502 *mpu, word target, word from, int *insns)
+{
+  byte *m= mpu->memory;
+  int   ticks= 3 + !!(((word)(from + 2) ^ target) & 0xff00);
+  word  ea;
+
+  *insns= 1;
+  if (target == from)				/* Bxx * */
+    return ticks;
+  switch (m[target])
+    {
+    case 0xa5: case 0xa6: case 0xa4: case 0x24:	/* LDA LDX LDY BIT zp */
+      if ((word)(target + 2) != from) return 0;
+      ea= m[(word)(target + 1)];
+      ticks += 3;
+      break;
+    case 0xad: case 0xae: case 0xac: case 0x2c:	/* LDA LDX LDY BIT abs */
+      if ((word)(target + 3) != from) return 0;
+      ea= m[(word)(target + 1)] | (m[(word)(target + 2)] << 8);
+      ticks += 4;
+      break;
+    default:
+      return 0;
+    }
+  if (M6502_getCallback(mpu, read, ea))
+    return 0;
+  *insns= 2;
+  return ticks;
+}
+
+
+/* hook levels.  each engine is built three times: for MPUs with neither
+ * read nor write callbacks (HOOKS 0), with write callbacks only (HOOKS 1),
+ * and with both (HOOKS 2), so that the common cases don't test for
+ * callbacks they can't have.  M6502_execute() picks the cheapest variant
+ * covering the installed callbacks.  if calling out installs callbacks
+ * the running variant doesn't check, it stops at the next instruction
+ * boundary with RESELECT and M6502_execute() carries on with another. */
+
+#define RESELECT	-1
+
+static int anyHooks(M6502_PageMap pages)
+{
+  unsigned int i;
+  for (i= 0;  i < sizeof(M6502_PageMap);  ++i)
+    if (pages[i])
+      return 1;
+  return 0;
+}
+
+static int hookLevel(M6502 *mpu)
+{
+  if (anyHooks(mpu->callbacks->readPages))	return 2;
+  if (anyHooks(mpu->callbacks->writePages))	return 1;
+  return 0;
+}
+
+typedef int (*Engine)(M6502 *mpu, unsigned long insns, uint64_t limit, unsigned long *executed);
+
+
+/* the plain interpreter */
+
+#define PREDECODED	0
+#define BLOCKS		0
+
+#define RUN		interpretPure
+#define HOOKS		0
+#include "lib6502-run.h"
+#undef RUN
+#undef HOOKS
+
+#define RUN		interpretWrites
+#define HOOKS		1
+#include "lib6502-run.h"
+#undef RUN
+#undef HOOKS
+
+#define RUN		interpret
+#define HOOKS		2
+#include "lib6502-run.h"
+#undef RUN
+#undef HOOKS
+
+#undef PREDECODED
+#undef BLOCKS
+
+static Engine interpreters[3]= { interpretPure, interpretWrites, interpret };
+
+
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+
+/* the predecoding engine: same insns, but addressing modes take their
+ * operands from the cache entry (DC) of the insn being executed */
+
+#undef abs
+#undef relative
+#undef indirect
+#undef absx
+#undef absy
+#undef zp
+#undef zpx
+#undef zpy
+#undef indx
+#undef indy
+#undef indabsx
+#undef indzp
+
+#define abs(ticks)				\
+  tick(ticks);					\
+  ea= dc->operand;				\
+  PC += 2;
+
+#define relative(ticks)				\
+  tick(ticks);					\
+  ea= dc->operand;				\
+  PC++;						\
+  tickIf(((PC + ea) ^ PC) & 0xff00);
+
+#define indirect(ticks)				\
+  tick(ticks);					\
+  {						\
+    word tmp= dc->operand;			\
+    ea = memory[tmp] + (memory[tmp + 1] << 8);	\
+    PC += 2;					\
+  }
+
+#define absx(ticks)						\
+  tick(ticks);							\
+  ea= dc->operand;						\
+  PC += 2;							\
+  tickIf((ticks == 4) && ((ea >> 8) != ((ea + X) >> 8)));	\
+  ea += X;
+
+#define absy(ticks)						\
+  tick(ticks);							\
+  ea= dc->operand;						\
+  PC += 2;							\
+  tickIf((ticks == 4) && ((ea >> 8) != ((ea + Y) >> 8)));	\
+  ea += Y
+
+#define zp(ticks)				\
+  tick(ticks);					\
+  ea= dc->operand;				\
+  PC++;
+
+#define zpx(ticks)				\
+  tick(ticks);					\
+  ea= (dc->operand + X) & 0x00ff;		\
+  PC++;
+
+#define zpy(ticks)				\
+  tick(ticks);					\
+  ea= (dc->operand + Y) & 0x00ff;		\
+  PC++;
+
+#define indx(ticks)				\
+  tick(ticks);					\
+  {						\
+    byte tmp= dc->operand + X;			\
+    ea= memory[tmp] + (memory[tmp + 1] << 8);	\
+    PC++;					\
+  }
+
+#define indy(ticks)						\
+  tick(ticks);							\
+  {								\
+    byte tmp= dc->operand;					\
+    ea= memory[tmp] + (memory[tmp + 1] << 8);			\
+    tickIf((ticks == 5) && ((ea >> 8) != ((ea + Y) >> 8)));	\
+    ea += Y;							\
+    PC++;							\
+  }
+
+#define indabsx(ticks)					\
+  tick(ticks);						\
+  {							\
+    word tmp= dc->operand + X;				\
+    ea = memory[tmp] + (memory[tmp + 1] << 8);		\
+  }
+
+#define indzp(ticks)					\
+  tick(ticks);						\
+  {							\
+    byte tmp= dc->operand;				\
+    ea = memory[tmp] + (memory[tmp + 1] << 8);		\
+    PC++;						\
+  }
+
+#define PREDECODED	1
+#define BLOCKS		0
+
+#define RUN		predecodedPure
+#define HOOKS		0
+#include "lib6502-run.h"
+#undef RUN
+#undef HOOKS
 
-  internalise();
+#define RUN		predecodedWrites
+#define HOOKS		1
+#include "lib6502-run.h"
+#undef RUN
+#undef HOOKS
 
-  begin();
-  do_insns(dispatch);
-  end();
+#define RUN		predecoded
+#define HOOKS		2
+#include "lib6502-run.h"
+#undef RUN
+#undef HOOKS
 
-# undef begin
-# undef internalise
-# undef externalise
-# undef fetch
-# undef next
-# undef dispatch
-# undef end
+#undef BLOCKS
+
+static Engine predecoders[3]= { predecodedPure, predecodedWrites, predecoded };
+
+/* the block engine: the same again, checking limits once per block */
+
+#define BLOCKS		1
+
+#define RUN		blocksPure
+#define HOOKS		0
+#include "lib6502-run.h"
+#undef RUN
+#undef HOOKS
+
+#define RUN		blocksWrites
+#define HOOKS		1
+#include "lib6502-run.h"
+#undef RUN
+#undef HOOKS
+
+#define RUN		blocks
+#define HOOKS		2
+#include "lib6502-run.h"
+#undef RUN
+#undef HOOKS
+
+#undef PREDECODED
+#undef BLOCKS
+
+static Engine blockers[3]= { blocksPure, blocksWrites, blocks };
+
+#endif /* __GNUC__ && !__STRICT_ANSI__ */
+
+
+/* run at most INSNS instructions and stop at the first instruction boundary
+ * once TICKS clock cycles have elapsed (zero means no limit in either case).
+ * the reason for stopping is returned and, if EXECUTED is not null, the
+ * number of instructions run is stored through it. */
+
+int M6502_execute(M6502 *mpu, unsigned long insns, uint64_t ticks, unsigned long *executed)
+{
+  uint64_t	limit= ticks ? mpu->ticks + ticks : UINT64_MAX;
+  unsigned long	done= 0, n;
+  Engine       *engines= interpreters;
+  int		stop;
+
+  mpu->stop= 0;
+  if ((stop= service(mpu, limit)))
+    {
+      if (executed) *executed= 0;
+      return stop;
+    }
+
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+  if (mpu->cache)
+    engines= mpu->cache->blocks ? blockers : predecoders;
+#endif
+  do
+    {
+      stop= engines[hookLevel(mpu)](mpu, insns ? insns - done : 0, limit, &n);
+      done += n;
+    }
+  while (stop == RESELECT);
+  if (executed) *executed= done;
+  return stop;
 
   (void)oops;
 }
 
 
+/* select the engine M6502_execute() uses.  returns 0 if ENGINE isn't
+ * available in this build. */
+
+int M6502_setEngine(M6502 *mpu, int engine)
+{
+  switch (engine)
+    {
+    case M6502_Interpreter:
+      freeCache(mpu->cache);
+      mpu->cache= 0;
+      return 1;
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+    case M6502_Predecoder:
+    case M6502_Blocks:
+      /* the cache holds labels of one engine only */
+      if (mpu->cache && mpu->cache->blocks != (engine == M6502_Blocks))
+	{
+	  freeCache(mpu->cache);
+	  mpu->cache= 0;
+	}
+      if (!mpu->cache && !(mpu->cache= newCache())) outOfMemory();
+      mpu->cache->blocks= (engine == M6502_Blocks);
+      return 1;
+#endif
+    }
+  return 0;
+}
+
+
+/* turn the fusion of insn pairs by the predecoding engines on or off (it's
+ * on to begin with).  only meant for measuring what fusion is worth. */
+
+void M6502_setFusion(M6502 *mpu, int fuse)
+{
+  if (mpu->cache && mpu->cache->unfused != !fuse)
+    {
+      mpu->cache->unfused= !fuse;
+      mpu->cache->owner= 0;	/* decode everything afresh */
+    }
+}
+
+
+/* tell the engine that LEN bytes at ADDR were modified behind its back
+ * (e.g. by writing directly into mpu->memory) */
+
+static void invalidateRange(M6502_Cache *cache, word addr, unsigned int len)
+{
+  while (len)
+    {
+      unsigned int n= 0x100 - (addr & 0xff);	/* to the end of the page */
+      if (n > len) n= len;
+      len -= n;
+      if (!cache->code[addr >> 8])		/* no code here: skip the page */
+	addr += n;
+      else
+	while (n--)
+	  {
+	    invalidate(cache, addr);
+	    ++addr;
+	  }
+    }
+}
+
+void M6502_invalidate(M6502 *mpu, uint16_t addr, unsigned int len)
+{
+  M6502 *m= mpu;
+  do
+    {
+      if (m->cache) invalidateRange(m->cache, addr, len);
+      m= m->sharer;
+    }
+  while (m && m != mpu);
+}
+
+
+/* make MPU, whose memory must be that of WITH, see WITH's writes to it and
+ * vice versa.  (the memory still belongs to whichever mpu allocated it.) */
+
+void M6502_share(M6502 *mpu, M6502 *with)
+{
+  if (!with->sharer) with->sharer= with;
+  mpu->sharer= with->sharer;
+  with->sharer= mpu;
+}
+
+
 int M6502_disassemble(M6502 *mpu, word ip, char buffer[64])
 {
   char *s= buffer;
@@ -864,6 +1581,65 @@ static void outOfMemory(void)
 }
 
 
+/* install FN at every address from FIRST to LAST in TABLE (or remove the
+ * callbacks there, if FN is null), allocating or freeing pages and keeping
+ * the page bitmap PAGES in step */
+
+void M6502_setCallbackRangeIn(M6502_CallbackTable table, M6502_PageMap pages, uint16_t first, uint16_t last, M6502_Callback fn)
+{
+  unsigned addr= first;
+
+  while (addr <= last)
+    {
+      M6502_CallbackPage *page= table[addr >> 8];
+      byte		  bit=  1 << ((addr >> 8) & 7);
+      unsigned		  end=  (addr | 0xff) < last ? (addr | 0xff) : last;
+      int		  i;
+
+      if (!page)
+	{
+	  if (!fn) { addr= end + 1;  continue; }
+	  if (!(page= calloc(1, sizeof(M6502_CallbackPage)))) outOfMemory();
+	  table[addr >> 8]= page;
+	  pages[addr >> 11] |= bit;
+	}
+      for (i= addr & 0xff;  i <= (int)(end & 0xff);  ++i)
+	(*page)[i]= fn;
+      if (!fn)
+	{
+	  for (i= 0;  i < 0x100 && !(*page)[i];  ++i);
+	  if (i == 0x100)
+	    {
+	      free(page);
+	      table[addr >> 8]= 0;
+	      pages[addr >> 11] &= ~bit;
+	    }
+	}
+      addr= end + 1;
+    }
+}
+
+
+M6502_Callback M6502_setCallbackIn(M6502_CallbackTable table, M6502_PageMap pages, uint16_t addr, M6502_Callback fn)
+{
+  M6502_setCallbackRangeIn(table, pages, addr, addr, fn);
+  return fn;
+}
+
+
+static void freeCallbacks(M6502_Callbacks *callbacks)
+{
+  int i;
+  for (i= 0;  i < 0x100;  ++i)
+    {
+      free(callbacks->read[i]);
+      free(callbacks->write[i]);
+      free(callbacks->call[i]);
+    }
+  free(callbacks);
+}
+
+
 M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callbacks *callbacks)
 {
   M6502 *mpu= calloc(1, sizeof(M6502));
@@ -883,11 +1659,113 @@ M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callback
 }
 
 
+/* put TO in the same state as FROM: registers, memory, callbacks, timed
+ * events and engine.  only the memory pages that differ are copied (and
+ * invalidated); if TO has no decoded instructions of its own it gets those
+ * of FROM, which are valid as the memory they were decoded from is the
+ * same.  TO has its own copy of everything, even of what FROM shares with
+ * others (custom_data excepted, which is left alone). */
+
+static void copyCallbacks(M6502_CallbackTable to, M6502_CallbackTable from)
+{
+  int i;
+  for (i= 0;  i < 0x100;  ++i)
+    if (from[i])
+      {
+	if (!to[i] && !(to[i]= malloc(sizeof(M6502_CallbackPage)))) outOfMemory();
+	memcpy(to[i], from[i], sizeof(M6502_CallbackPage));
+      }
+    else if (to[i])
+      {
+	free(to[i]);
+	to[i]= 0;
+      }
+}
+
+void M6502_copy(M6502 *to, M6502 *from)
+{
+  int i, fresh= 0;
+
+  *to->registers= *from->registers;
+
+  if (to->cache && (!from->cache || to->cache->blocks != from->cache->blocks
+		    || to->cache->unfused != from->cache->unfused))
+    {
+      freeCache(to->cache);
+      to->cache= 0;
+    }
+  if (from->cache && !to->cache)
+    {
+      if (!(to->cache= newCache())) outOfMemory();
+      to->cache->blocks= from->cache->blocks;
+      to->cache->unfused= from->cache->unfused;
+      to->cache->owner= from->cache->owner;
+      fresh= 1;
+    }
+
+  for (i= 0;  i < 0x10000;  i += 0x100)
+    if (memcmp(to->memory + i, from->memory + i, 0x100))
+      {
+	memcpy(to->memory + i, from->memory + i, 0x100);
+	if (!fresh) M6502_invalidate(to, i, 0x100);
+      }
+
+  if (fresh)
+    for (i= 0;  i < 0x100;  ++i)
+      if (from->cache->code[i])
+	{
+	  memcpy(&to->cache->insn[i << 8], &from->cache->insn[i << 8], 0x100 * sizeof(M6502_Decoded));
+	  to->cache->code[i]= 1;
+	}
+
+  copyCallbacks(to->callbacks->read,  from->callbacks->read);
+  copyCallbacks(to->callbacks->write, from->callbacks->write);
+  copyCallbacks(to->callbacks->call,  from->callbacks->call);
+  memcpy(to->callbacks->readPages,  from->callbacks->readPages,  sizeof(M6502_PageMap));
+  memcpy(to->callbacks->writePages, from->callbacks->writePages, sizeof(M6502_PageMap));
+  memcpy(to->callbacks->callPages,  from->callbacks->callPages,  sizeof(M6502_PageMap));
+
+  to->ticks= from->ticks;
+  to->waiting= from->waiting;
+  to->stop= 0;
+
+  if (to->maxevents < from->nevents)
+    {
+      M6502_Event *events= realloc(to->events, from->maxevents * sizeof(M6502_Event));
+      if (!events) outOfMemory();
+      to->events= events;
+      to->maxevents= from->maxevents;
+    }
+  if (from->nevents)
+    memcpy(to->events, from->events, from->nevents * sizeof(M6502_Event));
+  to->nevents= from->nevents;
+  to->lastEvent= from->lastEvent;
+}
+
+
+/* a new mpu in the same state as MPU (see above) */
+
+M6502 *M6502_clone(M6502 *mpu)
+{
+  M6502 *clone= M6502_new(0, 0, 0);
+  M6502_copy(clone, mpu);
+  return clone;
+}
+
+
 void M6502_delete(M6502 *mpu)
 {
-  if (mpu->flags & M6502_CallbacksAllocated) free(mpu->callbacks);
+  if (mpu->sharer)	/* leave the ring */
+    {
+      M6502 *m= mpu->sharer;
+      while (m->sharer != mpu) m= m->sharer;
+      m->sharer= (mpu->sharer == m) ? 0 : mpu->sharer;
+    }
+  if (mpu->flags & M6502_CallbacksAllocated) freeCallbacks(mpu->callbacks);
   if (mpu->flags & M6502_MemoryAllocated   ) free(mpu->memory);
   if (mpu->flags & M6502_RegistersAllocated) free(mpu->registers);
+  free(mpu->events);
+  freeCache(mpu->cache);
 
   free(mpu);
 }
@@ -8,10 +8,15 @@
 typedef struct _M6502		M6502;
 typedef struct _M6502_Registers	M6502_Registers;
 typedef struct _M6502_Callbacks	M6502_Callbacks;
+typedef struct _M6502_Event	M6502_Event;
+typedef struct _M6502_Cache	M6502_Cache;
+typedef struct _M6502_Decoded	M6502_Decoded;
 
 typedef int   (*M6502_Callback)(M6502 *mpu, uint16_t address, uint8_t data);
+typedef void  (*M6502_EventHandler)(M6502 *mpu, uint64_t when, void *data);
 
-typedef M6502_Callback	M6502_CallbackTable[0x10000];
+typedef M6502_Callback	M6502_CallbackPage[0x100];
+typedef M6502_CallbackPage *M6502_CallbackTable[0x100];
 typedef uint8_t		M6502_Memory[0x10000];
 
 enum {
@@ -30,11 +35,32 @@ struct _M6502_Registers
   uint16_t pc;	/* program counter */
 };
 
+/* each table is a directory of pages, a page being allocated when its
+ * first callback is installed and freed when its last one is removed.  the
+ * table is summarised by a bitmap with one bit per page, set if the page
+ * is allocated; the run loop only looks into the directory for pages whose
+ * bit is set, so callbacks must be installed with M6502_setCallback() to
+ * keep the two in step. */
+
+typedef uint8_t		M6502_PageMap[0x100 / 8];
+
 struct _M6502_Callbacks
 {
   M6502_CallbackTable read;
   M6502_CallbackTable write;
   M6502_CallbackTable call;
+  M6502_PageMap	      readPages;
+  M6502_PageMap	      writePages;
+  M6502_PageMap	      callPages;
+};
+
+struct _M6502_Event
+{
+  uint64_t	     when;	/* clock cycle at which the handler is called */
+  uint64_t	     period;	/* re-armed this many cycles later, or 0 if one-shot */
+  M6502_EventHandler handler;
+  void		    *data;
+  int		     id;
 };
 
 struct _M6502
@@ -45,19 +71,64 @@ struct _M6502
   unsigned int	   flags;
 
   void            *custom_data;  /* Reserved for the user. The emulator doesn't use it. */
+
+  uint64_t	   ticks;	/* clock cycles executed so far */
+  uint64_t	   deadline;	/* M6502_execute() returns once ticks reaches this */
+  int		   stop;	/* reason passed to M6502_stop(), or 0 */
+  int		   waiting;	/* non-zero after WAI, until an interrupt */
+
+  M6502_Event	  *events;	/* min-heap ordered on when (see M6502_schedule()) */
+  int		   nevents;
+  int		   maxevents;
+  int		   lastEvent;	/* id given to the most recently scheduled event */
+
+  M6502_Cache	  *cache;	/* predecoded instructions, if that engine is selected */
+  M6502		  *sharer;	/* next in the ring of mpus sharing our memory, or null (see M6502_share()) */
 };
 
 enum {
   M6502_RegistersAllocated = 1 << 0,
   M6502_MemoryAllocated    = 1 << 1,
-  M6502_CallbacksAllocated = 1 << 2
+  M6502_CallbacksAllocated = 1 << 2,
+  M6502_VolatileMemory     = 1 << 3	/* memory may change while running (e.g. written by another process): don't skip idle loops */
+};
+
+/* engines M6502_setEngine() accepts */
+
+enum {
+  M6502_Interpreter= 0,	/* decode each instruction as it is executed */
+  M6502_Predecoder,	/* cache decoded instructions (invalidated by writes) */
+  M6502_Blocks		/* as above, checking limits once per basic block (still an interpreter) */
+};
+
+/* reasons M6502_run() and M6502_execute() return */
+
+enum {
+  M6502_StopBudget= 1,	/* the instruction or cycle budget was used up */
+  M6502_StopBRK,	/* a BRK handler asked to stop */
+  M6502_StopIllegal,	/* undefined instruction (PC is left pointing at it) */
+  M6502_StopRequested,	/* a callback called M6502_stop() */
+  M6502_StopWaiting,	/* WAI with no event pending to end the wait */
+  M6502_StopHalted	/* STP (PC is left pointing at it) */
 };
 
 extern M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callbacks *callbacks);
+extern void   M6502_copy(M6502 *to, M6502 *from);
+extern M6502 *M6502_clone(M6502 *mpu);
 extern void   M6502_reset(M6502 *mpu);
 extern void   M6502_nmi(M6502 *mpu);
 extern void   M6502_irq(M6502 *mpu);
-extern void   M6502_run(M6502 *mpu);
+extern int    M6502_run(M6502 *mpu);
+extern int    M6502_step(M6502 *mpu, unsigned long insns);
+extern int    M6502_execute(M6502 *mpu, unsigned long insns, uint64_t ticks, unsigned long *executed);
+extern void   M6502_stop(M6502 *mpu, int reason);
+extern int    M6502_setEngine(M6502 *mpu, int engine);
+extern void   M6502_setFusion(M6502 *mpu, int fuse);
+extern void   M6502_invalidate(M6502 *mpu, uint16_t addr, unsigned int len);
+extern void   M6502_share(M6502 *mpu, M6502 *with);
+extern int    M6502_schedule(M6502 *mpu, uint64_t when, uint64_t period, M6502_EventHandler handler, void *data);
+extern int    M6502_scheduleAs(M6502 *mpu, int id, uint64_t when, uint64_t period, M6502_EventHandler handler, void *data);
+extern void  *M6502_cancel(M6502 *mpu, int id);
 extern int    M6502_disassemble(M6502 *mpu, uint16_t addr, char buffer[64]);
 extern void   M6502_dump(M6502 *mpu, char buffer[64]);
 extern void   M6502_delete(M6502 *mpu);
@@ -70,8 +141,23 @@ extern void   M6502_delete(M6502 *mpu);
   ( ( ((MPU)->memory[M6502_##VEC##VectorLSB]= ((uint8_t)(ADDR)) & 0xff) )	\
     , ((MPU)->memory[M6502_##VEC##VectorMSB]= (uint8_t)((ADDR) >> 8)) )
 
-#define M6502_getCallback(MPU, TYPE, ADDR)	((MPU)->callbacks->TYPE[ADDR])
-#define M6502_setCallback(MPU, TYPE, ADDR, FN)	((MPU)->callbacks->TYPE[ADDR]= (FN))
+#define M6502_pageHooked(PAGES, ADDR)	((PAGES)[(uint16_t)(ADDR) >> 11] & (1 << (((uint16_t)(ADDR) >> 8) & 7)))
+
+/* the callback at ADDR, which must be on a page whose bit is set */
+#define M6502_callbackAt(TABLE, ADDR)	((*(TABLE)[(uint16_t)(ADDR) >> 8])[(ADDR) & 0xff])
+
+#define M6502_getCallback(MPU, TYPE, ADDR)					\
+  ( M6502_pageHooked((MPU)->callbacks->TYPE##Pages, ADDR)			\
+      ? M6502_callbackAt((MPU)->callbacks->TYPE, ADDR) : 0 )
+
+#define M6502_setCallback(MPU, TYPE, ADDR, FN)	\
+  M6502_setCallbackIn((MPU)->callbacks->TYPE, (MPU)->callbacks->TYPE##Pages, (ADDR), (FN))
+
+#define M6502_setCallbackRange(MPU, TYPE, FIRST, LAST, FN)	\
+  M6502_setCallbackRangeIn((MPU)->callbacks->TYPE, (MPU)->callbacks->TYPE##Pages, (FIRST), (LAST), (FN))
+
+extern M6502_Callback M6502_setCallbackIn(M6502_CallbackTable table, M6502_PageMap pages, uint16_t addr, M6502_Callback fn);
+extern void	      M6502_setCallbackRangeIn(M6502_CallbackTable table, M6502_PageMap pages, uint16_t first, uint16_t last, M6502_Callback fn);
 
 
 #endif /* __m6502_h */
@@ -0,0 +1,252 @@
+/**
+ * Hook sets: where LuaMPU keeps the Lua callbacks installed at addresses.
+ *
+ * The C library has its own (per-page) table of callbacks, telling it
+ * *whether* to call out. Here we record *what* to call: a sorted array of
+ * address ranges, looked up by binary search.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hooks.h"
+
+/**
+ * Returns the range containing an address, or NULL.
+ */
+const struct HookRange *
+hookset_find(const HookSet * set, uint16_t addr)
+{
+    int lo = 0, hi = set->count - 1;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        const struct HookRange *r = &set->ranges[mid];
+
+        if (addr < r->first)
+            hi = mid - 1;
+        else if (addr > r->last)
+            lo = mid + 1;
+        else
+            return r;
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the ref mapped to an address, or 0.
+ */
+int
+hookset_lookup(const HookSet * set, uint16_t addr)
+{
+    const struct HookRange *r = hookset_find(set, addr);
+
+    return r ? r->ref : 0;
+}
+
+/**
+ * Returns the index of the first range ending at or after 'addr' (or the
+ * count, if none does).
+ */
+static int
+first_ending_at_or_after(const HookSet * set, uint16_t addr)
+{
+    int lo = 0, hi = set->count;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (set->ranges[mid].last < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * Makes room for 'count' ranges, and for counting the uses of 'ref'.
+ */
+static void
+reserve(lua_State * L, HookSet * set, int count, int ref)
+{
+    if (count > set->size)
+    {
+        int size = set->size ? set->size * 2 : 4;
+        void *p;
+
+        while (size < count)
+            size *= 2;
+        if (!(p = realloc(set->ranges, size * sizeof *set->ranges)))
+            luaL_error(L, E_("out of memory"));
+        set->ranges = p;
+        set->size = size;
+    }
+    if (ref >= set->nuses)
+    {
+        int nuses = set->nuses ? set->nuses * 2 : 16;
+        int *p;
+
+        while (nuses <= ref)
+            nuses *= 2;
+        if (!(p = realloc(set->uses, nuses * sizeof *p)))
+            luaL_error(L, E_("out of memory"));
+        memset(p + set->nuses, 0, (nuses - set->nuses) * sizeof *p);
+        set->uses = p;
+        set->nuses = nuses;
+    }
+}
+
+/**
+ * Counts one range less for a ref, releasing it from the table at index
+ * 't' when no range is left for it.
+ */
+static void
+drop(lua_State * L, int t, HookSet * set, int ref)
+{
+    if (--set->uses[ref] == 0)
+        luaL_unref(L, t, ref);
+}
+
+/**
+ * Whether two refs stand for the same value.
+ */
+static gboolean
+same_value(lua_State * L, int t, int ref1, int ref2)
+{
+    gboolean same;
+
+    if (ref1 == ref2)
+        return TRUE;
+    lua_rawgeti(L, t, ref1);
+    lua_rawgeti(L, t, ref2);
+    same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return same;
+}
+
+/**
+ * Merges the range at 'i' into the preceding one, if they're adjacent and
+ * mapped to the same thing.
+ */
+static void
+merge_with_previous(lua_State * L, int t, HookSet * set, int i)
+{
+    struct HookRange *prev, *r;
+
+    if (i <= 0 || i >= set->count)
+        return;
+    prev = &set->ranges[i - 1];
+    r = &set->ranges[i];
+    if (prev->last + 1 != r->first || prev->data != r->data || !same_value(L, t, prev->ref, r->ref))
+        return;
+
+    prev->last = r->last;
+    drop(L, t, set, r->ref);
+    memmove(r, r + 1, (set->count - i - 1) * sizeof *r);
+    set->count--;
+}
+
+/**
+ * Maps [first, last] to a ref, and 'data', (or unmaps it, if the ref is 0).
+ *
+ * Ranges overlapping it are trimmed (or split), and refs no longer mapped
+ * anywhere are released from the table at index 't'. This takes a binary
+ * search plus moving the ranges that follow, so installing callbacks
+ * address by address, in order, takes constant time per address.
+ */
+void
+hookset_assign(lua_State * L, int t, HookSet * set, uint16_t first, uint16_t last, int ref,
+               void *data)
+{
+    struct HookRange pieces[3];
+    int lo, hi, i, n = 0, ours;
+
+    t = lua_absindex(L, t);
+
+    /* The ranges overlapping ours are [lo, hi). */
+    lo = first_ending_at_or_after(set, first);
+    for (hi = lo; hi < set->count && set->ranges[hi].first <= last; hi++)
+        ;
+
+    /* What replaces them: what sticks out of ours on either side, and ours. */
+    if (lo < hi && set->ranges[lo].first < first)
+    {
+        pieces[n] = set->ranges[lo];
+        pieces[n++].last = first - 1;
+    }
+    ours = lo + n;
+    if (ref)
+    {
+        pieces[n].first = first;
+        pieces[n].last = last;
+        pieces[n].ref = ref;
+        pieces[n++].data = data;
+    }
+    if (lo < hi && set->ranges[hi - 1].last > last)
+    {
+        pieces[n] = set->ranges[hi - 1];
+        pieces[n++].first = last + 1;
+    }
+
+    reserve(L, set, set->count - (hi - lo) + n, ref);
+
+    /* Count the new uses before the dropped ones, so that a trimmed range
+     * doesn't lose its ref. */
+    for (i = 0; i < n; i++)
+        set->uses[pieces[i].ref]++;
+    for (i = lo; i < hi; i++)
+        drop(L, t, set, set->ranges[i].ref);
+
+    memmove(&set->ranges[lo + n], &set->ranges[hi], (set->count - hi) * sizeof *set->ranges);
+    memcpy(&set->ranges[lo], pieces, n * sizeof *pieces);
+    set->count += n - (hi - lo);
+
+    if (ref)
+    {
+        merge_with_previous(L, t, set, ours + 1);
+        merge_with_previous(L, t, set, ours);
+    }
+}
+
+/**
+ * Makes 'to' a copy of 'from' (the refs are the same, so they must be
+ * valid in the table 'to' is used with). Returns FALSE if out of memory.
+ */
+gboolean
+hookset_copy(HookSet * to, const HookSet * from)
+{
+    to->ranges = NULL;
+    to->count = to->size = 0;
+    to->uses = NULL;
+    to->nuses = 0;
+    if (from->count)
+    {
+        to->ranges = malloc(from->count * sizeof *from->ranges);
+        to->uses = malloc(from->nuses * sizeof *from->uses);
+        if (!to->ranges || !to->uses)
+        {
+            hookset_free(to);
+            return FALSE;
+        }
+        memcpy(to->ranges, from->ranges, from->count * sizeof *from->ranges);
+        memcpy(to->uses, from->uses, from->nuses * sizeof *from->uses);
+        to->count = to->size = from->count;
+        to->nuses = from->nuses;
+    }
+    return TRUE;
+}
+
+void
+hookset_free(HookSet * set)
+{
+    free(set->ranges);
+    free(set->uses);
+    set->ranges = NULL;
+    set->uses = NULL;
+    set->count = set->size = set->nuses = 0;
+}
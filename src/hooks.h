@@ -0,0 +1,39 @@
+#ifndef M6502__HOOKS_H
+#define M6502__HOOKS_H
+
+#include <stdint.h>
+
+#include "lutils.h"
+
+/**
+ * A set of non-overlapping address ranges, each mapped to a ref (a Lua
+ * function stored in some table). It costs nothing when empty and grows
+ * with the number of ranges (and refs), not with the number of addresses
+ * they cover. Neighbouring ranges mapped to the same function are kept as
+ * one.
+ */
+typedef struct
+{
+    struct HookRange
+    {
+        uint16_t first, last;
+        int ref;
+        void *data;             /* Whatever the user of the set wants to keep with the ref. */
+    } *ranges;                  /* Sorted by address. */
+
+    int count;
+    int size;
+
+    int *uses;                  /* How many ranges each ref is mapped to, indexed by ref. */
+    int nuses;
+
+} HookSet;
+
+const struct HookRange *hookset_find(const HookSet * set, uint16_t addr);
+int hookset_lookup(const HookSet * set, uint16_t addr);
+void hookset_assign(lua_State * L, int t, HookSet * set, uint16_t first, uint16_t last, int ref,
+                    void *data);
+gboolean hookset_copy(HookSet * to, const HookSet * from);
+void hookset_free(HookSet * set);
+
+#endif
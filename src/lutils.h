@@ -54,6 +54,10 @@ void luaL_newlib(lua_State * L, const luaL_Reg * l);
 
 #define luaL_setfuncs(L, l, n) (luaL_register (L, NULL, l))
 
+/* A userdata's environment is what 5.2+ calls its "user value". */
+#define lua_getuservalue lua_getfenv
+#define lua_setuservalue lua_setfenv
+
 #endif
 
 /* --------------------- Borrowings from Lua 5.1 -------------------------- */
@@ -0,0 +1,82 @@
+/**
+ * Native devices for lua-M6502.
+ *
+ * This header is all a separate (native) Lua module needs to provide
+ * devices that an MPU calls directly, in C, when the program accesses the
+ * addresses they're attached to (see mpu:attach() in main.c). It doesn't
+ * depend on Lua, nor on the rest of lua-M6502.
+ *
+ * A device is a full userdata whose block *starts* with an M6502_Device.
+ * E.g., a module could create one like this:
+ *
+ *    typedef struct {
+ *        M6502_Device dev;       // Must come first.
+ *        uint8_t latch;          // The device's own state.
+ *    } Latch;
+ *
+ *    static uint8_t latch_read(void *state, uint16_t addr) {
+ *        return ((Latch *) state)->latch;
+ *    }
+ *
+ *    static int new_latch(lua_State *L) {
+ *        Latch *l = lua_newuserdata(L, sizeof *l);
+ *        memset(l, 0, sizeof *l);
+ *        M6502_DEVICE_INIT(&l->dev, "latch");
+ *        l->dev.state = l;
+ *        l->dev.read = latch_read;
+ *        return 1;
+ *    }
+ *
+ * The MPU keeps a reference to the userdata for as long as the device is
+ * attached, so its state stays valid.
+ *
+ * Compatibility: fields are only ever added at the end, and the version
+ * goes up when they are; the MPU checks 'magic' and 'version' before using
+ * a device.
+ */
+#ifndef M6502__DEVICE_H
+#define M6502__DEVICE_H
+
+#include <stdint.h>
+
+#define M6502_DEVICE_MAGIC    0x4d363544        /* "M65D" */
+#define M6502_DEVICE_VERSION  1
+
+/* What tick() returns to raise interrupts. */
+#define M6502_DEVICE_IRQ  1
+#define M6502_DEVICE_NMI  2
+
+typedef struct M6502_Device
+{
+    uint32_t magic;             /* M6502_DEVICE_MAGIC */
+    uint32_t version;           /* M6502_DEVICE_VERSION */
+    const char *name;           /* For error messages. */
+
+    void *state;                /* Passed to the functions below. */
+
+    /*
+     * Called when the program reads from an address the device is attached
+     * to. If NULL, reads come from memory, as usual.
+     */
+    uint8_t (*read) (void *state, uint16_t addr);
+
+    /*
+     * Called when the program writes to an address the device is attached
+     * to. If NULL, writes go to memory, as usual.
+     */
+    void (*write) (void *state, uint16_t addr, uint8_t byte);
+
+    /*
+     * Called every 'period' cycles while the MPU runs (if both are set).
+     * 'now' is the current cycle. Return M6502_DEVICE_IRQ and/or
+     * M6502_DEVICE_NMI to interrupt the processor, or 0.
+     */
+    int (*tick) (void *state, uint64_t now);
+    uint32_t period;
+
+} M6502_Device;
+
+#define M6502_DEVICE_INIT(dev, dev_name) \
+    ((dev)->magic = M6502_DEVICE_MAGIC, (dev)->version = M6502_DEVICE_VERSION, (dev)->name = (dev_name))
+
+#endif
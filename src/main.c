@@ -8,11 +8,16 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 
 #include "lutils.h"
 
 #include "utils.h"
+#include "hooks.h"
+#include "mapper.h"
+#include "memfile.h"
+#include "m6502_device.h"
 
 /* ------------------------------------------------------------------------ */
 
@@ -23,12 +28,49 @@ typedef struct
 {
     M6502 *mpu;
 
-    /* The following hold Lua refs to Lua functions (callbacks). */
-    int read[0x10000];
-    int write[0x10000];
-    int call[0x10000];
+    /* The following map addresses to refs into our callbacks table. */
+    HookSet read;
+    HookSet write;
+    HookSet call;
 
-    lua_State *L;               /* The engine which created this instance. */
+    lua_State *L;               /* The thread that last called a method of ours (see enter()). */
+
+    uint8_t *dirty;             /* One bit per address, for track_dirty(). Allocated on demand. */
+
+    struct                      /* Writes recorded by queue_writes(). */
+    {
+        struct QueuedWrite
+        {
+            uint64_t cycle;
+            uint16_t addr;
+            uint8_t value;
+        } *entries;
+        size_t count;
+        size_t size;
+        size_t limit;           /* The most entries it may hold; 0 for QUEUE_DEFAULT_LIMIT. */
+        unsigned long lost;     /* Dropped because the queue was full (or memory ran out). */
+    } queue;
+
+    lua_Integer violations;     /* Writes ignored by protect(). */
+
+    Mapper *mapper;             /* For map() and friends. Allocated on demand. */
+    uint8_t mirrored[0x100];    /* Pages we've installed mpu_mirror_write() on. */
+    uint8_t displaced[0x100];   /* Pages whose Lua write callbacks it replaced, still to release. */
+    gboolean displacing;        /* Whether there are such pages. */
+
+    HookSet devices;            /* Maps addresses to refs of attached devices (and to the devices, as data). */
+
+    struct                      /* Attached devices that tick, and their events. */
+    {
+        M6502_Device *device;
+        int event;
+    } *ticking;
+    int nticking;
+
+    uint64_t serial;            /* Tells MPUs apart in snapshots (see save()). */
+
+    uint8_t *memfile;           /* The mapped file, if memory is backed by one (see new()). */
+    size_t memfile_size;
 
 } LuaMPU;
 
@@ -60,81 +102,102 @@ luaM_checkaddr(lua_State * L, int idx)
 /* ------------------------------------------------------------------------ */
 
 /**
- * MPUs registration table
- * -----------------------
- *
- * The problem:
- *
- *   We need to be able to convert a M6502 C object to its corresponding Lua
- *   object (LuaMPU).
- *
- *   This is because our callback functions (mpu_{read,write,call}_callback)
- *   are invoked, by the underlying C library, with only a pointer to a M6502
- *   object, and we need to invoke, in turn, the lua callbacks, handing them
- *   a Lua object.
- *
- * The solution:
- *
- *   We record all the living MPU objects in a table. This table associates
- *   M6502 C objects with their corresponding Lua objects. The conversion
- *   task is then simple: a table lookup.
+ * The callbacks table
+ * -------------------
+ *
+ * The Lua functions an MPU calls (on_read/on_write/on_call callbacks and
+ * timed events) are stored, as refs, in a table which is the user value
+ * of the LuaMPU userdata. This way they live exactly as long as the MPU:
+ * nothing in the registry points at them, so an MPU whose callbacks refer
+ * back to it (the usual case) is still collected.
+ *
+ * Callbacks are only ever called from within our own methods (run, step,
+ * peek, poke, ...), and these all have the MPU as their first argument.
+ * So when the C library hands us a M6502 object, the corresponding Lua
+ * object is simply at index 1 of the thread that called the method, and
+ * its callbacks table is one lua_getuservalue() away: no lookups needed.
  */
 
 /**
- * Creates the registration table.
- *
- * In pseudo code, it does:
- *
- *    REGISTRY["mpus"] = new_weak_table()
+ * Gets the MPU at index 1, for methods that may end up calling callbacks.
  */
-static void
-registry__create(lua_State * L)
+static LuaMPU *
+enter(lua_State * L)
 {
-    luaU_new_weak_table(L, "kv");
-    lua_setfield(L, LUA_REGISTRYINDEX, "mpus");
+    LuaMPU *self = SELF(L, 1);
+
+    self->L = L;
+    return self;
 }
 
 /**
- * Records an MPU object in the registration table.
- *
- * In pseudo code, it does:
- *
- *    REGISTRY["mpus"][mpu] = lmpu
+ * Creates the callbacks table of the MPU at the top of the stack.
  */
 static void
-registry__record_lmpu(lua_State * L, int lmpu_idx)
+callbacks__create(lua_State * L)
 {
-    LUAU_GUARD(L);
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
+}
 
-    LuaMPU *lmpu = luaU_checkudata__unsafe(L, lmpu_idx, "LuaMPU");
+/**
+ * Stores the value at the top of the stack in the callbacks table of the
+ * MPU at 'lmpu_idx', and pops it.
+ *
+ * Returns its ref.
+ */
+static int
+callbacks__ref(lua_State * L, int lmpu_idx)
+{
+    int ref;
 
     lmpu_idx = lua_absindex(L, lmpu_idx);
 
-    lua_pushlightuserdata(L, lmpu->mpu);
-    lua_pushvalue(L, lmpu_idx);
-    luaU_registry_settable(L, "mpus");
+    lua_getuservalue(L, lmpu_idx);
+    lua_insert(L, -2);
+    ref = luaL_ref(L, -2);
+    lua_pop(L, 1);
 
-    LUAU_UNGUARD(L);
+    return ref;
 }
 
 /**
- * Gets an MPU from the registration table.
- *
- * In pseudo code, it does:
- *
- *    stack.push( REGISTRY["mpus"][mpu] )
+ * Releases a ref from the callbacks table of the MPU at 'lmpu_idx'.
  */
 static void
-registry__push_lmpu(lua_State * L, M6502 * mpu)
+callbacks__unref(lua_State * L, int lmpu_idx, int ref)
 {
-    LUAU_GUARD(L);
+    lua_getuservalue(L, lmpu_idx);
+    luaL_unref(L, -1, ref);
+    lua_pop(L, 1);
+}
 
-    lua_pushlightuserdata(L, mpu);
-    luaU_registry_gettable(L, "mpus");
+/**
+ * Pushes the callback at 'ref', followed by the MPU itself (which is the
+ * first argument all callbacks get).
+ */
+static void
+callbacks__push(lua_State * L, LuaMPU * self, int ref)
+{
+    if (lua_touserdata(L, 1) != self)   /* A method is missing enter(). */
+        luaL_error(L, E_("Internal error: the MPU isn't the method's first argument."));
 
-    assert(!lua_isnil(L, -1));  /* This shouldn't happen. */
+    lua_getuservalue(L, 1);
+    lua_rawgeti(L, -1, ref);
+    lua_replace(L, -2);
+    lua_pushvalue(L, 1);
+}
+
+/**
+ * Calls the callback pushed by callbacks__push(), with its arguments.
+ */
+static void
+callbacks__call(lua_State * L, LuaMPU * self, int nargs, int nresults)
+{
+    lua_call(L, nargs, nresults);
 
-    LUAU_UNGUARD_BY(L, 1);
+    /* The callback may have used us from another coroutine. */
+    self->L = L;
 }
 
 /* ------------------------------------------------------------------------ */
@@ -145,6 +208,48 @@ registry__push_lmpu(lua_State * L, M6502 * mpu)
  * @section
  */
 
+/**
+ * Returns a new MPU serial.
+ *
+ * Snapshots from other processes (or Lua states) must not carry our MPUs'
+ * serials, so these aren't simply 1, 2, 3...: they're a counter added to a
+ * seed made of the time and of addresses (which ASLR varies), and mixed
+ * (with the SplitMix64 finalizer, which is a bijection, so serials within
+ * a process never repeat).
+ */
+static uint64_t
+serial__new(void)
+{
+    static uint64_t seed, count;
+    uint64_t x;
+
+    if (!seed)
+        seed = (((uint64_t) time(NULL) << 32) ^ (uint64_t) clock()
+                ^ (uint64_t) (uintptr_t) &seed ^ ((uint64_t) (uintptr_t) &x << 16)) | 1;     /* Never 0 again. */
+
+    x = seed + ++count * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* The callbacks table of an MPU sharing another's memory holds, under this
+ * key, the MPU owning the memory. See new(). */
+#define MEMORY_OWNER_KEY  "memory_owner"
+
+/* And that of an MPU handed out by a pool holds the pool. See pool(). */
+#define POOL_KEY  "pool"
+
+static const char *const memfile_modes[] = { "private", "shared", NULL };
+
+static const char *const engine_names[] = {
+    "interpret", "predecode", "block", NULL
+};
+
+static const int engine_values[] = {
+    M6502_Interpreter, M6502_Predecoder, M6502_Blocks
+};
+
 /**
  * Returns a new MPU object.
  *
@@ -152,19 +257,170 @@ registry__push_lmpu(lua_State * L, M6502 * mpu)
  * that @{run|terminates the program}. All other state (memory and
  * registers) is set to zero.
  *
+ * You may pass a table of options:
+ *
+ * - `engine`: How instructions are executed. The default, "interpret",
+ *   decodes each instruction as it executes it. "predecode" caches the
+ *   decoded instructions (costing about 1MB per MPU), which may make
+ *   programs that run for a long time in the same code faster. Self-modifying
+ *   code still works: writing to memory discards the affected cache entries.
+ *   "block" is a block-checked interpreter: it builds on "predecode", and
+ *   also groups instructions into basic blocks (ending at branches, jumps,
+ *   subroutine calls and returns) so as to check the @{run|budget} once per
+ *   block instead of once per instruction. It stops at exactly the same
+ *   places as the other engines.
+ *   All three are interpreters; there's no engine compiling to native
+ *   code. Each instruction is still dispatched, so the gains are modest.
+ *   On the loops of `examples/benchmark.lua`, "block" is up to about 1.5
+ *   times as fast as "interpret", and hardly faster on a loop that mostly
+ *   copies memory ("predecode" can even be a bit slower there). Measure
+ *   with your own programs before choosing one.
+ *
+ * - `fuse`: For "predecode" and "block". These engines fuse some common
+ *   pairs of instructions (like LDA/STA and DEX/BNE), saving a dispatch
+ *   for each pair. Set this to `false` to turn that off, e.g. to measure
+ *   what it's worth. It doesn't change what programs do.
+ *
+ * - `memory_file`: The path of a file to use as memory, instead of
+ *   zeroed memory. The file is mapped, not read, so even large images load
+ *   instantly. Its first 64KB are the MPU's memory; whatever follows (in
+ *   multiples of 256 bytes) becomes the @{backing|backing store}.
+ *
+ * - `mode`: For `memory_file`. With "private" (the default), the file
+ *   must have at least 64KB, and the MPU's writes aren't seen in it. With
+ *   "shared", they are: other processes mapping the file see the memory
+ *   live (the backing store is written to when banks are switched out).
+ *   The file is created, or grown to 64KB, if needed. Since other
+ *   processes may write too, idle loops aren't skipped (see @{run}).
+ *
+ * - `share_memory_with`: Another MPU, whose memory this one uses too,
+ *   as in a machine with several processors on one bus. Each sees the
+ *   other's writes at once, and the engines notice when one of them
+ *   overwrites code the other runs. Only the memory is shared: registers,
+ *   callbacks, devices, and the @{backing|memory mapping} are each MPU's
+ *   own (so switch banks from one MPU only). The memory stays alive as
+ *   long as any of the MPUs sharing it does, whichever was created first.
+ *   Can't be combined with `memory_file` (but the other MPU may use one).
+ *
+ * Clones of such an MPU (and MPUs in @{pool}s) have memory of their own.
+ *
+ * Example:
+ *
+ *    local mpu = require('M6502').new { engine = "predecode" }
+ *
+ *    local mpu = require('M6502').new { memory_file = "c64.bin" }
+ *
+ *    local cpu = require('M6502').new()
+ *    local coprocessor = require('M6502').new { share_memory_with = cpu }
+ *
+ * @param[opt] opts
+ *
  * @function new
  */
 static int
 l_new(lua_State * L)
 {
     LuaMPU *lmpu;
+    int engine = M6502_Interpreter;
+    gboolean fuse = TRUE;
+    uint8_t *memfile = NULL;
+    size_t memfile_size = 0;
+    LuaMPU *other = NULL;
+    gboolean shared = FALSE;
+
+    if (!lua_isnoneornil(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_getfield(L, 1, "engine");
+        engine = luaU_checkoption(L, -1, "interpret", engine_names, engine_values);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "fuse");
+        fuse = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "share_memory_with");
+        if (!lua_isnil(L, -1))
+        {
+            other = luaL_checkudata(L, -1, "LuaMPU");
+            lua_getfield(L, 1, "memory_file");
+            if (!lua_isnil(L, -1))
+                luaL_error(L, E_("Options 'share_memory_with' and 'memory_file' can't be used together."));
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "memory_file");
+        if (!lua_isnil(L, -1))
+        {
+            const char *path = luaL_checkstring(L, -1);
+            const char *error;
+
+            lua_getfield(L, 1, "mode");
+            shared = luaL_checkoption(L, -1, "private", memfile_modes) == 1;
+            lua_pop(L, 1);
+
+            if (!(memfile = memfile_map(path, shared, 0x10000, &memfile_size, &error)))
+                luaL_error(L, E_("Can't use '%s' as memory: %s."), path, error);
+            if (memfile_size % 0x100 != 0)
+            {
+                memfile_unmap(memfile, memfile_size);
+                luaL_error(L, E_("Can't use '%s' as memory: its size must be a multiple of 256."), path);
+            }
+        }
+        lua_pop(L, 1);
+    }
 
     lmpu = luaU_newuserdata0(L, sizeof *lmpu, "LuaMPU");
 
-    lmpu->mpu = M6502_new(NULL, NULL, NULL);
+    lmpu->mpu = M6502_new(NULL, other ? other->mpu->memory : memfile, NULL);
+    if (shared || (other && (other->mpu->flags & M6502_VolatileMemory)))
+        lmpu->mpu->flags |= M6502_VolatileMemory;       /* Other processes write it. See run(). */
+    lmpu->memfile = memfile;
+    lmpu->memfile_size = memfile_size;
+    if (memfile_size > 0x10000)
+    {
+        /* The rest of the file is the backing store. */
+        if (!(lmpu->mapper = mapper_new()))
+            luaL_error(L, E_("out of memory"));
+        lmpu->mapper->store = memfile + 0x10000;
+        lmpu->mapper->size = memfile_size - 0x10000;
+        lmpu->mapper->borrowed = TRUE;
+    }
+    callbacks__create(L);
+
+    if (other)
+    {
+        /*
+         * The memory is freed with the MPU that allocated it, so we keep
+         * that MPU alive for as long as we are: by holding it in our
+         * callbacks table. (Not in the other MPU's table: that would only
+         * keep the owner alive as long as the other MPU is.)
+         */
+        M6502_share(lmpu->mpu, other->mpu);
+        lua_getuservalue(L, -1);
+        lua_getfield(L, 1, "share_memory_with");
+        lua_getuservalue(L, -1);
+        lua_getfield(L, -1, MEMORY_OWNER_KEY);
+        if (lua_isnil(L, -1))
+            lua_pop(L, 2);      /* The other MPU is the owner. */
+        else
+        {
+            lua_replace(L, -3);
+            lua_pop(L, 1);
+        }
+        lua_setfield(L, -2, MEMORY_OWNER_KEY);
+        lua_pop(L, 1);
+    }
+
     lmpu->L = L;
+    lmpu->serial = serial__new();
     lmpu->mpu->custom_data = lmpu;      /* See all places using get_mpu_self() to see why it's needed */
 
+    if (!M6502_setEngine(lmpu->mpu, engine))
+        luaL_error(L, E_("The '%s' engine isn't available in this build."), engine_names[engine]);
+    M6502_setFusion(lmpu->mpu, fuse);
+
     /* Setup registers. */
     lmpu->mpu->registers->s = 0xff;
 
@@ -177,8 +433,6 @@ l_new(lua_State * L)
      */
     M6502_setCallback(lmpu->mpu, call, 0x0000, default_BRK_handler);    /* The user can override this handler. */
 
-    registry__record_lmpu(L, -1);
-
     return 1;
 }
 
@@ -297,7 +551,7 @@ REGACC(pc);
 static int
 l_mpu_peek(lua_State * L)
 {
-    LuaMPU *lmpu = SELF(L, 1);
+    LuaMPU *lmpu = enter(L);
     uint16_t addr = luaM_checkaddr(L, 2);
     gboolean direct = lua_toboolean(L, 3);
 
@@ -321,13 +575,16 @@ l_mpu_peek(lua_State * L)
 static int
 l_mpu_poke(lua_State * L)
 {
-    LuaMPU *lmpu = SELF(L, 1);
+    LuaMPU *lmpu = enter(L);
     uint16_t addr = luaM_checkaddr(L, 2);
     uint8_t value = luaL_checkinteger(L, 3);
     gboolean direct = lua_toboolean(L, 4);
 
     if (direct)
+    {
         lmpu->mpu->memory[addr] = value;
+        M6502_invalidate(lmpu->mpu, addr, 1);
+    }
     else
         write_byte(lmpu->mpu, addr, value);
 
@@ -345,7 +602,7 @@ l_mpu_poke(lua_State * L)
 static int
 l_mpu_peekw(lua_State * L)
 {
-    LuaMPU *lmpu = SELF(L, 1);
+    LuaMPU *lmpu = enter(L);
     uint16_t addr = luaM_checkaddr(L, 2);
     gboolean direct = lua_toboolean(L, 3);
 
@@ -376,7 +633,7 @@ l_mpu_peekw(lua_State * L)
 static int
 l_mpu_pokew(lua_State * L)
 {
-    LuaMPU *lmpu = SELF(L, 1);
+    LuaMPU *lmpu = enter(L);
     uint16_t addr = luaM_checkaddr(L, 2);
     uint16_t value = luaL_checkinteger(L, 3);
     gboolean direct = lua_toboolean(L, 4);
@@ -387,6 +644,7 @@ l_mpu_pokew(lua_State * L)
     if (direct)
     {
         *(uint16_t *) (lmpu->mpu->memory + addr) = value;
+        M6502_invalidate(lmpu->mpu, addr, 2);
     }
     else
     {
@@ -412,27 +670,25 @@ l_mpu_pokew(lua_State * L)
 static int
 l_mpu_peeks(lua_State * L)
 {
-    LuaMPU *lmpu = SELF(L, 1);
+    LuaMPU *lmpu = enter(L);
     uint16_t addr = luaM_checkaddr(L, 2);
     int len = luaL_checkinteger(L, 3);
     gboolean direct = lua_toboolean(L, 4);
 
-    len = MIN(len, 0x10000 - addr);
+    len = MAX(MIN(len, 0x10000 - addr), 0);
 
-    if (direct)
+    if (direct
+        || unhooked_span(lmpu->mpu->callbacks->read, lmpu->mpu->callbacks->readPages, addr, len) == (unsigned) len)
     {
         lua_pushlstring(L, (const char *) &lmpu->mpu->memory[addr], len);
     }
     else
     {
-        luaL_Buffer sb;
-        luaL_buffinit(L, &sb);
-        {
-            int i;
-            for (i = 0; i < len; i++)
-                luaL_addchar(&sb, read_byte(lmpu->mpu, addr + i));
-        }
-        luaL_pushresult(&sb);
+        /* The callbacks may use the stack, so we can't use a luaL_Buffer. */
+        uint8_t *buf = lua_newuserdata(L, len);
+
+        read_bytes(lmpu->mpu, addr, buf, len);
+        lua_pushlstring(L, (const char *) buf, len);
     }
     return 1;
 }
@@ -460,7 +716,7 @@ l_mpu_peeks(lua_State * L)
 static int
 l_mpu_pokes(lua_State * L)
 {
-    LuaMPU *lmpu = SELF(L, 1);
+    LuaMPU *lmpu = enter(L);
     uint16_t addr = luaM_checkaddr(L, 2);
     size_t len;
     const char *s = luaL_checklstring(L, 3, &len);
@@ -471,12 +727,94 @@ l_mpu_pokes(lua_State * L)
     if (direct)
     {
         memcpy(&lmpu->mpu->memory[addr], s, len);
+        M6502_invalidate(lmpu->mpu, addr, len);
+    }
+    else
+    {
+        write_bytes(lmpu->mpu, addr, (const uint8_t *) s, len);
+    }
+    return 0;
+}
+
+/**
+ * Fills a range of memory with a byte.
+ *
+ * Example:
+ *
+ *    -- Clear the screen (on a machine whose text screen is at $0400).
+ *    mpu:fill(0x400, 1000, 32)
+ *
+ * @function mpu:fill
+ *
+ * @param addr
+ * @param len (As with @{pokes}, it's permissible to go past the end of
+ *   memory.)
+ * @param byte
+ * @param[opt] direct Boolean.
+ */
+static int
+l_mpu_fill(lua_State * L)
+{
+    LuaMPU *lmpu = enter(L);
+    uint16_t addr = luaM_checkaddr(L, 2);
+    lua_Integer len = luaL_checkinteger(L, 3);
+    uint8_t value = luaL_checkinteger(L, 4);
+    gboolean direct = lua_toboolean(L, 5);
+
+    len = MAX(MIN(len, 0x10000 - addr), 0);
+
+    if (direct)
+    {
+        memset(&lmpu->mpu->memory[addr], value, len);
+        M6502_invalidate(lmpu->mpu, addr, len);
+    }
+    else
+    {
+        fill_bytes(lmpu->mpu, addr, value, len);
+    }
+    return 0;
+}
+
+/**
+ * Copies a range of memory to another address.
+ *
+ * The ranges may overlap. Unless the copy is direct, it's as if all the
+ * bytes were first read (with read callbacks called), and then written
+ * (with write callbacks called).
+ *
+ * @function mpu:copy
+ *
+ * @param dst
+ * @param src
+ * @param len (It's permissible for either range to go past the end of
+ *   memory: the copy is trimmed down.)
+ * @param[opt] direct Boolean.
+ */
+static int
+l_mpu_copy(lua_State * L)
+{
+    LuaMPU *lmpu = enter(L);
+    M6502 *mpu = lmpu->mpu;
+    uint16_t dst = luaM_checkaddr(L, 2);
+    uint16_t src = luaM_checkaddr(L, 3);
+    lua_Integer len = luaL_checkinteger(L, 4);
+    gboolean direct = lua_toboolean(L, 5);
+
+    len = MAX(MIN(len, 0x10000 - MAX(dst, src)), 0);
+
+    if (direct
+        || (unhooked_span(mpu->callbacks->read, mpu->callbacks->readPages, src, len) == len
+            && unhooked_span(mpu->callbacks->write, mpu->callbacks->writePages, dst, len) == len))
+    {
+        memmove(&mpu->memory[dst], &mpu->memory[src], len);
+        M6502_invalidate(mpu, dst, len);
     }
     else
     {
-        int i;
-        for (i = 0; i < len; i++)
-            write_byte(lmpu->mpu, addr + i, s[i]);
+        uint8_t *buf = lua_newuserdata(L, len);
+
+        read_bytes(mpu, src, buf, len);
+        write_bytes(mpu, dst, buf, len);
     }
     return 0;
 }
@@ -584,23 +922,23 @@ static int
 mpu_read_callback(M6502 * mpu, uint16_t addr, uint8_t data)
 {
     LuaMPU *self = get_mpu_self(mpu);
+    lua_State *L = self->L;
+    int ref = hookset_lookup(&self->read, addr);
 
     (void) data;
 
-    d_message(("read of addr %x, by ref %d.\n", addr, self->read[addr]));
+    d_message(("read of addr %x, by ref %d.\n", addr, ref));
 
-    /* Push the function: */
-    lua_rawgeti(self->L, LUA_REGISTRYINDEX, self->read[addr]);
-    /* Push the arguments it's to receive: */
-    registry__push_lmpu(self->L, mpu);
-    lua_pushinteger(self->L, addr);
+    /* Push the function, and the arguments it's to receive: */
+    callbacks__push(L, self, ref);
+    lua_pushinteger(L, addr);
     /* Call it: */
-    lua_call(self->L, 2, 1);
+    callbacks__call(L, self, 2, 1);
 
     /* @todo: Do we want to implicitly convert float to int? 3.4 to 3? It's
      * already the case for Lua 5.1 and 5.2, but 5.3 would return zero if
      * the callback returned float. */
-    int result = luaU_pop_integer(self->L);
+    int result = luaU_pop_integer(L);
 
     return result;
 }
@@ -609,17 +947,17 @@ static int
 mpu_write_callback(M6502 * mpu, uint16_t addr, uint8_t data)
 {
     LuaMPU *self = get_mpu_self(mpu);
+    lua_State *L = self->L;
+    int ref = hookset_lookup(&self->write, addr);
 
-    d_message(("write of addr %x, by ref %d.\n", addr, self->write[addr]));
+    d_message(("write of addr %x, by ref %d.\n", addr, ref));
 
-    /* Push the function: */
-    lua_rawgeti(self->L, LUA_REGISTRYINDEX, self->write[addr]);
-    /* Push the arguments it's to receive: */
-    registry__push_lmpu(self->L, mpu);
-    lua_pushinteger(self->L, addr);
-    lua_pushinteger(self->L, data);
+    /* Push the function, and the arguments it's to receive: */
+    callbacks__push(L, self, ref);
+    lua_pushinteger(L, addr);
+    lua_pushinteger(L, data);
     /* Call it: */
-    lua_call(self->L, 3, 0);
+    callbacks__call(L, self, 3, 0);
 
     return 0;
 }
@@ -632,27 +970,29 @@ static int
 mpu_call_callback(M6502 * mpu, uint16_t addr, uint8_t inst)
 {
     LuaMPU *self = get_mpu_self(mpu);
+    lua_State *L = self->L;
+    int ref;
     int result;
 
-    LUAU_GUARD(self->L);
+    LUAU_GUARD(L);
 
     if (inst == OP_BRK)
         addr = *(uint16_t *) & self->mpu->memory[0xFFFE];
 
-    d_message(("call of addr %x, by ref %d.\n", addr, self->call[addr]));
+    ref = hookset_lookup(&self->call, addr);
+
+    d_message(("call of addr %x, by ref %d.\n", addr, ref));
 
-    /* Push the function: */
-    lua_rawgeti(self->L, LUA_REGISTRYINDEX, self->call[addr]);
-    /* Push the arguments it's to receive: */
-    registry__push_lmpu(self->L, mpu);
-    lua_pushinteger(self->L, addr);
-    lua_pushinteger(self->L, inst);
+    /* Push the function, and the arguments it's to receive: */
+    callbacks__push(L, self, ref);
+    lua_pushinteger(L, addr);
+    lua_pushinteger(L, inst);
     /* Call it: */
-    lua_call(self->L, 3, 1);
+    callbacks__call(L, self, 3, 1);
 
-    result = luaU_pop_integer(self->L);
+    result = luaU_pop_integer(L);
 
-    LUAU_UNGUARD(self->L);
+    LUAU_UNGUARD(L);
 
     if (inst == OP_JSR && result == 0)
         return popw(mpu) + 1;   /* JSR pushes next insn addr - 1 */
@@ -664,31 +1004,135 @@ mpu_call_callback(M6502 * mpu, uint16_t addr, uint8_t inst)
 #undef OP_JMP
 #undef OP_JSR
 
+static void devices__prune(lua_State * L, LuaMPU * self, uint16_t first, uint16_t last);
+
+/**
+ * Releases the Lua write callbacks mpu_mirror_write() replaced while the
+ * MPU ran (see mapper__mirror_pages()).
+ *
+ * This has to happen before the callbacks are next changed, lest we
+ * release new ones.
+ */
+static void
+mpu__release_displaced(lua_State * L, LuaMPU * self)
+{
+    int page;
+
+    if (!self->displacing)
+        return;
+
+    self->displacing = FALSE;
+    for (page = 0; page < 0x100; page++)
+        if (self->displaced[page])
+        {
+            self->displaced[page] = 0;
+            lua_getuservalue(L, 1);
+            hookset_assign(L, -1, &self->write, page << 8, (page << 8) | 0xff, 0, NULL);
+            lua_pop(L, 1);
+            devices__prune(L, self, page << 8, (page << 8) | 0xff);
+        }
+}
+
 static void
-mpu_on_xxx(lua_State * L, uint16_t addr, int *callbacks_lua, M6502_Callback * callbacks_c,
-           M6502_Callback c_handler)
+mpu_on_xxx(lua_State * L, uint16_t first, uint16_t last, int fn_idx, HookSet * callbacks_lua,
+           M6502_CallbackPage ** callbacks_c, uint8_t * pages, M6502_Callback c_handler)
 {
-    /* Release the previous callback, if installed: */
+    LuaMPU *self = SELF(L, 1);
+    int ref = 0;
 
-    if (callbacks_lua[addr] != 0)
+    mpu__release_displaced(L, self);
+
+    /* The callback is the `fn` in `mpu:on_write(addr, fn)` or `mpu:on_write_range(first, last, fn)`. */
+    if (!lua_isnoneornil(L, fn_idx))
     {
-        luaL_unref(L, LUA_REGISTRYINDEX, callbacks_lua[addr]);
-        callbacks_lua[addr] = 0;
-        callbacks_c[addr] = NULL;
+        if (lua_type(L, fn_idx) != LUA_TFUNCTION)
+            luaL_typerror(L, fn_idx, "function");
+
+        lua_pushvalue(L, fn_idx);       // ensure it's at top
+        ref = callbacks__ref(L, 1);
     }
 
-    /* Install the new callback, if provided: */
+    /* This also releases the previous callbacks, if installed: */
+    lua_getuservalue(L, 1);
+    hookset_assign(L, -1, callbacks_lua, first, last, ref, NULL);
+    lua_pop(L, 1);
+    M6502_setCallbackRangeIn(callbacks_c, pages, first, last, ref ? c_handler : NULL);
+    devices__prune(L, self, first, last);
+}
 
-    /* The callback is always at index #3 (it's the `fn` in `mpu:on_write(addr, fn)`). */
-    if (!lua_isnoneornil(L, 3))
+/**
+ * Installs one of our built-in (C) handlers over a range, replacing any
+ * Lua callbacks there.
+ */
+static void
+mpu_on_c(lua_State * L, HookSet * callbacks_lua, M6502_CallbackPage ** callbacks_c, uint8_t * pages,
+         uint16_t first, uint16_t last, M6502_Callback c_handler)
+{
+    LuaMPU *self = SELF(L, 1);
+
+    mpu__release_displaced(L, self);
+
+    lua_getuservalue(L, 1);
+    hookset_assign(L, -1, callbacks_lua, first, last, 0, NULL);
+    lua_pop(L, 1);
+    M6502_setCallbackRangeIn(callbacks_c, pages, first, last, c_handler);
+    devices__prune(L, self, first, last);
+}
+
+/**
+ * Removes a built-in handler from a range. Other callbacks in the range
+ * are left alone.
+ */
+static void
+mpu_off_c(M6502_CallbackPage ** callbacks_c, uint8_t * pages, uint16_t first, uint16_t last,
+          M6502_Callback c_handler)
+{
+    unsigned addr = first;
+
+#define HANDLER_AT(addr) \
+    (M6502_pageHooked(pages, addr) ? M6502_callbackAt(callbacks_c, addr) : NULL)
+
+    while (addr <= last)
     {
-        if (lua_type(L, 3) != LUA_TFUNCTION)
-            luaL_typerror(L, 3, "function");
+        unsigned end = addr;
 
-        lua_pushvalue(L, 3);    // ensure it's at top
-        callbacks_lua[addr] = luaL_ref(L, LUA_REGISTRYINDEX);
-        callbacks_c[addr] = c_handler;
+        if (!M6502_pageHooked(pages, addr))
+        {
+            addr = (addr | 0xff) + 1;
+            continue;
+        }
+        if (HANDLER_AT(addr) != c_handler)
+        {
+            addr++;
+            continue;
+        }
+        while (end < last && HANDLER_AT(end + 1) == c_handler)
+            end++;
+        M6502_setCallbackRangeIn(callbacks_c, pages, addr, end, NULL);
+        addr = end + 1;
     }
+
+#undef HANDLER_AT
+}
+
+#define mpu_on_read_c(L, self, first, last, c_handler) \
+    mpu_on_c(L, &(self)->read, (self)->mpu->callbacks->read, (self)->mpu->callbacks->readPages, \
+             first, last, c_handler)
+#define mpu_off_read_c(self, first, last, c_handler) \
+    mpu_off_c((self)->mpu->callbacks->read, (self)->mpu->callbacks->readPages, first, last, c_handler)
+#define mpu_on_write_c(L, self, first, last, c_handler) \
+    mpu_on_c(L, &(self)->write, (self)->mpu->callbacks->write, (self)->mpu->callbacks->writePages, \
+             first, last, c_handler)
+#define mpu_off_write_c(self, first, last, c_handler) \
+    mpu_off_c((self)->mpu->callbacks->write, (self)->mpu->callbacks->writePages, first, last, c_handler)
+
+static uint16_t
+luaM_checklast(lua_State * L, int idx, uint16_t first)
+{
+    uint16_t last = luaM_checkaddr(L, idx);
+    if (last < first)
+        luaL_error(L, E_("The range is empty (it ends at %d, before its start, %d)."), last, first);
+    return last;
 }
 
 /**
@@ -716,7 +1160,8 @@ l_mpu_on_read(lua_State * L)
     LuaMPU *self = SELF(L, 1);
     uint16_t addr = luaM_checkaddr(L, 2);
 
-    mpu_on_xxx(L, addr, self->read, self->mpu->callbacks->read, mpu_read_callback);
+    mpu_on_xxx(L, addr, addr, 3, &self->read, self->mpu->callbacks->read,
+               self->mpu->callbacks->readPages, mpu_read_callback);
 
     return 0;
 }
@@ -759,9 +1204,7 @@ l_mpu_on_read(lua_State * L)
  *
  *      end
  *
- *      for addr = SCREEN_ADDR, SCREEN_ADDR + 32*32 - 1 do
- *        mpu:on_write(addr, write)
- *      end
+ *      mpu:on_write_range(SCREEN_ADDR, SCREEN_ADDR + 32*32 - 1, write)
  *
  *    end
  *
@@ -785,7 +1228,8 @@ l_mpu_on_write(lua_State * L)
     LuaMPU *self = SELF(L, 1);
     uint16_t addr = luaM_checkaddr(L, 2);
 
-    mpu_on_xxx(L, addr, self->write, self->mpu->callbacks->write, mpu_write_callback);
+    mpu_on_xxx(L, addr, addr, 3, &self->write, self->mpu->callbacks->write,
+               self->mpu->callbacks->writePages, mpu_write_callback);
 
     return 0;
 }
@@ -832,121 +1276,2427 @@ l_mpu_on_call(lua_State * L)
     LuaMPU *self = SELF(L, 1);
     uint16_t addr = luaM_checkaddr(L, 2);
 
-    mpu_on_xxx(L, addr, self->call, self->mpu->callbacks->call, mpu_call_callback);
+    mpu_on_xxx(L, addr, addr, 3, &self->call, self->mpu->callbacks->call,
+               self->mpu->callbacks->callPages, mpu_call_callback);
 
     return 0;
 }
 
-/* ------------------------------------------------------------------------ */
-
 /**
- * Misc.
+ * Installs a callback to be used when a byte is read from a range of
+ * addresses.
  *
- * @section
- */
-
-/**
- * Disassembles one machine instruction.
+ * This is like calling @{on_read} for each address from `first` to
+ * `last`, only much cheaper: the range is stored once, however large it
+ * is. Use it for devices that occupy a window of memory.
  *
  * Example:
  *
- *    local text, ins_size = mpu:dis(0x603)
- *    print(text)
- *
- *    -- Print the next instruction.
- *    local text = mpu:dis(0x603 + ins_size)
- *    print(text)
+ *    -- Make a 4KB ROM window read as 0xFF.
+ *    mpu:on_read_range(0xc000, 0xcfff, function()
+ *      return 0xff
+ *    end)
  *
- * See @{M6502.utils.dis_range} for an easier function to use.
+ *    -- Remove it.
+ *    mpu:on_read_range(0xc000, 0xcfff, nil)
  *
- * @param addr The instruction's address.
+ * Installing a callback (or __nil__) over part of a range leaves the rest
+ * of the range with its callback.
  *
- * @return The mnemonic assembly code for the instruction.
- * @return The length, in bytes, of the instruction and its operands (this
- *   lets you advance to the next instruction).
+ * @function mpu:on_read_range
  *
- * @function mpu:dis
+ * @param first
+ * @param last
+ * @param fn The function to install. Or __nil__ to clear the callbacks in
+ *   the range. It gets the same arguments as with @{on_read}.
  */
 static int
-l_mpu_dis(lua_State * L)
+l_mpu_on_read_range(lua_State * L)
 {
-    /* input vars */
     LuaMPU *self = SELF(L, 1);
-    uint16_t addr = luaM_checkaddr(L, 2);
-
-    /* output vars */
-    char insn[64];
-    int len;
+    uint16_t first = luaM_checkaddr(L, 2);
+    uint16_t last = luaM_checklast(L, 3, first);
 
-    len = M6502_disassemble(self->mpu, addr, insn);
+    mpu_on_xxx(L, first, last, 4, &self->read, self->mpu->callbacks->read,
+               self->mpu->callbacks->readPages, mpu_read_callback);
 
-    lua_pushstring(L, insn);
-    lua_pushinteger(L, len);
-    return 2;
+    return 0;
 }
 
 /**
- * Returns a string describing the MPU status.
- *
- * The values of the registers (and flags) is included.
- *
- * Example:
+ * Installs a callback to be used when a byte is written to a range of
+ * addresses.
  *
- *    print( mpu:dump() )
+ * See @{on_read_range} and @{on_write}.
  *
- * (If you want to dump a memory range, see @{M6502.utils.dump_range}.)
+ * @function mpu:on_write_range
  *
- * @function mpu:dump
+ * @param first
+ * @param last
+ * @param fn The function to install. Or __nil__ to clear the callbacks in
+ *   the range.
  */
 static int
-l_mpu_dump(lua_State * L)
+l_mpu_on_write_range(lua_State * L)
 {
-    LuaMPU *lmpu = SELF(L, 1);
+    LuaMPU *self = SELF(L, 1);
+    uint16_t first = luaM_checkaddr(L, 2);
+    uint16_t last = luaM_checklast(L, 3, first);
 
-    /* output var */
-    char buf[64];
+    mpu_on_xxx(L, first, last, 4, &self->write, self->mpu->callbacks->write,
+               self->mpu->callbacks->writePages, mpu_write_callback);
 
-    M6502_dump(lmpu->mpu, buf);
-    lua_pushstring(L, buf);
-    return 1;
+    return 0;
 }
 
 /**
- * Makes the MPU start executing instructions.
+ * Installs a callback to be used when an address in a range is called.
  *
- * See @{PC}.
+ * See @{on_read_range} and @{on_call}.
  *
- * The MPU runs till a BRK (`0x00`) instructions is reached. By default the
- * handler for this instruction terminates the program after printing the
- * @{dump|MPU status}.
+ * @function mpu:on_call_range
  *
- * @function mpu:run
+ * @param first
+ * @param last
+ * @param fn The function to install. Or __nil__ to clear the callbacks in
+ *   the range.
  */
 static int
-l_mpu_run(lua_State * L)
-{
-    LuaMPU *lmpu = SELF(L, 1);
-
-    M6502_run(lmpu->mpu);
-    return 0;
-}
-
-static int
-l_mpu_gc(lua_State * L)
+l_mpu_on_call_range(lua_State * L)
 {
     LuaMPU *self = SELF(L, 1);
+    uint16_t first = luaM_checkaddr(L, 2);
+    uint16_t last = luaM_checklast(L, 3, first);
+
+    mpu_on_xxx(L, first, last, 4, &self->call, self->mpu->callbacks->call,
+               self->mpu->callbacks->callPages, mpu_call_callback);
 
-    d_message(("deleting %p\n", self));
-    M6502_delete(self->mpu);
     return 0;
 }
 
 /* ------------------------------------------------------------------------ */
 
-/* *INDENT-OFF* */
-
+/**
+ * Timed events.
+ *
+ * These let you call Lua functions when the @{cycles|clock} reaches a
+ * certain value. It's the way to implement timers and other devices that
+ * work in emulated time. The MPU only checks the clock against the nearest
+ * event, so scheduling events doesn't slow down the emulation.
+ *
+ * Events only fire while the MPU is running (and between instructions).
+ *
+ * @section
+ */
+
+static void
+mpu_event_callback(M6502 * mpu, uint64_t when, void *data, gboolean once)
+{
+    LuaMPU *self = get_mpu_self(mpu);
+    lua_State *L = self->L;
+    int ref = (int) (intptr_t) data;
+
+    d_message(("event at cycle %lu, by ref %d.\n", (unsigned long) when, ref));
+
+    /* Push the function, and the arguments it's to receive: */
+    callbacks__push(L, self, ref);
+    if (once)
+        callbacks__unref(L, 1, ref);
+    lua_pushinteger(L, when);
+    /* Call it: */
+    callbacks__call(L, self, 2, 0);
+}
+
+static void
+mpu_once_callback(M6502 * mpu, uint64_t when, void *data)
+{
+    mpu_event_callback(mpu, when, data, TRUE);
+}
+
+static void
+mpu_every_callback(M6502 * mpu, uint64_t when, void *data)
+{
+    mpu_event_callback(mpu, when, data, FALSE);
+}
+
+static int
+mpu_schedule_xxx(lua_State * L, uint64_t when, uint64_t period, M6502_EventHandler c_handler)
+{
+    LuaMPU *self = SELF(L, 1);
+    int ref;
+
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+
+    lua_pushvalue(L, 3);
+    ref = callbacks__ref(L, 1);
+
+    lua_pushinteger(L, M6502_schedule(self->mpu, when, period, c_handler, (void *) (intptr_t) ref));
+    return 1;
+}
+
+/**
+ * Calls a function when the clock reaches a certain cycle.
+ *
+ * Example:
+ *
+ *    -- Raise a flag one second (at 1MHz) from now.
+ *    mpu:at_cycle(mpu:cycles() + 1000000, function(mpu, cycle)
+ *      mpu:poke(0xd000, 1)
+ *    end)
+ *
+ * If the cycle has already passed, the function is called before the
+ * next instruction executes.
+ *
+ * @param cycle
+ * @param fn The function to call. It gets two arguments: the __mpu__
+ *   object, and the __cycle__ it was scheduled for.
+ *
+ * @return An id you can pass to @{cancel}.
+ *
+ * @function mpu:at_cycle
+ */
+static int
+l_mpu_at_cycle(lua_State * L)
+{
+    lua_Integer when = luaL_checkinteger(L, 2);
+
+    return mpu_schedule_xxx(L, MAX(when, 0), 0, mpu_once_callback);
+}
+
+/**
+ * Calls a function periodically.
+ *
+ * The function is first called `n` cycles from now, and then every `n`
+ * cycles, till you @{cancel} it.
+ *
+ * Example:
+ *
+ *    -- A 60Hz vertical-blank interrupt, at 1MHz.
+ *    mpu:every(1000000 / 60, function(mpu)
+ *      mpu:poke(0xd019, 1)
+ *    end)
+ *
+ * @param n The period, in cycles.
+ * @param fn The function to call. It gets the same arguments as
+ *   with @{at_cycle}.
+ *
+ * @return An id you can pass to @{cancel}.
+ *
+ * @function mpu:every
+ */
+static int
+l_mpu_every(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    lua_Integer period = luaL_checkinteger(L, 2);
+
+    if (period < 1)
+        luaL_error(L, E_("The period must be positive (I got %d)."), (int) period);
+
+    return mpu_schedule_xxx(L, self->mpu->ticks + period, period, mpu_every_callback);
+}
+
+/**
+ * Cancels an event.
+ *
+ * @param id The value returned by @{at_cycle} or @{every}.
+ *
+ * @return __true__ if the event was pending; __false__ if it had already
+ *   fired (or was already cancelled).
+ *
+ * @function mpu:cancel
+ */
+static int
+l_mpu_cancel(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    int id = luaL_checkinteger(L, 2);
+    void *data;
+
+    data = M6502_cancel(self->mpu, id);
+    if (data)
+        callbacks__unref(L, 1, (int) (intptr_t) data);
+
+    lua_pushboolean(L, data != NULL);
+    return 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Dirty tracking.
+ *
+ * If all you want to know is *what* the program wrote to some memory
+ * (e.g., to redraw a screen), there's no need for an @{on_write} callback:
+ * have the MPU note the addresses written to, and collect them once in a
+ * while (e.g., once per frame).
+ *
+ * @section
+ */
+
+static int
+mpu_dirty_write(M6502 * mpu, uint16_t addr, uint8_t data)
+{
+    LuaMPU *self = get_mpu_self(mpu);
+
+    mpu->memory[addr] = data;
+    M6502_invalidate(mpu, addr, 1);
+    self->dirty[addr >> 3] |= 1 << (addr & 7);
+
+    return 0;
+}
+
+/**
+ * Tracks writes to a range of addresses.
+ *
+ * Writes to the range (by the program, or by non-direct pokes) go to
+ * memory as usual, and are noted. Use @{take_dirty} to find what has
+ * changed.
+ *
+ * This replaces any write callbacks in the range (and vice versa:
+ * installing a write callback stops tracking at its address).
+ *
+ * Example:
+ *
+ *    mpu:track_dirty(0x200, 0x5ff)   -- The screen.
+ *    ...
+ *    mpu:run { cycles = 1000000 / 60 }
+ *    for _, range in ipairs(mpu:take_dirty()) do
+ *      redraw(range[1], range[2])
+ *    end
+ *
+ * @param first
+ * @param last
+ * @param[opt] on Boolean. Pass __false__ to stop tracking the range.
+ *
+ * @function mpu:track_dirty
+ */
+static int
+l_mpu_track_dirty(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    uint16_t first = luaM_checkaddr(L, 2);
+    uint16_t last = luaM_checklast(L, 3, first);
+
+    if (lua_isnoneornil(L, 4) || lua_toboolean(L, 4))
+    {
+        if (!self->dirty && !(self->dirty = calloc(0x10000 / 8, 1)))
+            luaL_error(L, E_("out of memory"));
+        mpu_on_write_c(L, self, first, last, mpu_dirty_write);
+    }
+    else
+        mpu_off_write_c(self, first, last, mpu_dirty_write);
+
+    return 0;
+}
+
+static const char *const dirty_names[] = { "ranges", "bytes", NULL };
+
+/**
+ * Returns the addresses written to since the last call, and forgets them.
+ *
+ * @param[opt] what Either "ranges" (the default) or "bytes".
+ *
+ * @return A list of the ranges written to, in address order. Each is a
+ *   table `{ first, last }`, or, if you asked for "bytes", a table
+ *   `{ first, bytes }`, where `bytes` is a string holding the range's
+ *   current contents.
+ *
+ * @function mpu:take_dirty
+ */
+static int
+l_mpu_take_dirty(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    gboolean bytes = luaL_checkoption(L, 2, "ranges", dirty_names) == 1;
+    uint8_t *dirty = self->dirty;
+    unsigned addr = 0;
+    int n = 0;
+
+#define IS_DIRTY(addr)  (dirty[(addr) >> 3] & (1 << ((addr) & 7)))
+
+    lua_newtable(L);
+
+    if (!dirty)
+        return 1;
+
+    while (addr < 0x10000)
+    {
+        unsigned first;
+
+        if (!dirty[addr >> 3])
+        {
+            addr = (addr | 7) + 1;
+            continue;
+        }
+        if (!IS_DIRTY(addr))
+        {
+            addr++;
+            continue;
+        }
+
+        first = addr;
+        while (addr < 0x10000 && IS_DIRTY(addr))
+            addr++;
+
+        lua_createtable(L, 2, 0);
+        lua_pushinteger(L, first);
+        lua_rawseti(L, -2, 1);
+        if (bytes)
+            lua_pushlstring(L, (char *) self->mpu->memory + first, addr - first);
+        else
+            lua_pushinteger(L, addr - 1);
+        lua_rawseti(L, -2, 2);
+        lua_rawseti(L, -2, ++n);
+    }
+
+#undef IS_DIRTY
+
+    memset(dirty, 0, 0x10000 / 8);
+
+    return 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Write queues.
+ *
+ * Many devices only *receive* bytes: a console, a sound latch, some LEDs.
+ * They don't need to be called the moment the program writes to them; it's
+ * enough to hand them, say once per frame, what was written and when. This
+ * is what write queues do, and it's much faster than @{on_write} callbacks.
+ *
+ * @section
+ */
+
+/* 1MB worth of writes. */
+#define QUEUE_DEFAULT_LIMIT  65536
+
+static int
+mpu_queue_write(M6502 * mpu, uint16_t addr, uint8_t data)
+{
+    LuaMPU *self = get_mpu_self(mpu);
+    struct QueuedWrite *w;
+    size_t limit = self->queue.limit ? self->queue.limit : QUEUE_DEFAULT_LIMIT;
+
+    mpu->memory[addr] = data;
+    M6502_invalidate(mpu, addr, 1);
+
+    if (self->queue.count >= limit)
+    {
+        self->queue.lost++;     /* Full. */
+        return 0;
+    }
+    if (self->queue.count == self->queue.size)
+    {
+        size_t size = self->queue.size ? self->queue.size * 2 : 256;
+        struct QueuedWrite *entries;
+
+        if (size > limit)
+            size = limit;
+        entries = realloc(self->queue.entries, size * sizeof *entries);
+
+        if (!entries)
+        {
+            /* We can't raise an error from here. */
+            self->queue.lost++;
+            return 0;
+        }
+        self->queue.entries = entries;
+        self->queue.size = size;
+    }
+
+    w = &self->queue.entries[self->queue.count++];
+    w->cycle = mpu->ticks;
+    w->addr = addr;
+    w->value = data;
+
+    return 0;
+}
+
+/**
+ * Queues the writes to a range of addresses.
+ *
+ * Writes to the range (by the program, or by non-direct pokes) go to
+ * memory as usual, and are recorded, with the cycle they happened at, for
+ * @{drain_writes} to collect.
+ *
+ * All the queued ranges of an MPU share one queue, which holds at most
+ * `size` writes (65536 unless you say otherwise). When it's full, further
+ * writes are still made to memory but aren't recorded: @{drain_writes}
+ * tells how many were lost. So a program that's never drained doesn't eat
+ * up memory.
+ *
+ * This replaces any write callbacks in the range (and vice versa).
+ *
+ * Example:
+ *
+ *    -- A console at 0xf001.
+ *    mpu:queue_writes(0xf001, 0xf001)
+ *    while true do
+ *      mpu:run { cycles = 20000 }
+ *      io.write(mpu:drain_writes("values"))
+ *    end
+ *
+ * @param first
+ * @param last
+ * @param[opt] on Boolean. Pass __false__ to stop queuing writes to the range.
+ * @param[opt] size The most writes the queue may hold.
+ *
+ * @function mpu:queue_writes
+ */
+static int
+l_mpu_queue_writes(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    uint16_t first = luaM_checkaddr(L, 2);
+    uint16_t last = luaM_checklast(L, 3, first);
+
+    if (!lua_isnoneornil(L, 5))
+    {
+        lua_Integer size = luaL_checkinteger(L, 5);
+
+        if (size < 1)
+            luaL_error(L, E_("The queue size must be positive (I got %d)."), (int) size);
+        self->queue.limit = size;
+    }
+
+    if (lua_isnoneornil(L, 4) || lua_toboolean(L, 4))
+        mpu_on_write_c(L, self, first, last, mpu_queue_write);
+    else
+        mpu_off_write_c(self, first, last, mpu_queue_write);
+
+    return 0;
+}
+
+static const char *const drain_names[] = { "list", "values", NULL };
+
+/**
+ * Returns the queued writes, and empties the queue.
+ *
+ * @param[opt] what Either "list" (the default) or "values".
+ *
+ * @return For "list", a flat list holding three numbers per write: the
+ *   cycle, the address and the byte; e.g., `{ 1000, 0xf001, 65, 1012,
+ *   0xf001, 66 }`. For "values", a string with the bytes written (handy
+ *   when there's a single address queued); e.g., `"AB"`.
+ * @return The number of writes dropped since the last call because the
+ *   queue was full (see @{queue_writes}), or memory ran out.
+ *
+ * @function mpu:drain_writes
+ */
+static int
+l_mpu_drain_writes(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    gboolean values = luaL_checkoption(L, 2, "list", drain_names) == 1;
+    size_t count = self->queue.count;
+    size_t i;
+
+    if (values)
+    {
+        luaL_Buffer sb;
+
+        luaL_buffinit(L, &sb);
+        for (i = 0; i < count; i++)
+            luaL_addchar(&sb, self->queue.entries[i].value);
+        luaL_pushresult(&sb);
+    }
+    else
+    {
+        lua_createtable(L, count * 3, 0);
+        for (i = 0; i < count; i++)
+        {
+            struct QueuedWrite *w = &self->queue.entries[i];
+
+            lua_pushinteger(L, w->cycle);
+            lua_rawseti(L, -2, i * 3 + 1);
+            lua_pushinteger(L, w->addr);
+            lua_rawseti(L, -2, i * 3 + 2);
+            lua_pushinteger(L, w->value);
+            lua_rawseti(L, -2, i * 3 + 3);
+        }
+    }
+    lua_pushinteger(L, self->queue.lost);
+
+    self->queue.count = 0;
+    self->queue.lost = 0;
+
+    return 2;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Memory protection.
+ *
+ * @section
+ */
+
+static int
+mpu_ignore_write(M6502 * mpu, uint16_t addr, uint8_t data)
+{
+    (void) addr;
+    (void) data;
+
+    get_mpu_self(mpu)->violations++;
+    return 0;
+}
+
+static const char *const protect_names[] = { "ro", "rw", NULL };
+
+/**
+ * Makes a range of memory read-only (or writable again).
+ *
+ * Writes to a read-only range, by the program or by non-direct pokes,
+ * are ignored (and counted; see @{violations}). Direct pokes still work,
+ * so you can load a ROM image after protecting its range.
+ *
+ * This replaces any write callbacks in the range (and vice versa).
+ *
+ * Example:
+ *
+ *    mpu:protect(0xc000, 0xffff, "ro")
+ *    mpu:pokes(0xc000, rom_image, true)
+ *
+ * @param first
+ * @param last
+ * @param mode Either "ro" or "rw".
+ *
+ * @function mpu:protect
+ */
+static int
+l_mpu_protect(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    uint16_t first = luaM_checkaddr(L, 2);
+    uint16_t last = luaM_checklast(L, 3, first);
+    gboolean ro = luaL_checkoption(L, 4, NULL, protect_names) == 0;
+
+    if (ro)
+        mpu_on_write_c(L, self, first, last, mpu_ignore_write);
+    else
+        mpu_off_write_c(self, first, last, mpu_ignore_write);
+
+    return 0;
+}
+
+/**
+ * Reads/writes the number of writes ignored by @{protect}.
+ *
+ * Example:
+ *
+ *    mpu:violations(0)
+ *    mpu:run { cycles = 100000 }
+ *    if mpu:violations() > 0 then
+ *      print("The program tried to write to ROM.")
+ *    end
+ *
+ * @param[opt] value
+ * @function mpu:violations
+ */
+static int
+l_mpu_violations(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+
+    if (lua_gettop(L) > 1)
+    {
+        self->violations = luaL_checkinteger(L, 2);
+        return 0;
+    }
+    else
+    {
+        lua_pushinteger(L, self->violations);
+        return 1;
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Memory mapping.
+ *
+ * These let you emulate machines with more memory than the 6502 can
+ * address (bank switching), and address decoding that shows the same
+ * memory at several addresses (mirroring).
+ *
+ * The extra memory is a "backing store" you allocate with @{backing}.
+ * Each 6502 page (256 bytes) can be mapped to any page-aligned offset in
+ * it. Switching banks costs a copy of the pages involved, but running
+ * code, whether in mapped memory or not, is as fast as ever.
+ *
+ * Example:
+ *
+ *    -- A 1MB cartridge, switched in 16KB banks at $8000 by writing the
+ *    -- bank number to $DF00.
+ *    mpu:backing(1024 * 1024)
+ *    mpu:backing_pokes(0, cartridge_image)
+ *    mpu:bank_latch(0xdf00, 0x80, 0x40)
+ *    mpu:map(0x80, 0, 0x40)    -- Bank 0, to begin with.
+ *
+ *    -- 2KB of RAM, mirrored 4 times over $0000-$1FFF.
+ *    for i = 1, 3 do
+ *      mpu:mirror(i * 8, 0, 8)
+ *    end
+ *
+ * Mirrored pages are kept in step by a write callback on each of them (in
+ * C, so it's fast), which means you can't have @{on_write} callbacks on
+ * them, and direct pokes only affect the page you poke.
+ *
+ * @section
+ */
+
+static int
+mpu_mirror_write(M6502 * mpu, uint16_t addr, uint8_t data)
+{
+    LuaMPU *self = get_mpu_self(mpu);
+
+    mapper_write(self->mapper, mpu, addr, data);
+    return 0;
+}
+
+/**
+ * Installs (or removes) mpu_mirror_write() on the pages that have become
+ * (or stopped being) mirrors.
+ *
+ * This only touches the C side, so it's safe from within a run. The Lua
+ * callbacks it replaces are left for mpu__release_displaced().
+ */
+static void
+mapper__mirror_pages(LuaMPU * self)
+{
+    int page;
+
+    for (page = 0; page < 0x100; page++)
+    {
+        gboolean aliased = mapper_aliased(self->mapper, page);
+
+        if (aliased && !self->mirrored[page])
+        {
+            M6502_setCallbackRangeIn(self->mpu->callbacks->write, self->mpu->callbacks->writePages,
+                                     page << 8, (page << 8) | 0xff, mpu_mirror_write);
+            self->displaced[page] = 1;
+            self->displacing = TRUE;
+        }
+        else if (!aliased && self->mirrored[page])
+            mpu_off_write_c(self, page << 8, (page << 8) | 0xff, mpu_mirror_write);
+        self->mirrored[page] = aliased;
+    }
+}
+
+static void
+mapper__sync_hooks(lua_State * L, LuaMPU * self)
+{
+    mapper__mirror_pages(self);
+    mpu__release_displaced(L, self);
+}
+
+static int
+mpu_latch_write(M6502 * mpu, uint16_t addr, uint8_t data)
+{
+    LuaMPU *self = get_mpu_self(mpu);
+    struct MapperLatch *latch = mapper_find_latch(self->mapper, addr);
+    long offset = latch->base + (long) data * latch->count * 0x100;
+    int i;
+
+    if (offset + latch->count * 0x100 > (long) self->mapper->size)
+        return 0;               /* No such bank. */
+
+    for (i = 0; i < latch->count; i++)
+        mapper_map(self->mapper, mpu, latch->page + i, offset + i * 0x100);
+    mapper__mirror_pages(self);       /* We're inside a run: no Lua work here. */
+
+    return 0;
+}
+
+static Mapper *
+mapper__get(lua_State * L, LuaMPU * self)
+{
+    if (!self->mapper && !(self->mapper = mapper_new()))
+        luaL_error(L, E_("out of memory"));
+    return self->mapper;
+}
+
+static int
+luaM_checkpages(lua_State * L, int page_idx, int count_idx, int *count)
+{
+    int page = luaL_checkinteger(L, page_idx);
+
+    *count = luaL_optinteger(L, count_idx, 1);
+    if (page < 0 || *count < 1 || page + *count > 0x100)
+        luaL_error(L, E_("pages out of range (should be within [0, 0xff], but I got %d pages from %d)."),
+                   *count, page);
+    return page;
+}
+
+static long
+luaM_checkbank(lua_State * L, int idx, Mapper * m, int count)
+{
+    lua_Integer offset = luaL_checkinteger(L, idx);
+
+    if (offset < 0 || offset % 0x100 != 0 || offset + count * 0x100 > (lua_Integer) m->size)
+        luaL_error(L, E_("Bad offset in the backing store (I got %d; the store has %d bytes, and offsets must be multiples of 256)."),
+                   (int) offset, (int) m->size);
+    return offset;
+}
+
+/**
+ * Reads/resizes the backing store.
+ *
+ * @param[opt] size In bytes; a multiple of 256. Pages mapped past the new
+ *   end become plain memory.
+ *
+ * @function mpu:backing
+ */
+static int
+l_mpu_backing(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    Mapper *m = mapper__get(L, self);
+
+    if (lua_gettop(L) > 1)
+    {
+        lua_Integer size = luaL_checkinteger(L, 2);
+
+        if (size < 0 || size % 0x100 != 0)
+            luaL_error(L, E_("The size must be a multiple of 256 (I got %d)."), (int) size);
+        if (m->borrowed)
+            luaL_error(L, E_("The backing store is part of the memory file: it can't be resized."));
+        if (!mapper_resize(m, self->mpu, size))
+            luaL_error(L, E_("out of memory"));
+        return 0;
+    }
+    else
+    {
+        lua_pushinteger(L, m->size);
+        return 1;
+    }
+}
+
+/**
+ * Reads bytes from the backing store.
+ *
+ * @param offset
+ * @param len
+ *
+ * @function mpu:backing_peeks
+ */
+static int
+l_mpu_backing_peeks(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    Mapper *m = mapper__get(L, self);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    lua_Integer len = luaL_checkinteger(L, 3);
+
+    if (offset < 0 || len < 0 || offset + len > (lua_Integer) m->size)
+        luaL_error(L, E_("Out of the backing store."));
+
+    mapper_sync(m, self->mpu);
+    lua_pushlstring(L, (char *) m->store + offset, len);
+    return 1;
+}
+
+/**
+ * Writes bytes to the backing store.
+ *
+ * Pages mapped to the bytes written see them at once.
+ *
+ * @param offset
+ * @param bytes A string.
+ *
+ * @function mpu:backing_pokes
+ */
+static int
+l_mpu_backing_pokes(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    Mapper *m = mapper__get(L, self);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    size_t len;
+    const char *s = luaL_checklstring(L, 3, &len);
+
+    if (offset < 0 || offset + (lua_Integer) len > (lua_Integer) m->size)
+        luaL_error(L, E_("Out of the backing store."));
+
+    mapper_sync(m, self->mpu);
+    memcpy(m->store + offset, s, len);
+    mapper_refresh(m, self->mpu, offset, len);
+    return 0;
+}
+
+/**
+ * Maps pages to the backing store.
+ *
+ * The current contents of a page that's already mapped are written back
+ * to the store first. If another page is mapped to the same offset, the
+ * two become mirrors.
+ *
+ * @param page The first page (e.g., 0x80 for $8000).
+ * @param offset The offset in the backing store (a multiple of 256). Or
+ *   __nil__ to turn the pages back into plain memory (keeping their
+ *   contents).
+ * @param[opt] count How many pages. Defaults to 1.
+ *
+ * @function mpu:map
+ */
+static int
+l_mpu_map(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    Mapper *m = mapper__get(L, self);
+    int count;
+    int page = luaM_checkpages(L, 2, 4, &count);
+    long offset = lua_isnoneornil(L, 3) ? -1 : luaM_checkbank(L, 3, m, count);
+    int i;
+
+    for (i = 0; i < count; i++)
+        mapper_map(m, self->mpu, page + i, offset < 0 ? -1 : offset + i * 0x100);
+    mapper__sync_hooks(L, self);
+
+    return 0;
+}
+
+/**
+ * Makes pages mirror other pages.
+ *
+ * @param page The first page.
+ * @param of The first page to mirror. Or __nil__ to stop mirroring.
+ * @param[opt] count How many pages. Defaults to 1.
+ *
+ * @function mpu:mirror
+ */
+static int
+l_mpu_mirror(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    Mapper *m = mapper__get(L, self);
+    int count;
+    int page = luaM_checkpages(L, 2, 4, &count);
+    int of = -1;
+    int i;
+
+    if (!lua_isnoneornil(L, 3))
+        of = luaM_checkpages(L, 3, 4, &count);
+
+    for (i = 0; i < count; i++)
+        mapper_mirror(m, self->mpu, page + i, of < 0 ? -1 : of + i);
+    mapper__sync_hooks(L, self);
+
+    return 0;
+}
+
+/**
+ * Installs a bank-switching latch.
+ *
+ * Writing a byte N to `addr` maps `count` pages, starting at `page`, to
+ * the bank at offset `base + N * count * 256` in the backing store (as
+ * with @{map}). Writes selecting banks past the end of the store are
+ * ignored. The latch isn't memory: the byte isn't stored.
+ *
+ * @param addr
+ * @param page The first page. Or __nil__ to remove the latch.
+ * @param count How many pages.
+ * @param[opt] base Defaults to 0.
+ *
+ * @function mpu:bank_latch
+ */
+static int
+l_mpu_bank_latch(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    Mapper *m = mapper__get(L, self);
+    uint16_t addr = luaM_checkaddr(L, 2);
+
+    if (lua_isnoneornil(L, 3))
+    {
+        mapper_set_latch(m, addr, -1, 0, 0);
+        mpu_off_write_c(self, addr, addr, mpu_latch_write);
+    }
+    else
+    {
+        int count;
+        int page = luaM_checkpages(L, 3, 4, &count);
+        lua_Integer base = luaL_optinteger(L, 5, 0);
+
+        if (base < 0 || base % 0x100 != 0)
+            luaL_error(L, E_("The base must be a multiple of 256 (I got %d)."), (int) base);
+        if (!mapper_set_latch(m, addr, page, count, base))
+            luaL_error(L, E_("out of memory"));
+        mpu_on_write_c(L, self, addr, addr, mpu_latch_write);
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Native devices.
+ *
+ * Devices written in C, by separate Lua modules, can be attached directly
+ * to address ranges. The MPU then calls them without going through Lua at
+ * all, so they cost about as little as plain memory.
+ *
+ * Such a module includes `m6502_device.h` (which comes with this library;
+ * LuaRocks installs it in the `conf` directory under the rock's directory,
+ * which `luarocks show --rock-dir lua-M6502` prints) and hands out userdata starting with an `M6502_Device` structure. This
+ * structure has pointers to the functions that handle reads and writes,
+ * and optionally a function to call periodically (e.g., for a timer
+ * that raises interrupts).
+ *
+ * Example:
+ *
+ *    local via = require('my_devices').via()
+ *    mpu:attach(via, 0x9000, 0x900f)
+ *
+ * A device can be attached at several places, and even to several MPUs.
+ *
+ * @section
+ */
+
+static int
+mpu_device_read(M6502 * mpu, uint16_t addr, uint8_t data)
+{
+    M6502_Device *dev = hookset_find(&get_mpu_self(mpu)->devices, addr)->data;
+
+    (void) data;
+    return dev->read(dev->state, addr);
+}
+
+static int
+mpu_device_write(M6502 * mpu, uint16_t addr, uint8_t data)
+{
+    M6502_Device *dev = hookset_find(&get_mpu_self(mpu)->devices, addr)->data;
+
+    dev->write(dev->state, addr, data);
+    return 0;
+}
+
+static void
+mpu_device_tick(M6502 * mpu, uint64_t when, void *data)
+{
+    M6502_Device *dev = data;
+    int irqs = dev->tick(dev->state, when);
+
+    if (irqs & M6502_DEVICE_NMI)
+        M6502_nmi(mpu);
+    if (irqs & M6502_DEVICE_IRQ)
+        M6502_irq(mpu);
+}
+
+static gboolean
+devices__has(LuaMPU * self, M6502_Device * dev)
+{
+    int i;
+
+    for (i = 0; i < self->devices.count; i++)
+        if (self->devices.ranges[i].data == dev)
+            return TRUE;
+    return FALSE;
+}
+
+/**
+ * Returns the lowest address a device is attached at. This is how
+ * snapshots refer to it.
+ */
+static uint16_t
+devices__first_addr(LuaMPU * self, M6502_Device * dev)
+{
+    int i;
+
+    for (i = 0; i < self->devices.count; i++)
+        if (self->devices.ranges[i].data == dev)
+            return self->devices.ranges[i].first;
+    return 0;
+}
+
+static gboolean
+devices__ticking(LuaMPU * self, M6502_Device * dev)
+{
+    int i;
+
+    for (i = 0; i < self->nticking; i++)
+        if (self->ticking[i].device == dev)
+            return TRUE;
+    return FALSE;
+}
+
+static void
+devices__add_tick(lua_State * L, LuaMPU * self, M6502_Device * dev, int event)
+{
+    void *p = realloc(self->ticking, (self->nticking + 1) * sizeof *self->ticking);
+
+    if (!p)
+    {
+        M6502_cancel(self->mpu, event);
+        luaL_error(L, E_("out of memory"));
+    }
+    self->ticking = p;
+    self->ticking[self->nticking].device = dev;
+    self->ticking[self->nticking++].event = event;
+}
+
+/**
+ * Schedules the ticks of newly attached devices, and cancels those of
+ * devices no longer attached (before their userdata may be collected).
+ */
+static void
+devices__sync_ticks(lua_State * L, LuaMPU * self, M6502_Device * added)
+{
+    int i;
+
+    for (i = 0; i < self->nticking; i++)
+    {
+        if (self->ticking[i].device == added)
+            added = NULL;       /* Already ticking. */
+        else if (!devices__has(self, self->ticking[i].device))
+        {
+            M6502_cancel(self->mpu, self->ticking[i].event);
+            self->ticking[i--] = self->ticking[--self->nticking];
+        }
+    }
+
+    if (added && added->tick && added->period)
+        devices__add_tick(L, self, added,
+                          M6502_schedule(self->mpu, self->mpu->ticks + added->period, added->period,
+                                         mpu_device_tick, added));
+}
+
+/* Whether the device at 'addr', if any, has lost all its handlers there. */
+static gboolean
+devices__displaced(LuaMPU * self, unsigned addr)
+{
+    M6502_Callbacks *cb = self->mpu->callbacks;
+    const struct HookRange *r = hookset_find(&self->devices, addr);
+    M6502_Device *dev = r ? r->data : NULL;
+
+    if (!dev || (!dev->read && !dev->write))
+        return FALSE;           /* Nothing to lose. */
+    return !(dev->read && M6502_pageHooked(cb->readPages, addr)
+             && M6502_callbackAt(cb->read, addr) == mpu_device_read)
+        && !(dev->write && M6502_pageHooked(cb->writePages, addr)
+             && M6502_callbackAt(cb->write, addr) == mpu_device_write);
+}
+
+/**
+ * Detaches devices from the addresses in [first, last] where other
+ * handlers (callbacks, protect(), ...) have replaced theirs, and cancels
+ * the ticks of those no longer attached anywhere. A device handling both
+ * reads and writes stays where either handler is still its own.
+ */
+static void
+devices__prune(lua_State * L, LuaMPU * self, uint16_t first, uint16_t last)
+{
+    unsigned addr;
+    gboolean pruned = FALSE;
+
+    if (!self->devices.count)
+        return;
+
+    lua_getuservalue(L, 1);
+    for (addr = first; addr <= last; addr++)
+        if (devices__displaced(self, addr))
+        {
+            unsigned end = addr;
+
+            while (end < last && devices__displaced(self, end + 1))
+                end++;
+            hookset_assign(L, -1, &self->devices, addr, end, 0, NULL);
+            addr = end;
+            pruned = TRUE;
+        }
+    lua_pop(L, 1);
+
+    if (pruned)
+        devices__sync_ticks(L, self, NULL);
+}
+
+static M6502_Device *
+luaM_checkdevice(lua_State * L, int idx)
+{
+    M6502_Device *dev = lua_touserdata(L, idx);
+
+    if (lua_type(L, idx) != LUA_TUSERDATA || lua_rawlen(L, idx) < sizeof(M6502_Device)
+        || dev->magic != M6502_DEVICE_MAGIC)
+        luaL_typerror(L, idx, "device");
+    if (dev->version > M6502_DEVICE_VERSION)
+        luaL_error(L, E_("The device '%s' needs a newer version of this library (it's for version %d; we're version %d)."),
+                   dev->name ? dev->name : "?", (int) dev->version, M6502_DEVICE_VERSION);
+    return dev;
+}
+
+static void
+mpu_attach_xxx(lua_State * L, LuaMPU * self, uint16_t first, uint16_t last, M6502_Device * dev, int ref)
+{
+    lua_getuservalue(L, 1);
+    hookset_assign(L, -1, &self->devices, first, last, ref, dev);
+    lua_pop(L, 1);
+
+    if (dev && dev->read)
+        mpu_on_read_c(L, self, first, last, mpu_device_read);
+    else
+        mpu_off_read_c(self, first, last, mpu_device_read);
+
+    if (dev && dev->write)
+        mpu_on_write_c(L, self, first, last, mpu_device_write);
+    else
+        mpu_off_write_c(self, first, last, mpu_device_write);
+
+    devices__sync_ticks(L, self, dev);
+}
+
+/**
+ * Attaches a native device to a range of addresses.
+ *
+ * Reads and writes in the range go to the device instead of to memory
+ * (except for those the device doesn't handle). This replaces any
+ * @{on_read}/@{on_write} callbacks, and any device previously attached, in
+ * the range (and vice versa: installing callbacks there later overrides
+ * the device, which is detached from wherever none of its handlers is
+ * left).
+ *
+ * If the device ticks, it starts ticking now, and stops when it's no
+ * longer attached anywhere on this MPU.
+ *
+ * Direct peeks and pokes still access memory.
+ *
+ * @param device A device, as created by some native module.
+ * @param first
+ * @param last
+ *
+ * @function mpu:attach
+ */
+static int
+l_mpu_attach(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    M6502_Device *dev = luaM_checkdevice(L, 2);
+    uint16_t first = luaM_checkaddr(L, 3);
+    uint16_t last = luaM_checklast(L, 4, first);
+    int ref;
+
+    lua_pushvalue(L, 2);
+    ref = callbacks__ref(L, 1);
+
+    mpu_attach_xxx(L, self, first, last, dev, ref);
+    return 0;
+}
+
+/**
+ * Detaches the devices from a range of addresses.
+ *
+ * @param first
+ * @param last
+ *
+ * @function mpu:detach
+ */
+static int
+l_mpu_detach(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    uint16_t first = luaM_checkaddr(L, 2);
+    uint16_t last = luaM_checklast(L, 3, first);
+
+    mpu_attach_xxx(L, self, first, last, NULL, 0);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Snapshots.
+ *
+ * You can save the state of an MPU into a string, and restore it later:
+ *
+ *    local blob = mpu:save()
+ *    for _, test in ipairs(tests) do
+ *      test(mpu)
+ *      mpu:restore(blob)
+ *    end
+ *
+ * A snapshot holds the registers, the clock, memory, the protected
+ * ranges (and the violations count), the memory mapping (including the
+ * backing store and the bank latches), and the pending timed events.
+ *
+ * It doesn't hold Lua callbacks or devices: these are wiring, not state,
+ * and stay as they are. Timed events are an exception, as they come and
+ * go as the MPU runs: those pending at the MPU's latest save() are brought
+ * back by restore(), with their functions. (So, restoring an older
+ * snapshot, or one saved by another MPU, be it in this process or in
+ * another, skips any event whose function isn't known.) Device ticks are restored for the devices attached where
+ * they were (a device is known by the lowest address it's attached at).
+ *
+ * Restoring only copies the memory pages that have changed, so it's fast
+ * when a run touches little memory.
+ *
+ * The format is versioned, and independent of the machine's endianness.
+ *
+ * @section
+ */
+
+#define SNAPSHOT_MAGIC    "M6502\032"
+#define SNAPSHOT_VERSION  3
+
+enum { SNAP_ONCE, SNAP_EVERY, SNAP_TICK };
+
+/* The sizes of the fixed part and of the records. */
+#define SNAP_HEADER_SIZE   (6 + 2 + 8)
+#define SNAP_REGS_SIZE     (5 + 2 + 8 + 1)
+#define SNAP_RANGE_SIZE    (2 + 2)
+#define SNAP_LATCH_SIZE    (2 + 1 + 2 + 8)
+#define SNAP_EVENT_SIZE    (4 + 8 + 8 + 1 + 8)
+#define SNAP_MAPPER_SIZE   (8 + 0x100 * 8 + 0x100 + 4)
+
+/* The key of the functions of events pending at the latest save(), in the callbacks table. */
+#define SAVED_EVENTS_KEY  "saved_events"
+
+static uint8_t *
+snap__put(uint8_t * p, uint64_t value, int nbytes)
+{
+    while (nbytes--)
+    {
+        *p++ = value & 0xff;
+        value >>= 8;
+    }
+    return p;
+}
+
+typedef struct
+{
+    lua_State *L;
+    const uint8_t *p, *end;
+} SnapReader;
+
+static const uint8_t *
+snap__take(SnapReader * r, size_t len)
+{
+    if ((size_t) (r->end - r->p) < len)
+        luaL_error(r->L, E_("The snapshot is truncated."));
+    r->p += len;
+    return r->p - len;
+}
+
+static uint64_t
+snap__get(SnapReader * r, int nbytes)
+{
+    const uint8_t *p = snap__take(r, nbytes);
+    uint64_t value = 0;
+
+    while (nbytes--)
+        value = value << 8 | p[nbytes];
+    return value;
+}
+
+/**
+ * Finds the runs of addresses having a certain write handler. Writes them
+ * at 'p', if not NULL, and returns their number.
+ */
+static int
+snap__runs(LuaMPU * self, M6502_Callback handler, uint8_t ** p)
+{
+    M6502_Callbacks *cb = self->mpu->callbacks;
+    unsigned addr = 0;
+    int count = 0;
+
+#define HANDLER_AT(addr) \
+    (M6502_pageHooked(cb->writePages, addr) ? M6502_callbackAt(cb->write, addr) : NULL)
+
+    while (addr < 0x10000)
+    {
+        unsigned end = addr;
+
+        if (!M6502_pageHooked(cb->writePages, addr))
+        {
+            addr = (addr | 0xff) + 1;
+            continue;
+        }
+        if (HANDLER_AT(addr) != handler)
+        {
+            addr++;
+            continue;
+        }
+        while (end < 0xffff && HANDLER_AT(end + 1) == handler)
+            end++;
+        if (p)
+        {
+            *p = snap__put(*p, addr, 2);
+            *p = snap__put(*p, end, 2);
+        }
+        count++;
+        addr = end + 1;
+    }
+
+#undef HANDLER_AT
+
+    return count;
+}
+
+/**
+ * Checks that the mapping in a snapshot won't lead us astray.
+ */
+static void
+snap__check_mapping(SnapReader * r, size_t size, const uint8_t * map, const uint8_t * alias,
+                    const uint8_t * latches, int nlatches)
+{
+    SnapReader rr = *r;
+    int i, j;
+
+    rr.p = map;
+    for (i = 0; i < 0x100; i++)
+    {
+        int64_t offset = (int64_t) snap__get(&rr, 8);
+
+        if (offset != -1 && (offset < 0 || offset % 0x100 != 0 || offset + 0x100 > (int64_t) size))
+            luaL_error(r->L, E_("The snapshot is corrupt (bad mapping)."));
+    }
+
+    /* Each page must be in a ring. */
+    for (i = 0; i < 0x100; i++)
+    {
+        int page = alias[i];
+
+        for (j = 0; page != i && j < 0x100; j++)
+            page = alias[page];
+        if (page != i)
+            luaL_error(r->L, E_("The snapshot is corrupt (bad mirroring)."));
+    }
+
+    rr.p = latches;
+    for (i = 0; i < nlatches; i++)
+    {
+        int page, count;
+
+        snap__get(&rr, 2);
+        page = snap__get(&rr, 1);
+        count = snap__get(&rr, 2);
+        if (count < 1 || page + count > 0x100 || (int64_t) snap__get(&rr, 8) < 0)
+            luaL_error(r->L, E_("The snapshot is corrupt (bad bank latch)."));
+    }
+}
+
+static int
+snap__event_kind(const M6502_Event * e)
+{
+    if (e->handler == mpu_once_callback)
+        return SNAP_ONCE;
+    if (e->handler == mpu_every_callback)
+        return SNAP_EVERY;
+    return SNAP_TICK;
+}
+
+/**
+ * Saves the state of the MPU.
+ *
+ * @return A string.
+ *
+ * @function mpu:save
+ */
+static int
+l_mpu_save(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    M6502 *mpu = self->mpu;
+    Mapper *m = self->mapper;
+    int nprotected = snap__runs(self, mpu_ignore_write, NULL);
+    size_t size;
+    uint8_t *blob, *p;
+    int i;
+
+    size = SNAP_HEADER_SIZE + SNAP_REGS_SIZE + 0x10000 + 8
+        + 4 + nprotected * SNAP_RANGE_SIZE
+        + 1 + (m ? SNAP_MAPPER_SIZE + m->size + m->nlatches * SNAP_LATCH_SIZE : 0)
+        + 4 + 4 + mpu->nevents * SNAP_EVENT_SIZE;
+
+    p = blob = lua_newuserdata(L, size);
+
+    memcpy(p, SNAPSHOT_MAGIC, 6);
+    p = snap__put(p + 6, SNAPSHOT_VERSION, 2);
+    p = snap__put(p, self->serial, 8);
+
+    p = snap__put(p, mpu->registers->a, 1);
+    p = snap__put(p, mpu->registers->x, 1);
+    p = snap__put(p, mpu->registers->y, 1);
+    p = snap__put(p, mpu->registers->p, 1);
+    p = snap__put(p, mpu->registers->s, 1);
+    p = snap__put(p, mpu->registers->pc, 2);
+    p = snap__put(p, mpu->ticks, 8);
+    p = snap__put(p, mpu->waiting, 1);
+
+    memcpy(p, mpu->memory, 0x10000);
+    p += 0x10000;
+
+    p = snap__put(p, self->violations, 8);
+    p = snap__put(p, nprotected, 4);
+    snap__runs(self, mpu_ignore_write, &p);
+
+    p = snap__put(p, m != NULL, 1);
+    if (m)
+    {
+        p = snap__put(p, m->size, 8);
+        memcpy(p, m->store, m->size);
+        p += m->size;
+        for (i = 0; i < 0x100; i++)
+            p = snap__put(p, m->map[i], 8);
+        memcpy(p, m->alias, 0x100);
+        p += 0x100;
+        p = snap__put(p, m->nlatches, 4);
+        for (i = 0; i < m->nlatches; i++)
+        {
+            p = snap__put(p, m->latches[i].addr, 2);
+            p = snap__put(p, m->latches[i].page, 1);
+            p = snap__put(p, m->latches[i].count, 2);
+            p = snap__put(p, m->latches[i].base, 8);
+        }
+    }
+
+    /* We keep the functions of the events, for restore(). */
+    lua_getuservalue(L, 1);
+    lua_newtable(L);
+
+    p = snap__put(p, mpu->lastEvent, 4);
+    p = snap__put(p, mpu->nevents, 4);
+    for (i = 0; i < mpu->nevents; i++)
+    {
+        const M6502_Event *e = &mpu->events[i];
+        int kind = snap__event_kind(e);
+
+        p = snap__put(p, e->id, 4);
+        p = snap__put(p, e->when, 8);
+        p = snap__put(p, e->period, 8);
+        p = snap__put(p, kind, 1);
+        p = snap__put(p, kind == SNAP_TICK ? devices__first_addr(self, e->data) : 0, 8);
+
+        if (kind != SNAP_TICK)
+        {
+            lua_rawgeti(L, -2, (int) (intptr_t) e->data);
+            lua_rawseti(L, -2, e->id);
+        }
+    }
+
+    lua_setfield(L, -2, SAVED_EVENTS_KEY);
+    lua_pop(L, 1);
+
+    assert((size_t) (p - blob) == size);
+
+    lua_pushlstring(L, (const char *) blob, size);
+    return 1;
+}
+
+/**
+ * Restores a state saved by @{save}.
+ *
+ * The snapshot may come from another MPU (but see the notes about timed
+ * events, above).
+ *
+ * @param blob A string returned by @{save}.
+ *
+ * @function mpu:restore
+ */
+static int
+l_mpu_restore(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+    M6502 *mpu = self->mpu;
+    size_t len;
+    SnapReader r;
+    const uint8_t *regs, *memory, *protected, *events;
+    const uint8_t *store = NULL, *map = NULL, *alias = NULL, *latches = NULL;
+    size_t mapper_size = 0;
+    int nprotected, nlatches = 0, nevents, last_event, i;
+    uint64_t serial;
+    lua_Integer violations;
+    Mapper *m = NULL;
+
+    r.L = L;
+    r.p = (const uint8_t *) luaL_checklstring(L, 2, &len);
+    r.end = r.p + len;
+
+    /*
+     * First we parse (and check) the whole snapshot. Only then do we touch
+     * the MPU, so a bad snapshot leaves it as it was.
+     */
+
+    if (len < 8 || memcmp(r.p, SNAPSHOT_MAGIC, 6) != 0)
+        return luaL_error(L, E_("This isn't an MPU snapshot."));
+    r.p += 6;
+    if (snap__get(&r, 2) != SNAPSHOT_VERSION)
+        return luaL_error(L, E_("Unsupported snapshot version (I support version %d)."), SNAPSHOT_VERSION);
+    serial = snap__get(&r, 8);
+
+    regs = snap__take(&r, SNAP_REGS_SIZE);
+    memory = snap__take(&r, 0x10000);
+    violations = snap__get(&r, 8);
+    nprotected = snap__get(&r, 4);
+    protected = snap__take(&r, (size_t) nprotected * SNAP_RANGE_SIZE);
+
+    if (snap__get(&r, 1))
+    {
+        mapper_size = snap__get(&r, 8);
+        store = snap__take(&r, mapper_size);
+        map = snap__take(&r, 0x100 * 8);
+        alias = snap__take(&r, 0x100);
+        nlatches = snap__get(&r, 4);
+        latches = snap__take(&r, (size_t) nlatches * SNAP_LATCH_SIZE);
+        snap__check_mapping(&r, mapper_size, map, alias, latches, nlatches);
+    }
+
+    last_event = snap__get(&r, 4);
+    nevents = snap__get(&r, 4);
+    events = snap__take(&r, (size_t) nevents * SNAP_EVENT_SIZE);
+
+    if (r.p != r.end)
+        return luaL_error(L, E_("The snapshot has trailing garbage."));
+
+    if (store)
+    {
+        if (!(m = mapper_new()) || (mapper_size && !(m->store = malloc(mapper_size))))
+        {
+            mapper_free(m);
+            return luaL_error(L, E_("out of memory"));
+        }
+        memcpy(m->store, store, mapper_size);
+        m->size = mapper_size;
+        r.p = map;
+        for (i = 0; i < 0x100; i++)
+            m->map[i] = (long) (int64_t) snap__get(&r, 8);
+        memcpy(m->alias, alias, 0x100);
+        r.p = latches;
+        for (i = 0; i < nlatches; i++)
+        {
+            uint16_t addr = snap__get(&r, 2);
+            int page = snap__get(&r, 1);
+            int count = snap__get(&r, 2);
+            long base = (long) (int64_t) snap__get(&r, 8);
+
+            if (!mapper_set_latch(m, addr, page, count, base))
+            {
+                mapper_free(m);
+                return luaL_error(L, E_("out of memory"));
+            }
+        }
+    }
+
+    /*
+     * Registers, clock and memory.
+     */
+
+    r.p = regs;
+    mpu->registers->a = snap__get(&r, 1);
+    mpu->registers->x = snap__get(&r, 1);
+    mpu->registers->y = snap__get(&r, 1);
+    mpu->registers->p = snap__get(&r, 1);
+    mpu->registers->s = snap__get(&r, 1);
+    mpu->registers->pc = snap__get(&r, 2);
+    mpu->ticks = snap__get(&r, 8);
+    mpu->waiting = snap__get(&r, 1);
+
+    for (i = 0; i < 0x10000; i += 0x100)
+    {
+        if (memcmp(mpu->memory + i, memory + i, 0x100) != 0)
+        {
+            memcpy(mpu->memory + i, memory + i, 0x100);
+            M6502_invalidate(mpu, i, 0x100);
+        }
+    }
+
+    /*
+     * Protection.
+     */
+
+    self->violations = violations;
+    mpu_off_write_c(self, 0, 0xffff, mpu_ignore_write);
+    r.p = protected;
+    for (i = 0; i < nprotected; i++)
+    {
+        uint16_t first = snap__get(&r, 2);
+        uint16_t last = snap__get(&r, 2);
+
+        mpu_on_write_c(L, self, first, MAX(first, last), mpu_ignore_write);
+    }
+
+    /*
+     * Mapping.
+     */
+
+    if (self->mapper || m)
+    {
+        if (self->mapper)
+        {
+            for (i = 0; i < self->mapper->nlatches; i++)
+                mpu_off_write_c(self, self->mapper->latches[i].addr, self->mapper->latches[i].addr,
+                                mpu_latch_write);
+            if (m && self->mapper->borrowed && self->mapper->size == m->size)
+            {
+                /* We keep the store in the memory file. */
+                memcpy(self->mapper->store, m->store, m->size);
+                free(m->store);
+                m->store = self->mapper->store;
+                m->borrowed = TRUE;
+            }
+            mapper_free(self->mapper);
+        }
+        self->mapper = m;
+        mapper__get(L, self);   /* We need one to undo the mirroring, if the snapshot has none. */
+        for (i = 0; i < self->mapper->nlatches; i++)
+            mpu_on_write_c(L, self, self->mapper->latches[i].addr, self->mapper->latches[i].addr,
+                           mpu_latch_write);
+        mapper__sync_hooks(L, self);
+    }
+
+    /*
+     * Timed events.
+     */
+
+    while (mpu->nevents)
+    {
+        M6502_Event e = mpu->events[0];
+
+        M6502_cancel(mpu, e.id);
+        if (snap__event_kind(&e) != SNAP_TICK)
+            callbacks__unref(L, 1, (int) (intptr_t) e.data);
+    }
+    self->nticking = 0;
+
+    lua_getuservalue(L, 1);
+    lua_getfield(L, -1, SAVED_EVENTS_KEY);
+    r.p = events;
+    for (i = 0; i < nevents; i++)
+    {
+        int id = snap__get(&r, 4);
+        uint64_t when = snap__get(&r, 8);
+        uint64_t period = snap__get(&r, 8);
+        int kind = snap__get(&r, 1);
+        uint64_t dev_addr = snap__get(&r, 8);
+
+        if (kind == SNAP_TICK)
+        {
+            const struct HookRange *dr = dev_addr <= 0xffff ? hookset_find(&self->devices, dev_addr) : NULL;
+            M6502_Device *dev = dr ? dr->data : NULL;
+
+            if (dev && dev->tick && dev->period && !devices__ticking(self, dev))
+                devices__add_tick(L, self, dev, M6502_scheduleAs(mpu, id, when, period, mpu_device_tick, dev));
+        }
+        else if (serial == self->serial && lua_istable(L, -1))
+        {
+            lua_rawgeti(L, -1, id);
+            if (!lua_isnil(L, -1))
+            {
+                int ref = callbacks__ref(L, 1);
+
+                M6502_scheduleAs(mpu, id, when, period,
+                                 kind == SNAP_ONCE ? mpu_once_callback : mpu_every_callback,
+                                 (void *) (intptr_t) ref);
+            }
+            else
+                lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 2);
+    mpu->lastEvent = MAX(mpu->lastEvent, last_event);
+
+    /* Devices attached since the save start ticking anew. */
+    for (i = 0; i < self->devices.count; i++)
+        devices__sync_ticks(L, self, self->devices.ranges[i].data);
+
+    return 0;
+}
+
+/**
+ * Puts the MPU at 'to_idx' in the same state as the one at 'from_idx',
+ * with the same callbacks and devices. The ones it had are dropped.
+ *
+ * That MPU must own its memory: we'd otherwise overwrite another MPU's,
+ * or a file's.
+ */
+static void
+mpu__copy(lua_State * L, int to_idx, int from_idx)
+{
+    LuaMPU *to, *from;
+    gboolean ok;
+
+    to_idx = lua_absindex(L, to_idx);
+    from_idx = lua_absindex(L, from_idx);
+    to = SELF(L, to_idx);
+    from = SELF(L, from_idx);
+
+    if (to->mpu->sharer || to->memfile)
+        luaL_error(L, E_("Can't copy into an MPU whose memory isn't its own."));
+
+    /* A copy of the callbacks table, so all the refs are valid in it. */
+    lua_newtable(L);
+    lua_getuservalue(L, from_idx);
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -5);
+    }
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_setfield(L, -2, SAVED_EVENTS_KEY);      /* These are for the other MPU's snapshots. */
+    lua_pushnil(L);
+    lua_setfield(L, -2, MEMORY_OWNER_KEY);      /* Our memory is our own. */
+    lua_pushnil(L);
+    lua_setfield(L, -2, POOL_KEY);              /* The caller decides. */
+    lua_setuservalue(L, to_idx);
+
+    M6502_copy(to->mpu, from->mpu);
+
+    to->violations = from->violations;
+    memcpy(to->mirrored, from->mirrored, sizeof to->mirrored);
+    memcpy(to->displaced, from->displaced, sizeof to->displaced);
+    to->displacing = from->displacing;
+
+    hookset_free(&to->read);
+    hookset_free(&to->write);
+    hookset_free(&to->call);
+    hookset_free(&to->devices);
+    mapper_free(to->mapper);
+    to->mapper = NULL;
+    to->queue.count = 0;
+    to->nticking = 0;
+
+    /* Everything else is only allocated by need, and so is the copy. */
+
+    ok = hookset_copy(&to->read, &from->read)
+        && hookset_copy(&to->write, &from->write)
+        && hookset_copy(&to->call, &from->call)
+        && hookset_copy(&to->devices, &from->devices);
+
+    if (!from->dirty)
+    {
+        free(to->dirty);
+        to->dirty = NULL;
+    }
+    else if (ok && (to->dirty || (ok = (to->dirty = malloc(0x10000 / 8)) != NULL)))
+        memcpy(to->dirty, from->dirty, 0x10000 / 8);
+
+    if (ok && to->queue.size < from->queue.count)
+    {
+        void *p = realloc(to->queue.entries, from->queue.count * sizeof *from->queue.entries);
+
+        if ((ok = p != NULL))
+        {
+            to->queue.entries = p;
+            to->queue.size = from->queue.count;
+        }
+    }
+    if (ok && from->queue.count)
+    {
+        memcpy(to->queue.entries, from->queue.entries, from->queue.count * sizeof *from->queue.entries);
+        to->queue.count = from->queue.count;
+    }
+    to->queue.lost = from->queue.lost;
+    to->queue.limit = from->queue.limit;
+
+    if (ok && from->mapper)
+        ok = (to->mapper = mapper_clone(from->mapper)) != NULL;
+
+    if (ok && from->nticking)
+    {
+        void *p = realloc(to->ticking, from->nticking * sizeof *from->ticking);
+
+        if ((ok = p != NULL))
+        {
+            to->ticking = p;
+            memcpy(to->ticking, from->ticking, from->nticking * sizeof *from->ticking);
+            to->nticking = from->nticking;
+        }
+    }
+
+    if (!ok)
+        luaL_error(L, E_("out of memory"));
+}
+
+/* Pushes a copy of the MPU at 'from_idx'. */
+static void
+mpu__clone(lua_State * L, int from_idx)
+{
+    LuaMPU *clone;
+
+    from_idx = lua_absindex(L, from_idx);
+    clone = luaU_newuserdata0(L, sizeof *clone, "LuaMPU");
+    clone->mpu = M6502_new(NULL, NULL, NULL);
+    clone->mpu->custom_data = clone;
+    clone->L = L;
+    clone->serial = serial__new();
+
+    mpu__copy(L, -1, from_idx);
+}
+
+/**
+ * Makes a copy of the MPU.
+ *
+ * The copy is in the same state (everything @{save} covers), and has the
+ * same callbacks and devices (the very same Lua functions and device
+ * objects, that is). From then on, the two MPUs are independent: the
+ * program in one doesn't see what the program in the other does, and
+ * installing a callback in one doesn't install it in the other.
+ *
+ * The copy is made there and then, not on write: each clone costs a
+ * copy of the memory (64KB), of the engine's decoded instructions (4KB
+ * per page holding code), of the hooked pages' callback tables, and of
+ * the callbacks table. That's cheaper than setting a machine up from
+ * scratch, but not free. If you fork often (e.g., to explore several
+ * paths from some point), get the MPUs from a @{pool} instead: handing
+ * one out again only copies the memory pages that have changed.
+ *
+ * Example:
+ *
+ *    for _, input in ipairs(inputs) do
+ *      local fork = mpu:clone()
+ *      fork:poke(0xd010, input)
+ *      fork:run { cycles = 10000 }
+ *    end
+ *
+ * @return A new MPU.
+ *
+ * @function mpu:clone
+ */
+static int
+l_mpu_clone(lua_State * L)
+{
+    SELF(L, 1);
+    mpu__clone(L, 1);
+    return 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Pools.
+ *
+ * If you run many short jobs, each on a machine set up the same way, a
+ * pool saves you from building the machine anew for each job: you set up
+ * one MPU, the template, and the pool hands out MPUs in the template's
+ * state (memory, registers, callbacks, devices; everything @{clone}
+ * copies). When you're done with an MPU, you give it back, and the next
+ * one to ask for an MPU gets it, reset to the template.
+ *
+ * Resetting only copies the memory pages that have changed, and keeps the
+ * instructions the engine has already decoded.
+ *
+ * Example:
+ *
+ *    local pool = M6502.pool { template = mpu, size = 4 }
+ *
+ *    for _, job in ipairs(jobs) do
+ *      local mpu = pool:acquire()
+ *      job(mpu)
+ *      pool:release(mpu)
+ *    end
+ *
+ * @section
+ */
+
+typedef struct
+{
+    int size;                   /* How many idle MPUs we keep. */
+    int idle;                   /* How many we have (they're in our user value, at [1..idle]). */
+} LuaPool;
+
+#define TEMPLATE_KEY  "template"
+
+/**
+ * Marks the MPU at the top of the stack as belonging to the pool at
+ * 'pool_idx', so that release() can tell.
+ */
+static void
+pool__tag(lua_State * L, int pool_idx)
+{
+    pool_idx = lua_absindex(L, pool_idx);
+    lua_getuservalue(L, -1);
+    lua_pushvalue(L, pool_idx);
+    lua_setfield(L, -2, POOL_KEY);
+    lua_pop(L, 1);
+}
+
+/**
+ * Creates a pool.
+ *
+ * @param options A table with the fields __template__ (an MPU) and,
+ *   optionally, __size__ (how many MPUs to create in advance, and the most
+ *   the pool keeps; 8 by default).
+ *
+ * Changes you make to the template later are seen by the MPUs acquired
+ * later.
+ *
+ * @function pool
+ */
+static int
+l_pool(lua_State * L)
+{
+    LuaPool *pool;
+    int size, i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, TEMPLATE_KEY);
+    luaL_checkudata(L, -1, "LuaMPU");
+    lua_getfield(L, 1, "size");
+    size = luaL_optinteger(L, -1, 8);
+    lua_pop(L, 1);
+    if (size < 0)
+        luaL_error(L, E_("The size can't be negative (I got %d)."), size);
+
+    pool = luaU_newuserdata0(L, sizeof *pool, "LuaMPUPool");
+    pool->size = size;
+
+    lua_createtable(L, size, 1);
+    lua_pushvalue(L, -3);
+    lua_setfield(L, -2, TEMPLATE_KEY);
+    for (i = 1; i <= size; i++)
+    {
+        mpu__clone(L, -3);
+        pool__tag(L, -3);
+        lua_rawseti(L, -2, i);
+    }
+    pool->idle = size;
+    lua_setuservalue(L, -2);
+
+    return 1;
+}
+
+/**
+ * Gets an MPU in the template's state.
+ *
+ * If the pool has no idle MPUs, it makes a new one.
+ *
+ * @function pool:acquire
+ */
+static int
+l_pool_acquire(lua_State * L)
+{
+    LuaPool *pool = luaL_checkudata(L, 1, "LuaMPUPool");
+
+    lua_getuservalue(L, 1);
+    lua_getfield(L, -1, TEMPLATE_KEY);
+
+    if (pool->idle)
+    {
+        lua_rawgeti(L, -2, pool->idle);
+        lua_pushnil(L);
+        lua_rawseti(L, -4, pool->idle--);
+        ((LuaMPU *) lua_touserdata(L, -1))->L = L;
+        mpu__copy(L, -1, -2);
+    }
+    else
+        mpu__clone(L, -1);
+    pool__tag(L, 1);
+
+    return 1;
+}
+
+/**
+ * Gives an MPU back to the pool.
+ *
+ * You shouldn't use the MPU after giving it back. (If the pool already
+ * keeps as many MPUs as its size, the MPU is simply dropped.)
+ *
+ * Only MPUs acquired from this pool can be given back to it (the pool
+ * overwrites their memory when it hands them out again).
+ *
+ * @param mpu
+ *
+ * @function pool:release
+ */
+static int
+l_pool_release(lua_State * L)
+{
+    LuaPool *pool = luaL_checkudata(L, 1, "LuaMPUPool");
+    int i;
+
+    luaL_checkudata(L, 2, "LuaMPU");
+
+    lua_getuservalue(L, 2);
+    lua_getfield(L, -1, POOL_KEY);
+    if (!lua_rawequal(L, -1, 1))
+        luaL_error(L, E_("This MPU doesn't come from this pool."));
+    lua_pop(L, 2);
+
+    lua_getuservalue(L, 1);
+
+    for (i = 1; i <= pool->idle; i++)
+    {
+        lua_rawgeti(L, -1, i);
+        if (lua_rawequal(L, -1, 2))
+            luaL_error(L, E_("This MPU was already released."));
+        lua_pop(L, 1);
+    }
+
+    if (pool->idle < pool->size)
+    {
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, ++pool->idle);
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Misc.
+ *
+ * @section
+ */
+
+/**
+ * Disassembles one machine instruction.
+ *
+ * Example:
+ *
+ *    local text, ins_size = mpu:dis(0x603)
+ *    print(text)
+ *
+ *    -- Print the next instruction.
+ *    local text = mpu:dis(0x603 + ins_size)
+ *    print(text)
+ *
+ * See @{M6502.utils.dis_range} for an easier function to use.
+ *
+ * @param addr The instruction's address.
+ *
+ * @return The mnemonic assembly code for the instruction.
+ * @return The length, in bytes, of the instruction and its operands (this
+ *   lets you advance to the next instruction).
+ *
+ * @function mpu:dis
+ */
+static int
+l_mpu_dis(lua_State * L)
+{
+    /* input vars */
+    LuaMPU *self = SELF(L, 1);
+    uint16_t addr = luaM_checkaddr(L, 2);
+
+    /* output vars */
+    char insn[64];
+    int len;
+
+    len = M6502_disassemble(self->mpu, addr, insn);
+
+    lua_pushstring(L, insn);
+    lua_pushinteger(L, len);
+    return 2;
+}
+
+/**
+ * Returns a string describing the MPU status.
+ *
+ * The values of the registers (and flags) is included.
+ *
+ * Example:
+ *
+ *    print( mpu:dump() )
+ *
+ * (If you want to dump a memory range, see @{M6502.utils.dump_range}.)
+ *
+ * @function mpu:dump
+ */
+static int
+l_mpu_dump(lua_State * L)
+{
+    LuaMPU *lmpu = SELF(L, 1);
+
+    /* output var */
+    char buf[64];
+
+    M6502_dump(lmpu->mpu, buf);
+    lua_pushstring(L, buf);
+    return 1;
+}
+
+/*
+ * Reads a budget field off the options table. Returns 0 if it's missing.
+ */
+static lua_Integer
+get_budget(lua_State * L, int idx, const char *field)
+{
+    lua_Integer n = 0;
+
+    lua_getfield(L, idx, field);
+    if (!lua_isnil(L, -1))
+    {
+        n = luaL_checkinteger(L, -1);
+        if (n < 1)
+            luaL_error(L, E_("The '%s' budget must be positive (I got %d)."), field, (int) n);
+    }
+    lua_pop(L, 1);
+    return n;
+}
+
+static const char *const stop_names[] = {
+    "budget", "brk", "illegal", "stopped", "waiting", "halted", NULL
+};
+
+static const int stop_values[] = {
+    M6502_StopBudget, M6502_StopBRK, M6502_StopIllegal, M6502_StopRequested,
+    M6502_StopWaiting, M6502_StopHalted
+};
+
+/**
+ * Makes the MPU start executing instructions.
+ *
+ * See @{PC}.
+ *
+ * The MPU runs till a BRK (`0x00`) instructions is reached. By default the
+ * handler for this instruction terminates the program after printing the
+ * @{dump|MPU status}.
+ *
+ * You may instead bound the run by passing a table with an `instructions`
+ * and/or a `cycles` field. The MPU then stops at the first instruction
+ * boundary where either budget is used up, and `run` returns. In this form
+ * the default BRK handler doesn't terminate the program: it just stops the
+ * MPU, leaving PC just past the BRK and the stack and I flag as they were
+ * before it, so that the program can be resumed. Example:
+ *
+ *    -- Give the program a time slice of 10000 instructions.
+ *    local reason, count = mpu:run { instructions = 10000 }
+ *    if reason == "budget" then
+ *      -- The program hasn't finished yet; resume it later.
+ *    end
+ *
+ * Programs that wait don't cost much. After a WAI, and in a loop that
+ * merely polls memory (like `LDA $D012 / BNE *-3`, or `JMP *`), the clock
+ * is advanced straight to the next @{at_cycle|timed event} or to the end of
+ * the `cycles` budget, exactly as if the loop had run till then. (Except
+ * for polling loops on MPUs whose memory is a file mapped in "shared"
+ * mode, see @{new}, or is shared with such an MPU: another process may
+ * change the polled byte at any moment, so these loops really run.)
+ *
+ * @param[opt] opts A table with `instructions` and/or `cycles` fields.
+ *
+ * @return The reason for stopping: "budget" (the budget was used up),
+ *   "brk" (a BRK was reached), "illegal" (an undefined instruction was
+ *   reached; PC points at it), "stopped" (a callback called @{stop}),
+ *   "waiting" (a WAI was reached and no event is pending that could
+ *   @{irq|interrupt} it; running again keeps waiting), or "halted" (an
+ *   STP was reached; PC points at it).
+ * @return How many instructions were executed (or, if only `cycles` was
+ *   given, how many clock cycles).
+ *
+ * @function mpu:run
+ */
+static int
+l_mpu_run(lua_State * L)
+{
+    LuaMPU *lmpu = enter(L);
+    gboolean bounded = !lua_isnoneornil(L, 2);
+
+    unsigned long insns = 0;
+    uint64_t ticks = 0;
+    gboolean count_ticks = FALSE;
+
+    unsigned long executed;
+    uint64_t start;
+    int stop;
+
+    if (bounded)
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        insns = get_budget(L, 2, "instructions");
+        ticks = get_budget(L, 2, "cycles");
+        count_ticks = (insns == 0 && ticks != 0);
+    }
+
+    start = lmpu->mpu->ticks;
+    stop = M6502_execute(lmpu->mpu, insns, ticks, &executed);
+    mpu__release_displaced(L, lmpu);
+
+    if (!bounded)
+    {
+        /* Traditional behavior. */
+        if (stop == M6502_StopBRK)
+        {
+            char buffer[64];
+            M6502_dump(lmpu->mpu, buffer);
+            printf("\nBRK instruction reached. Exiting.\n%s\n", buffer);
+            exit(0);
+        }
+        if (stop == M6502_StopIllegal)
+        {
+            fflush(stdout);
+            fprintf(stderr, "\nundefined instruction %02X\n",
+                    lmpu->mpu->memory[lmpu->mpu->registers->pc]);
+        }
+    }
+
+    luaU_push_option(L, stop, "budget", stop_names, stop_values);
+    if (count_ticks)
+        lua_pushinteger(L, lmpu->mpu->ticks - start);
+    else
+        lua_pushinteger(L, executed);
+    return 2;
+}
+
+/**
+ * Executes instructions one by one.
+ *
+ * This is like @{run} with an `instructions` budget, but it returns the
+ * registers as well, saving you the calls to their getters. It's meant for
+ * single-stepping. Example:
+ *
+ *    -- Trace a program.
+ *    repeat
+ *      local reason, pc, a, x, y = mpu:step()
+ *      print(("%04x  A=%02x X=%02x Y=%02x"):format(pc, a, x, y))
+ *    until reason ~= "budget"
+ *
+ * @param[opt] n How many instructions to execute. Defaults to 1.
+ *
+ * @return The reason for stopping (see @{run}); "budget" if all `n`
+ *   instructions were executed.
+ * @return The PC register.
+ * @return The A register.
+ * @return The X register.
+ * @return The Y register.
+ * @return The P register.
+ * @return The S register.
+ *
+ * @function mpu:step
+ */
+static int
+l_mpu_step(lua_State * L)
+{
+    LuaMPU *lmpu = enter(L);
+    lua_Integer n = luaL_optinteger(L, 2, 1);
+    M6502_Registers *r = lmpu->mpu->registers;
+    int stop;
+
+    if (n < 1)
+        luaL_error(L, E_("Number of instructions must be positive (I got %d)."), (int) n);
+
+    stop = M6502_step(lmpu->mpu, n);
+    mpu__release_displaced(L, lmpu);
+
+    luaU_push_option(L, stop, "budget", stop_names, stop_values);
+    lua_pushinteger(L, r->pc);
+    lua_pushinteger(L, r->a);
+    lua_pushinteger(L, r->x);
+    lua_pushinteger(L, r->y);
+    lua_pushinteger(L, r->p);
+    lua_pushinteger(L, r->s);
+    return 7;
+}
+
+/**
+ * Stops a running MPU.
+ *
+ * Call this from inside a callback. The MPU stops at the next instruction
+ * boundary and @{run} returns "stopped".
+ *
+ * @function mpu:stop
+ */
+static int
+l_mpu_stop(lua_State * L)
+{
+    LuaMPU *lmpu = SELF(L, 1);
+
+    M6502_stop(lmpu->mpu, M6502_StopRequested);
+    return 0;
+}
+
+/**
+ * Raises an interrupt request.
+ *
+ * If the I flag is clear, the current PC and P are pushed and execution
+ * continues at the IRQ vector. Either way, a pending WAI ends.
+ *
+ * This is typically called from a @{every|timed event}, to emulate a
+ * periodic interrupt.
+ *
+ * @function mpu:irq
+ */
+static int
+l_mpu_irq(lua_State * L)
+{
+    LuaMPU *lmpu = SELF(L, 1);
+
+    M6502_irq(lmpu->mpu);
+    return 0;
+}
+
+/**
+ * Raises a non-maskable interrupt.
+ *
+ * The current PC and P are pushed and execution continues at the NMI
+ * vector. A pending WAI ends.
+ *
+ * @function mpu:nmi
+ */
+static int
+l_mpu_nmi(lua_State * L)
+{
+    LuaMPU *lmpu = SELF(L, 1);
+
+    M6502_nmi(lmpu->mpu);
+    return 0;
+}
+
+/**
+ * Reads/writes the clock cycles counter.
+ *
+ * This counts the clock cycles executed since the MPU was created
+ * (including the extra cycles taken by branches and by page crossings).
+ * Inside a callback, the count includes the instruction being executed.
+ *
+ * Example:
+ *
+ *    local before = mpu:cycles()
+ *    mpu:run { instructions = 1000 }
+ *    print("took " .. (mpu:cycles() - before) .. " cycles")
+ *
+ * @param[opt] value
+ * @function mpu:cycles
+ */
+static int
+l_mpu_cycles(lua_State * L)
+{
+    LuaMPU *lmpu = SELF(L, 1);
+
+    if (lua_gettop(L) > 1)
+    {
+        lmpu->mpu->ticks = luaL_checkinteger(L, 2);
+        return 0;
+    }
+    else
+    {
+        lua_pushinteger(L, lmpu->mpu->ticks);
+        return 1;
+    }
+}
+
+static int
+l_mpu_gc(lua_State * L)
+{
+    LuaMPU *self = SELF(L, 1);
+
+    d_message(("deleting %p\n", self));
+    M6502_delete(self->mpu);
+    hookset_free(&self->read);
+    hookset_free(&self->write);
+    hookset_free(&self->call);
+    free(self->dirty);
+    free(self->queue.entries);
+    mapper_free(self->mapper);
+    hookset_free(&self->devices);
+    free(self->ticking);
+    memfile_unmap(self->memfile, self->memfile_size);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* *INDENT-OFF* */
+
 static const luaL_Reg functions[] = {
     { "new", l_new },
+    { "pool", l_pool },
     { NULL, NULL }
 };
 
@@ -969,6 +3719,8 @@ static const luaL_Reg mpu_methods[] = {
     { "pokew", l_mpu_pokew },
     { "peeks", l_mpu_peeks },
     { "pokes", l_mpu_pokes },
+    { "fill", l_mpu_fill },
+    { "copy", l_mpu_copy },
     { "push", l_mpu_push },
     { "pop", l_mpu_pop },
     { "pushw", l_mpu_pushw },
@@ -976,13 +3728,47 @@ static const luaL_Reg mpu_methods[] = {
     { "on_read", l_mpu_on_read },
     { "on_write", l_mpu_on_write },
     { "on_call", l_mpu_on_call },
+    { "on_read_range", l_mpu_on_read_range },
+    { "on_write_range", l_mpu_on_write_range },
+    { "on_call_range", l_mpu_on_call_range },
+    { "track_dirty", l_mpu_track_dirty },
+    { "take_dirty", l_mpu_take_dirty },
+    { "queue_writes", l_mpu_queue_writes },
+    { "drain_writes", l_mpu_drain_writes },
+    { "protect", l_mpu_protect },
+    { "violations", l_mpu_violations },
+    { "backing", l_mpu_backing },
+    { "backing_peeks", l_mpu_backing_peeks },
+    { "backing_pokes", l_mpu_backing_pokes },
+    { "map", l_mpu_map },
+    { "mirror", l_mpu_mirror },
+    { "bank_latch", l_mpu_bank_latch },
+    { "attach", l_mpu_attach },
+    { "detach", l_mpu_detach },
+    { "save", l_mpu_save },
+    { "restore", l_mpu_restore },
+    { "clone", l_mpu_clone },
+    { "at_cycle", l_mpu_at_cycle },
+    { "every", l_mpu_every },
+    { "cancel", l_mpu_cancel },
     { "run", l_mpu_run },
+    { "step", l_mpu_step },
+    { "stop", l_mpu_stop },
+    { "irq", l_mpu_irq },
+    { "nmi", l_mpu_nmi },
+    { "cycles", l_mpu_cycles },
     { "dis", l_mpu_dis },
     { "dump", l_mpu_dump },
     { "__gc", l_mpu_gc },
     { NULL, NULL }
 };
 
+static const luaL_Reg pool_methods[] = {
+    { "acquire", l_pool_acquire },
+    { "release", l_pool_release },
+    { NULL, NULL }
+};
+
 /* Exported constants */
 static const luaU_constReg constants[] = {
     /* We currently export no constants. */
@@ -997,9 +3783,9 @@ static const luaU_constReg constants[] = {
 LUALIB_API int
 luaopen_M6502(lua_State * L)
 {
-    registry__create(L);
 
     luaU_register_metatable(L, "LuaMPU", mpu_methods, TRUE);
+    luaU_register_metatable(L, "LuaMPUPool", pool_methods, TRUE);
 
     luaL_newlib(L, functions);
 
@@ -0,0 +1,274 @@
+/**
+ * The memory mapper. See mapper.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mapper.h"
+
+#define PAGE(page)  (mpu->memory + ((page) << 8))
+
+Mapper *
+mapper_new(void)
+{
+    Mapper *m = calloc(1, sizeof *m);
+    int i;
+
+    if (!m)
+        return NULL;
+    for (i = 0; i < 0x100; i++)
+    {
+        m->map[i] = -1;
+        m->alias[i] = i;
+    }
+    return m;
+}
+
+/**
+ * Returns a copy of a mapper, or NULL if out of memory.
+ */
+Mapper *
+mapper_clone(const Mapper * m)
+{
+    Mapper *copy = malloc(sizeof *copy);
+
+    if (!copy)
+        return NULL;
+    *copy = *m;
+    copy->store = NULL;
+    copy->borrowed = 0;
+    copy->latches = NULL;
+    if ((m->size && !(copy->store = malloc(m->size)))
+        || (m->nlatches && !(copy->latches = malloc(m->nlatches * sizeof *m->latches))))
+    {
+        mapper_free(copy);
+        return NULL;
+    }
+    if (m->size)
+        memcpy(copy->store, m->store, m->size);
+    if (m->nlatches)
+        memcpy(copy->latches, m->latches, m->nlatches * sizeof *m->latches);
+    return copy;
+}
+
+void
+mapper_free(Mapper * m)
+{
+    if (m)
+    {
+        if (!m->borrowed)
+            free(m->store);
+        free(m->latches);
+        free(m);
+    }
+}
+
+static void
+link_page(Mapper * m, int page, int of)
+{
+    m->alias[page] = m->alias[of];
+    m->alias[of] = page;
+}
+
+static void
+unlink_page(Mapper * m, int page)
+{
+    int q = page;
+
+    while (m->alias[q] != page)
+        q = m->alias[q];
+    m->alias[q] = m->alias[page];
+    m->alias[page] = page;
+}
+
+/**
+ * Copies a mapped page back to its bank.
+ */
+static void
+write_back(Mapper * m, M6502 * mpu, int page)
+{
+    if (m->map[page] >= 0)
+        memcpy(m->store + m->map[page], PAGE(page), 0x100);
+}
+
+/**
+ * Copies all the mapped pages back to their banks, making the store
+ * up to date.
+ */
+void
+mapper_sync(Mapper * m, M6502 * mpu)
+{
+    int page;
+
+    for (page = 0; page < 0x100; page++)
+        write_back(m, mpu, page);
+}
+
+/**
+ * Resizes the store. Pages mapped past its new end become plain memory.
+ *
+ * Returns 0 if out of memory.
+ */
+int
+mapper_resize(Mapper * m, M6502 * mpu, size_t size)
+{
+    uint8_t *store;
+    int page;
+
+    mapper_sync(m, mpu);
+
+    store = realloc(m->store, size ? size : 1);
+    if (!store)
+        return 0;
+    if (size > m->size)
+        memset(store + m->size, 0, size - m->size);
+    m->store = store;
+    m->size = size;
+
+    for (page = 0; page < 0x100; page++)
+        if (m->map[page] >= 0 && (size_t) m->map[page] + 0x100 > size)
+            m->map[page] = -1;
+
+    return 1;
+}
+
+/**
+ * Reloads the pages mapped to a part of the store that was changed.
+ */
+void
+mapper_refresh(Mapper * m, M6502 * mpu, size_t offset, size_t len)
+{
+    int page;
+
+    for (page = 0; page < 0x100; page++)
+    {
+        long at = m->map[page];
+
+        if (at >= 0 && (size_t) at < offset + len && (size_t) at + 0x100 > offset)
+        {
+            memcpy(PAGE(page), m->store + at, 0x100);
+            M6502_invalidate(mpu, page << 8, 0x100);
+        }
+    }
+}
+
+/**
+ * Maps a page to the bank at 'offset' in the store, or, if 'offset' is
+ * negative, turns it back into plain memory (keeping its contents).
+ *
+ * The page stops mirroring other pages. If another page is mapped to the
+ * same bank, the two become mirrors.
+ */
+void
+mapper_map(Mapper * m, M6502 * mpu, int page, long offset)
+{
+    int q;
+
+    write_back(m, mpu, page);
+    unlink_page(m, page);
+    m->map[page] = offset;
+
+    if (offset < 0)
+        return;
+
+    for (q = 0; q < 0x100; q++)
+        if (q != page && m->map[q] == offset)
+            break;
+
+    if (q < 0x100)
+    {
+        /* Its memory is more recent than the store. */
+        memcpy(PAGE(page), PAGE(q), 0x100);
+        link_page(m, page, q);
+    }
+    else
+        memcpy(PAGE(page), m->store + offset, 0x100);
+
+    M6502_invalidate(mpu, page << 8, 0x100);
+}
+
+/**
+ * Makes a page show the same memory as page 'of', or, if 'of' is negative,
+ * stop mirroring (the page keeps its contents, as plain memory).
+ */
+void
+mapper_mirror(Mapper * m, M6502 * mpu, int page, int of)
+{
+    write_back(m, mpu, page);
+    unlink_page(m, page);
+    m->map[page] = -1;
+
+    if (of < 0 || of == page)
+        return;
+
+    m->map[page] = m->map[of];
+    memcpy(PAGE(page), PAGE(of), 0x100);
+    M6502_invalidate(mpu, page << 8, 0x100);
+    link_page(m, page, of);
+}
+
+/**
+ * Writes a byte to a page and to all the pages showing the same memory.
+ */
+void
+mapper_write(Mapper * m, M6502 * mpu, uint16_t addr, uint8_t data)
+{
+    int page = addr >> 8;
+    int q = page;
+
+    do
+    {
+        uint16_t a = (q << 8) | (addr & 0xff);
+
+        mpu->memory[a] = data;
+        M6502_invalidate(mpu, a, 1);
+        q = m->alias[q];
+    }
+    while (q != page);
+}
+
+struct MapperLatch *
+mapper_find_latch(Mapper * m, uint16_t addr)
+{
+    int i;
+
+    for (i = 0; i < m->nlatches; i++)
+        if (m->latches[i].addr == addr)
+            return &m->latches[i];
+    return NULL;
+}
+
+/**
+ * Configures (or, if 'page' is negative, removes) the latch at 'addr'.
+ *
+ * Returns 0 if out of memory.
+ */
+int
+mapper_set_latch(Mapper * m, uint16_t addr, int page, int count, long base)
+{
+    struct MapperLatch *latch = mapper_find_latch(m, addr);
+
+    if (page < 0)
+    {
+        if (latch)
+            *latch = m->latches[--m->nlatches];
+        return 1;
+    }
+
+    if (!latch)
+    {
+        struct MapperLatch *latches = realloc(m->latches, (m->nlatches + 1) * sizeof *latches);
+
+        if (!latches)
+            return 0;
+        m->latches = latches;
+        latch = &m->latches[m->nlatches++];
+    }
+
+    latch->addr = addr;
+    latch->page = page;
+    latch->count = count;
+    latch->base = base;
+    return 1;
+}
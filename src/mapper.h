@@ -0,0 +1,56 @@
+#ifndef M6502__MAPPER_H
+#define M6502__MAPPER_H
+
+#include <stddef.h>
+
+#include "../lib/piumarta/lib6502.h"
+
+/**
+ * A memory mapper: it maps 6502 pages to pages of a (larger) backing
+ * store, for bank switching, and links pages that mirror each other.
+ *
+ * The MPU always runs from its flat 64KB memory. Mapping a page copies the
+ * bank in (writing the previous one back), so mapped pages cost nothing
+ * while running; it's the bank switch that costs 256 bytes of copying per
+ * page. Pages that show the same memory (mirrors, or the same bank mapped
+ * twice) are kept identical by writing through to all of them, which is
+ * the caller's job (see mapper_write()).
+ */
+typedef struct
+{
+    uint8_t *store;
+    size_t size;                /* In bytes; a multiple of 0x100. */
+    int borrowed;               /* The store isn't ours (e.g., it's in a mapped file): we don't free or resize it. */
+
+    long map[0x100];            /* Page -> offset of its bank in the store, or -1. */
+    uint8_t alias[0x100];       /* Next page in the ring of pages showing the same memory (itself if none). */
+
+    struct MapperLatch
+    {
+        uint16_t addr;          /* Writing N here... */
+        uint8_t page;           /* ...maps 'count' pages from 'page'... */
+        int count;
+        long base;              /* ...to the bank at 'base + N * count * 0x100'. */
+    } *latches;
+    int nlatches;
+
+} Mapper;
+
+Mapper *mapper_new(void);
+Mapper *mapper_clone(const Mapper * m);
+void mapper_free(Mapper * m);
+
+int mapper_resize(Mapper * m, M6502 * mpu, size_t size);
+void mapper_sync(Mapper * m, M6502 * mpu);
+void mapper_refresh(Mapper * m, M6502 * mpu, size_t offset, size_t len);
+
+void mapper_map(Mapper * m, M6502 * mpu, int page, long offset);
+void mapper_mirror(Mapper * m, M6502 * mpu, int page, int of);
+void mapper_write(Mapper * m, M6502 * mpu, uint16_t addr, uint8_t data);
+
+struct MapperLatch *mapper_find_latch(Mapper * m, uint16_t addr);
+int mapper_set_latch(Mapper * m, uint16_t addr, int page, int count, long base);
+
+#define mapper_aliased(m, page)  ((m)->alias[page] != (page))
+
+#endif
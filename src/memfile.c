@@ -0,0 +1,96 @@
+/**
+ * Memory backed by files (see the 'memory_file' option of M6502.new()).
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  define HAVE_MMAP
+#endif
+
+#include "memfile.h"
+
+#ifdef HAVE_MMAP
+
+/**
+ * Maps a file into memory.
+ *
+ * In shared mode, changes go to the file, which is created, or grown to
+ * 'min_size', if needed. Otherwise, changes are private to us, and the
+ * file must have at least 'min_size' bytes.
+ *
+ * Returns NULL, with a message at 'error', on failure.
+ */
+uint8_t *
+memfile_map(const char *path, gboolean shared, size_t min_size, size_t * size, const char **error)
+{
+    int fd;
+    struct stat st;
+    void *p;
+
+    fd = shared ? open(path, O_RDWR | O_CREAT, 0666) : open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        goto fail;
+
+    if ((size_t) st.st_size < min_size)
+    {
+        if (!shared)
+        {
+            close(fd);
+            *error = "the file is too small";
+            return NULL;
+        }
+        if (ftruncate(fd, min_size) < 0)
+            goto fail;
+        st.st_size = min_size;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        goto fail;
+
+    close(fd);                  /* The mapping stays. */
+    *size = st.st_size;
+    return p;
+
+  fail:
+    *error = strerror(errno);
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+void
+memfile_unmap(uint8_t * p, size_t size)
+{
+    if (p)
+        munmap(p, size);
+}
+
+#else
+
+uint8_t *
+memfile_map(const char *path, gboolean shared, size_t min_size, size_t * size, const char **error)
+{
+    (void) path;
+    (void) shared;
+    (void) min_size;
+    (void) size;
+    *error = "memory files aren't supported on this platform";
+    return NULL;
+}
+
+void
+memfile_unmap(uint8_t * p, size_t size)
+{
+    (void) p;
+    (void) size;
+}
+
+#endif
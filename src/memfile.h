@@ -0,0 +1,13 @@
+#ifndef M6502__MEMFILE_H
+#define M6502__MEMFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lutils.h"
+
+uint8_t *memfile_map(const char *path, gboolean shared, size_t min_size, size_t * size,
+                     const char **error);
+void memfile_unmap(uint8_t * p, size_t size);
+
+#endif
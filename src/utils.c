@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "utils.h"
 
@@ -20,14 +21,109 @@ write_byte(M6502 * mpu, uint16_t addr, uint8_t data)
     if (writer)
         writer(mpu, addr, data);
     else
+    {
         mpu->memory[addr] = data;
+        M6502_invalidate(mpu, addr, 1);
+    }
+}
+
+/**
+ * Returns how many of the 'len' addresses starting at 'addr' have no
+ * callback in a table. We can memcpy() over these.
+ */
+unsigned
+unhooked_span(M6502_CallbackPage ** table, uint8_t * pages, uint16_t addr, unsigned len)
+{
+    unsigned n = 0;
+
+    while (n < len)
+    {
+        unsigned a = addr + n;
+
+        if (!M6502_pageHooked(pages, a))
+            n += 0x100 - (a & 0xff);    /* Skip to the next page. */
+        else if (!M6502_callbackAt(table, a))
+            n++;
+        else
+            break;
+    }
+
+    return MIN(n, len);
+}
+
+/*
+ * The following work like read_byte() and write_byte() over a range, but
+ * only go byte by byte where there are callbacks. 'addr + len' mustn't
+ * exceed the memory's end.
+ *
+ * The spans are looked up afresh after each callback, as callbacks may
+ * install or remove others.
+ */
+
+void
+read_bytes(M6502 * mpu, uint16_t addr, uint8_t * buf, unsigned len)
+{
+    unsigned i = 0;
+
+    while (i < len)
+    {
+        unsigned n = unhooked_span(mpu->callbacks->read, mpu->callbacks->readPages, addr + i, len - i);
+
+        memcpy(buf + i, mpu->memory + addr + i, n);
+        i += n;
+        if (i < len)
+        {
+            buf[i] = M6502_callbackAt(mpu->callbacks->read, addr + i) (mpu, addr + i, -1);
+            i++;
+        }
+    }
+}
+
+void
+write_bytes(M6502 * mpu, uint16_t addr, const uint8_t * s, unsigned len)
+{
+    unsigned i = 0;
+
+    while (i < len)
+    {
+        unsigned n = unhooked_span(mpu->callbacks->write, mpu->callbacks->writePages, addr + i, len - i);
+
+        memcpy(mpu->memory + addr + i, s + i, n);
+        M6502_invalidate(mpu, addr + i, n);
+        i += n;
+        if (i < len)
+        {
+            M6502_callbackAt(mpu->callbacks->write, addr + i) (mpu, addr + i, s[i]);
+            i++;
+        }
+    }
+}
+
+void
+fill_bytes(M6502 * mpu, uint16_t addr, uint8_t data, unsigned len)
+{
+    unsigned i = 0;
+
+    while (i < len)
+    {
+        unsigned n = unhooked_span(mpu->callbacks->write, mpu->callbacks->writePages, addr + i, len - i);
+
+        memset(mpu->memory + addr + i, data, n);
+        M6502_invalidate(mpu, addr + i, n);
+        i += n;
+        if (i < len)
+        {
+            M6502_callbackAt(mpu->callbacks->write, addr + i) (mpu, addr + i, data);
+            i++;
+        }
+    }
 }
 
 void
 pushw(M6502 * mpu, uint16_t w)
 {
-    mpu->memory[mpu->registers->s-- + 0x100] = w >> 8;
-    mpu->memory[mpu->registers->s-- + 0x100] = w & 0xff;
+    pushb(mpu, w >> 8);
+    pushb(mpu, w & 0xff);
 }
 
 uint16_t
@@ -40,7 +136,9 @@ popw(M6502 * mpu)
 void
 pushb(M6502 * mpu, uint8_t b)
 {
-    mpu->memory[mpu->registers->s-- + 0x100] = b;
+    mpu->memory[mpu->registers->s + 0x100] = b;
+    M6502_invalidate(mpu, mpu->registers->s + 0x100, 1);
+    mpu->registers->s--;
 }
 
 uint8_t
@@ -49,11 +147,19 @@ popb(M6502 * mpu)
     return mpu->memory[++mpu->registers->s + 0x100];
 }
 
+/**
+ * Stops the MPU. PC is left just past the BRK (and its signature byte).
+ *
+ * BRK has already pushed PC and P, and set I, by the time we're called. We
+ * undo that, so that a program resumed after the stop finds the stack and
+ * the flags as they were before the BRK (only B stays set, as the CPU
+ * leaves it).
+ */
 int
 default_BRK_handler(M6502 * mpu, uint16_t address, uint8_t data)
 {
-    char buffer[64];
-    M6502_dump(mpu, buffer);
-    printf("\nBRK instruction reached. Exiting.\n%s\n", buffer);
-    exit(0);
+    mpu->registers->p = popb(mpu) & ~0x20;      /* Bit 5 is only set in the pushed copy. */
+    (void) popw(mpu);
+    M6502_stop(mpu, M6502_StopBRK);
+    return mpu->registers->pc;
 }
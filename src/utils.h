@@ -16,6 +16,11 @@
 uint8_t read_byte(M6502 * mpu, uint16_t addr);
 void write_byte(M6502 * mpu, uint16_t addr, uint8_t data);
 
+unsigned unhooked_span(M6502_CallbackPage ** table, uint8_t * pages, uint16_t addr, unsigned len);
+void read_bytes(M6502 * mpu, uint16_t addr, uint8_t * buf, unsigned len);
+void write_bytes(M6502 * mpu, uint16_t addr, const uint8_t * s, unsigned len);
+void fill_bytes(M6502 * mpu, uint16_t addr, uint8_t data, unsigned len);
+
 void pushw(M6502 * mpu, uint16_t w);
 uint16_t popw(M6502 * mpu);
 void pushb(M6502 * mpu, uint8_t b);
@@ -28,6 +28,238 @@ local function test_on_read()
 
 end
 
+local function test_shared_page()
+
+  print('testing callbacks sharing a page')
+
+  -- Callbacks are looked up through a per-page summary; make sure removing
+  -- one callback doesn't hide another on the same page.
+
+  mpu:poke(0x2010, 1)
+  mpu:poke(0x2020, 2)
+  mpu:poke(0x2110, 3)
+
+  mpu:on_read(0x2010, function() return 11 end)
+  mpu:on_read(0x2020, function() return 22 end)
+
+  mpu:on_read(0x2010, nil)
+  assert(mpu:peek(0x2010) == 1)
+  assert(mpu:peek(0x2020) == 22)
+  assert(mpu:peek(0x2110) == 3)
+
+  local written
+  mpu:on_write(0x2030, function(mpu, addr, val) written = val end)
+  mpu:pokes(0x600, utils.parse_hex 'a9 05 8d 30 20 ad 20 20 00')  -- LDA #5; STA $2030; LDA $2020; BRK
+  mpu:pc(0x600)
+  mpu:run {}
+  assert(written == 5)
+  assert(mpu:a() == 22)
+
+  mpu:on_read(0x2020, nil)
+  mpu:on_write(0x2030, nil)
+  assert(mpu:peek(0x2020) == 2)
+
+end
+
+local function test_many_callbacks()
+
+  print('testing many callbacks')
+
+  -- Install a callback on every 3rd byte across a few pages, then remove
+  -- and replace some of them.
+
+  local function returning(n)
+    return function() return n end
+  end
+
+  for addr = 0x3000, 0x33ff, 3 do
+    mpu:on_read(addr, returning(addr % 256))
+  end
+  for addr = 0x3100, 0x31ff do
+    mpu:on_read(addr, nil)
+  end
+  mpu:on_read(0x3201, returning(0xaa))
+
+  for addr = 0x2ff0, 0x3410 do
+    local expected = 0
+    if addr == 0x3201 then
+      expected = 0xaa
+    elseif addr >= 0x3000 and addr <= 0x33ff and addr % 3 == 0 and not (addr >= 0x3100 and addr <= 0x31ff) then
+      expected = addr % 256
+    end
+    assert(mpu:peek(addr) == expected)
+  end
+
+  for addr = 0x3000, 0x33ff do
+    mpu:on_read(addr, nil)
+  end
+  assert(mpu:peek(0x3201) == 0)
+
+end
+
+local function test_ranges()
+
+  print('testing on_read_range() and friends')
+
+  local m = require('M6502').new()
+
+  local function count(tbl)
+    local cnt = 0
+    for _ in pairs(tbl) do
+      cnt = cnt + 1
+    end
+    return cnt
+  end
+
+  local writes = {}
+  m:on_write_range(0x4000, 0x7fff, function(mpu, addr, val)
+    writes[#writes + 1] = addr
+  end)
+  -- One handler for the whole window.
+  assert(count((debug.getuservalue or debug.getfenv)(m)) == 1)
+
+  m:poke(0x3fff, 1)
+  m:poke(0x4000, 1)
+  m:poke(0x5abc, 1)
+  m:poke(0x7fff, 1)
+  m:poke(0x8000, 1)
+  assert(#writes == 3 and writes[1] == 0x4000 and writes[2] == 0x5abc and writes[3] == 0x7fff)
+
+  -- Punch a hole, and override a part.
+  m:on_write_range(0x5000, 0x5fff, nil)
+  m:on_write(0x6000, function(mpu, addr, val) writes[#writes + 1] = -addr end)
+  writes = {}
+  m:pokes(0x4fff, 'ab')
+  m:pokes(0x5fff, 'abc')
+  assert(#writes == 3 and writes[1] == 0x4fff and writes[2] == -0x6000 and writes[3] == 0x6001)
+  assert(m:peek(0x5000) == 0x62)   -- Not hooked anymore, so really written.
+
+  -- Ranges work while running, too.
+  local reads = 0
+  m:on_read_range(0x10, 0x1f, function(mpu, addr)
+    reads = reads + 1
+    return addr
+  end)
+  m:pokes(0x600, utils.parse_hex 'a5 12 a6 1f a4 20 00')  -- LDA $12; LDX $1F; LDY $20; BRK
+  m:pc(0x600)
+  m:run {}
+  assert(reads == 2 and m:a() == 0x12 and m:x() == 0x1f and m:y() == 0)
+
+  -- Bulk removal.
+  m:on_write_range(0, 0xffff, nil)
+  m:on_read_range(0, 0xffff, nil)
+  writes = {}
+  m:poke(0x4000, 1)
+  m:poke(0x6000, 1)
+  assert(#writes == 0)
+  assert(m:peek(0x12) == 0)
+
+  assert(not pcall(m.on_write_range, m, 0x200, 0x100, print))
+
+end
+
+local function test_ranges_random()
+
+  print('testing overlapping ranges')
+
+  -- Install and remove random ranges over a small area, and compare with
+  -- a plain Lua model.
+
+  local m = require('M6502').new()
+  local model = {}
+
+  local function returning(n)
+    return function() return n end
+  end
+
+  math.randomseed(42)
+  for i = 1, 300 do
+    local first = math.random(0x100, 0x1ff)
+    local last = math.min(first + math.random(0, 40), 0x1ff)
+    local val = (math.random(1, 4) > 1) and (i % 255 + 1) or nil
+    m:on_read_range(first, last, val and returning(val))
+    for addr = first, last do
+      model[addr] = val
+    end
+    for addr = 0xff, 0x200 do
+      assert(m:peek(addr) == (model[addr] or 0))
+    end
+  end
+
+end
+
+local function test_ranges_released()
+
+  print('testing that trimmed and merged ranges release their functions')
+
+  -- The same few functions, installed over random ranges (neighbours
+  -- with the same function are merged), then everything removed. The
+  -- functions are kept in a weak table only.
+
+  local m = require('M6502').new()
+  local model = {}
+  local fns = setmetatable({}, { __mode = 'v' })
+
+  math.randomseed(7)
+  for n = 1, 4 do
+    fns[n] = function() return n end
+  end
+  for i = 1, 400 do
+    local first = math.random(0x100, 0x1ff)
+    local last = math.min(first + math.random(0, 20), 0x1ff)
+    local n = math.random(0, 4)
+    if math.random(1, 2) == 1 then
+      for addr = first, last do     -- Address by address.
+        m:on_read(addr, fns[n])
+      end
+    else
+      m:on_read_range(first, last, fns[n])
+    end
+    for addr = first, last do
+      model[addr] = fns[n] and n
+    end
+  end
+  for addr = 0xff, 0x200 do
+    assert(m:peek(addr) == (model[addr] or 0))
+  end
+
+  m:on_read_range(0, 0xffff, nil)
+  collectgarbage()
+  collectgarbage()
+  assert(next(fns) == nil)
+
+end
+
+local function test_coroutines()
+
+  print('testing callbacks with coroutines')
+
+  -- The MPU is used from two coroutines; each callback must get its
+  -- arguments on the right stack.
+
+  local m = require('M6502').new()
+  m:on_read(0x10, function(mpu, addr) return 0x10 end)
+  m:on_write(0x20, function(mpu, addr, val)
+    -- Use the MPU from another coroutine, in the middle of a run.
+    local co = coroutine.wrap(function()
+      coroutine.yield(mpu:peek(0x10))
+    end)
+    assert(co() == 0x10)
+    mpu:poke(0x21, val + 1)
+  end)
+
+  m:pokes(0x600, utils.parse_hex 'a5 10 85 20 a5 10 85 20 00')  -- (LDA $10; STA $20) x2; BRK
+  m:pc(0x600)
+
+  local co = coroutine.create(function()
+    return m:run {}
+  end)
+  local ok, reason = coroutine.resume(co)
+  assert(ok and reason == 'brk')
+  assert(m:peek(0x21) == 0x11)
+
+end
+
 local function test_on_call()
 
   print('testing on_call()')
@@ -73,4 +305,10 @@ end
 ------------------------------------------------------
 
 test_on_read()
+test_shared_page()
+test_many_callbacks()
+test_ranges()
+test_ranges_random()
+test_ranges_released()
+test_coroutines()
 test_on_call()
@@ -0,0 +1,84 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+-- Runs a single instruction and returns the number of cycles it took.
+local function cost(hex, setup)
+  local mpu = M6.new()
+  mpu:pokes(0x6f0, utils.parse_hex(hex))
+  mpu:pc(0x6f0)
+  if setup then
+    setup(mpu)
+  end
+  local before = mpu:cycles()
+  mpu:run { instructions = 1 }
+  return mpu:cycles() - before
+end
+
+local function test_cycles()
+
+  print('testing cycles()')
+
+  assert(cost 'a9 01' == 2)         -- LDA #1
+  assert(cost '85 10' == 3)         -- STA $10
+  assert(cost 'ad 00 20' == 4)      -- LDA $2000
+  assert(cost '20 00 20' == 6)      -- JSR $2000
+
+  local mpu = M6.new()
+  mpu:cycles(1000)
+  assert(mpu:cycles() == 1000)
+
+end
+
+local function test_page_crossing()
+
+  print('testing page-crossing penalties')
+
+  local function x(n) return function(mpu) mpu:x(n) end end
+
+  assert(cost('bd 80 20', x(0xff)) == 4 + 1)  -- LDA $2080,X crossing into $21xx
+  assert(cost('bd 00 20', x(0xff)) == 4)      -- LDA $2000,X staying on the page
+  assert(cost('9d 80 20', x(0xff)) == 5)      -- STA $2080,X has no penalty
+
+end
+
+local function test_branches()
+
+  print('testing branch penalties')
+
+  local function p(n) return function(mpu) mpu:p(n) end end
+  local Z = 0x02
+
+  assert(cost('d0 02', p(Z)) == 2)         -- BNE, not taken
+  assert(cost('d0 02', p(0)) == 3)         -- BNE, taken
+  assert(cost('d0 20', p(0)) == 4)         -- BNE, taken, to $0712 (crosses page)
+  assert(cost('d0 fc', p(0)) == 3)         -- BNE, taken, backwards on the page
+
+end
+
+local function test_cycles_in_callback()
+
+  print('testing cycles() inside callbacks')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex 'a9 01 85 10')  -- LDA #1; STA $10
+  mpu:pc(0x600)
+
+  local seen
+  mpu:on_write(0x10, function(mpu)
+    seen = mpu:cycles()
+  end)
+  mpu:run { instructions = 2 }
+  assert(seen == 2 + 3)
+
+end
+
+------------------------------------------------------------------------------
+
+test_cycles()
+test_page_crossing()
+test_branches()
+test_cycles_in_callback()
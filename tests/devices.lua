@@ -0,0 +1,89 @@
+
+local M6 = require('M6502')
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+-- Real devices come from native modules (see examples/timer_device.c), so
+-- here we only check that anything else is refused.
+
+local function test_not_devices()
+
+  print('testing attach() refuses non-devices')
+
+  local mpu = M6.new()
+
+  for _, v in ipairs { {}, 'device', 42, io.stdout, M6.new() } do
+    local ok, err = pcall(mpu.attach, mpu, v, 0xd000, 0xd00f)
+    assert(not ok and err:find('device expected'))
+  end
+
+  -- Nothing was attached.
+  mpu:poke(0xd000, 7)
+  assert(mpu:peek(0xd000) == 7)
+
+end
+
+local function test_detach()
+
+  print('testing detach()')
+
+  local mpu = M6.new()
+
+  -- Detaching where nothing is attached is fine, and leaves callbacks alone.
+  local seen
+  mpu:on_write(0xd000, function(mpu, addr, val) seen = val end)
+  mpu:detach(0, 0xffff)
+  mpu:poke(0xd000, 5)
+  assert(seen == 5)
+
+  assert(not pcall(mpu.detach, mpu, 0xd00f, 0xd000))
+
+end
+
+local function test_replaced_by_callbacks()
+
+  print('testing callbacks replacing a device')
+
+  -- Needs the example device built (as "timer_device", on package.cpath).
+  local ok, timer_device = pcall(require, 'timer_device')
+  if not ok then
+    print('  skipped: no timer_device module')
+    return
+  end
+
+  -- Counts IRQs at $10:
+  --
+  --   0600  58        CLI
+  --   0601  4c 01 06  JMP $0601
+  --   0700  e6 10     INC $10
+  --   0702  40        RTI
+  local mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex '58 4c 01 06')
+  mpu:pokes(0x700, utils.parse_hex 'e6 10 40')
+  mpu:pokew(0xfffe, 0x700)
+  mpu:pc(0x600)
+
+  mpu:attach(timer_device.new(100), 0xd000, 0xd000)
+  mpu:poke(0xd000, 1)
+  collectgarbage()
+
+  -- The device still handles writes there, so it still ticks.
+  mpu:on_read(0xd000, function() return 0 end)
+  mpu:run { cycles = 1000 }
+  assert(mpu:peek(0x10) > 0)
+
+  -- Now it has nothing left there: it's detached, and stops ticking.
+  mpu:on_write(0xd000, function() end)
+  mpu:poke(0x10, 0)
+  collectgarbage()
+  mpu:run { cycles = 1000 }
+  assert(mpu:peek(0x10) == 0)
+
+end
+
+------------------------------------------------------------------------------
+
+test_not_devices()
+test_detach()
+test_replaced_by_callbacks()
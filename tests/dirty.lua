@@ -0,0 +1,64 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+local function test_take_dirty()
+
+  print('testing track_dirty() and take_dirty()')
+
+  local mpu = M6.new()
+  mpu:track_dirty(0x200, 0x5ff)
+
+  assert(#mpu:take_dirty() == 0)
+
+  -- Fill $0200-$0207, and poke $0300 and $0700 (untracked).
+  --
+  --   0600  a2 07     LDX #7
+  --   0602  8a        TXA
+  --   0603  9d 00 02  STA $0200,X
+  --   0606  ca        DEX
+  --   0607  10 f9     BPL $0602
+  --   0609  8d 00 03  STA $0300
+  --   060c  8d 00 07  STA $0700
+  --   060f  00        BRK
+  mpu:pokes(0x600, utils.parse_hex 'a2 07 8a 9d 00 02 ca 10 f9 8d 00 03 8d 00 07 00', true)
+  mpu:pc(0x600)
+  assert(mpu:run {} == 'brk')
+
+  local dirty = mpu:take_dirty()
+  assert(#dirty == 2)
+  assert(dirty[1][1] == 0x200 and dirty[1][2] == 0x207)
+  assert(dirty[2][1] == 0x300 and dirty[2][2] == 0x300)
+
+  -- Memory is written as usual.
+  assert(mpu:peek(0x205) == 5 and mpu:peek(0x207) == 7)
+
+  -- Taking forgets.
+  assert(#mpu:take_dirty() == 0)
+
+  -- Pokes count too, except direct ones.
+  mpu:pokes(0x3fe, 'abc')
+  mpu:poke(0x500, 1, true)
+  dirty = mpu:take_dirty('bytes')
+  assert(#dirty == 1 and dirty[1][1] == 0x3fe and dirty[1][2] == 'abc')
+
+  -- Stop tracking part of it.
+  mpu:track_dirty(0x400, 0x5ff, false)
+  mpu:pokes(0x3ff, 'xy')
+  dirty = mpu:take_dirty()
+  assert(#dirty == 1 and dirty[1][1] == 0x3ff and dirty[1][2] == 0x3ff)
+
+  -- A callback takes over its address.
+  local written
+  mpu:on_write(0x210, function(mpu, addr, val) written = val end)
+  mpu:poke(0x210, 9)
+  assert(written == 9 and #mpu:take_dirty() == 0)
+
+end
+
+------------------------------------------------------------------------------
+
+test_take_dirty()
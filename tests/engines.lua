@@ -0,0 +1,248 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+-- Runs the same program on several engines and checks they end up in the
+-- same state.
+
+local ENGINES = { "interpret", "predecode", "block" }
+
+-- The options for new() to try, for run_everywhere().
+local SETUPS = {
+  { engine = "interpret" },
+  { engine = "predecode" },
+  { engine = "predecode", fuse = false },
+  { engine = "block" },
+  { engine = "block", fuse = false },
+}
+
+local function state(mpu)
+  return table.concat({ mpu:dump(), mpu:cycles(), mpu:peeks(0, 0x10000) }, "\n")
+end
+
+local function run_everywhere(setup, opts)
+  local first
+  for _, options in ipairs(SETUPS) do
+    local mpu = M6.new(options)
+    setup(mpu)
+    local reason, count = mpu:run(opts)
+    local st = reason .. count .. state(mpu)
+    if first then
+      assert(st == first, "engine '" .. options.engine .. "' diverges"
+                          .. (options.fuse == false and " (unfused)" or ""))
+    end
+    first = st
+  end
+end
+
+local function test_random_programs()
+
+  print('testing engines on random programs')
+
+  math.randomseed(1234)
+
+  for _ = 1, 50 do
+    local bytes = {}
+    for i = 1, 0x800 do
+      bytes[i] = string.char(math.random(0, 255))
+    end
+    bytes = table.concat(bytes)
+    run_everywhere(function(mpu)
+      mpu:pokes(0x600, bytes)
+      mpu:pc(0x600)
+    end, { instructions = 2000 })
+  end
+
+end
+
+local function test_limits_and_callbacks()
+
+  print('testing engines stop at the same place')
+
+  -- A copy loop, with a hooked byte in the middle of the source:
+  --
+  --   0600  a2 00     LDX #0
+  --   0602  bd 00 20  LDA $2000,X
+  --   0605  9d 00 30  STA $3000,X
+  --   0608  e8        INX
+  --   0609  d0 f7     BNE $0602
+  --   060b  00        BRK
+  local prog = utils.parse_hex 'a2 00 bd 00 20 9d 00 30 e8 d0 f7 00'
+
+  local function setup(mpu)
+    mpu:pokes(0x600, prog)
+    mpu:pc(0x600)
+    mpu:on_read(0x2042, function(mpu)
+      mpu:stop()
+      return 0x42
+    end)
+  end
+
+  for _, n in ipairs { 1, 2, 3, 7, 100, 500 } do
+    run_everywhere(setup, { instructions = n })
+    run_everywhere(setup, { cycles = n })
+  end
+  run_everywhere(setup, {})
+
+end
+
+local function test_superinstructions()
+
+  print('testing engines on fused instruction pairs')
+
+  -- Exercises CLC/ADC, LDA/STA, INY/CPY, CMP/BNE and DEX/BNE, with a
+  -- hooked byte in the destination:
+  --
+  --   0600  a2 05     LDX #5
+  --   0602  a0 00     LDY #0
+  --   0604  18        CLC
+  --   0605  69 10     ADC #$10
+  --   0607  b9 00 20  LDA $2000,Y
+  --   060a  99 00 30  STA $3000,Y
+  --   060d  c8        INY
+  --   060e  c0 04     CPY #4
+  --   0610  d0 f5     BNE $0607
+  --   0612  c9 00     CMP #0
+  --   0614  d0 00     BNE $0616
+  --   0616  ca        DEX
+  --   0617  d0 eb     BNE $0604
+  --   0619  00        BRK
+  local prog = utils.parse_hex [[
+    a2 05 a0 00 18 69 10 b9 00 20 99 00 30 c8 c0 04
+    d0 f5 c9 00 d0 00 ca d0 eb 00
+  ]]
+
+  local function setup(mpu)
+    mpu:pokes(0x600, prog)
+    mpu:pokes(0x2000, utils.parse_hex '80 00 7f 01')
+    mpu:pc(0x600)
+    mpu:on_write(0x3002, function(mpu, addr, val)
+      mpu:poke(0x4000 + mpu:peek(0x4000) + 1, val)
+      mpu:poke(0x4000, mpu:peek(0x4000) + 1)
+    end)
+  end
+
+  for n = 1, 80 do
+    run_everywhere(setup, { instructions = n })
+    run_everywhere(setup, { cycles = n })
+  end
+  run_everywhere(setup, {})
+
+end
+
+local function test_hooks_installed_while_running()
+
+  print('testing callbacks installed while running')
+
+  -- The engines have faster variants for MPUs without read or write
+  -- callbacks; installing callbacks mid-run must switch variants.
+  --
+  --   0600  20 00 08  JSR $0800   (hooked: installs on_write($10))
+  --   0603  85 10     STA $10
+  --   0605  a5 11     LDA $11     (on_read($11) installed by an event)
+  --   0607  4c 05 06  JMP $0605
+  local prog = utils.parse_hex '20 00 08 85 10 a5 11 4c 05 06'
+
+  for _, engine in ipairs(ENGINES) do
+    local mpu = M6.new { engine = engine }
+    mpu:pokes(0x600, prog)
+    mpu:pc(0x600)
+
+    local written
+    mpu:on_call(0x800, function(mpu)
+      mpu:on_write(0x10, function(mpu, addr, val) written = true end)
+    end)
+    mpu:at_cycle(100, function(mpu)
+      mpu:on_read(0x11, function() return 0x99 end)
+    end)
+
+    local reason, count = mpu:run { cycles = 200 }
+    assert(reason == 'budget')
+    assert(written)
+    assert(mpu:a() == 0x99)
+
+    -- And back to the plain variant once the callbacks are gone.
+    mpu:on_read(0x11, nil)
+    mpu:on_write(0x10, nil)
+    mpu:run { cycles = 20 }
+    assert(mpu:a() == 0)
+  end
+
+end
+
+local function test_self_modifying_code()
+
+  print('testing engines on self-modifying code')
+
+  -- A loop that, on each iteration, increments the operand of its own
+  -- "LDA #" instruction:
+  --
+  --   0600  a9 00     LDA #0
+  --   0602  ee 01 06  INC $0601
+  --   0605  c9 05     CMP #5
+  --   0607  d0 f7     BNE $0600
+  --   0609  00        BRK
+  local prog = utils.parse_hex 'a9 00 ee 01 06 c9 05 d0 f7 00'
+
+  run_everywhere(function(mpu)
+    mpu:pokes(0x600, prog)
+    mpu:pc(0x600)
+  end, {})
+
+  for _, engine in ipairs(ENGINES) do
+    local mpu = M6.new { engine = engine }
+    mpu:pokes(0x600, prog)
+    mpu:pc(0x600)
+    assert(mpu:run {} == "brk")
+    assert(mpu:a() == 5)
+
+    -- Patching the code from Lua is noticed too.
+    mpu:poke(0x600, 0xa2, true)   -- LDA # --> LDX #
+    mpu:pc(0x600)
+    mpu:run { instructions = 1 }
+    assert(mpu:x() == 6)
+  end
+
+end
+
+local function test_store_over_next_insn()
+
+  print('testing engines on a store over the next instruction')
+
+  -- The STA overwrites the instruction right after it, which must then
+  -- run as written:
+  --
+  --   0600  a9 e8     LDA #$e8
+  --   0602  8d 05 06  STA $0605
+  --   0605  ea        NOP         (becomes INX)
+  --   0606  00        BRK
+  local prog = utils.parse_hex 'a9 e8 8d 05 06 ea 00'
+
+  for n = 1, 4 do
+    run_everywhere(function(mpu)
+      mpu:pokes(0x600, prog)
+      mpu:pc(0x600)
+    end, { instructions = n })
+  end
+
+  for _, engine in ipairs(ENGINES) do
+    local mpu = M6.new { engine = engine }
+    mpu:pokes(0x600, prog)
+    mpu:pc(0x600)
+    mpu:run { instructions = 3 }
+    assert(mpu:x() == 1, engine)
+  end
+
+end
+
+------------------------------------------------------------------------------
+
+test_random_programs()
+test_limits_and_callbacks()
+test_superinstructions()
+test_hooks_installed_while_running()
+test_self_modifying_code()
+test_store_over_next_insn()
@@ -0,0 +1,86 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+-- An endless loop:
+--
+--   0600  e8        INX
+--   0601  4c 00 06  JMP $0600
+--
+local LOOP = utils.parse_hex 'e8 4c 00 06'
+
+local function new_mpu()
+  local mpu = M6.new()
+  mpu:pokes(0x600, LOOP)
+  mpu:pc(0x600)
+  return mpu
+end
+
+local function test_at_cycle()
+
+  print('testing at_cycle()')
+
+  local mpu = new_mpu()
+  local fired = {}
+
+  mpu:at_cycle(100, function(mpu, cycle)
+    fired[#fired + 1] = cycle
+    assert(mpu:cycles() >= 100 and mpu:cycles() < 105)
+  end)
+  mpu:at_cycle(50, function(mpu, cycle)
+    fired[#fired + 1] = cycle
+  end)
+  local id = mpu:at_cycle(70, function()
+    error("cancelled events shouldn't fire")
+  end)
+  assert(mpu:cancel(id))
+  assert(not mpu:cancel(id))
+
+  mpu:run { cycles = 200 }
+  assert(#fired == 2 and fired[1] == 50 and fired[2] == 100)
+
+end
+
+local function test_every()
+
+  print('testing every()')
+
+  local mpu = new_mpu()
+  local count = 0
+  local id
+  id = mpu:every(10, function(mpu, cycle)
+    count = count + 1
+    assert(cycle == count * 10)
+    if count == 5 then
+      mpu:cancel(id)
+    end
+  end)
+
+  mpu:run { cycles = 1000 }
+  assert(count == 5)
+
+end
+
+local function test_stop_from_event()
+
+  print('testing stopping from an event')
+
+  local mpu = new_mpu()
+  mpu:at_cycle(30, function(mpu)
+    mpu:stop()
+  end)
+
+  local reason = mpu:run { cycles = 1000 }
+  assert(reason == 'stopped')
+  assert(mpu:cycles() >= 30 and mpu:cycles() < 35)
+
+end
+
+------------------------------------------------------------------------------
+
+test_at_cycle()
+test_every()
+test_stop_from_event()
@@ -3,13 +3,12 @@ local M6 = require('M6502')
 
 ------------------------------------------------------------------------------
 --
--- Tests that only living MPUs are recorded in the 'mpus' registry table.
--- It's a weak table and dead MPUs aren't supposed to be there.
+-- Tests that dead MPUs get collected.
 --
 
 local function test_gc()
 
-  print('testing the registration mechanism.')
+  print('testing that MPUs are collected.')
 
   -- Utility: How many elements in a table?
   local function count(tbl)
@@ -20,24 +19,69 @@ local function test_gc()
     return cnt
   end
 
-  local reg = debug.getregistry()['mpus']
+  local living = setmetatable({}, { __mode = "k" })
 
-  assert(count(reg) == 0)
+  local keep = M6.new()
+  living[keep] = true
 
   do
     local m = M6.new()
-    assert(count(reg) == 1)
+    living[m] = true
     local m2 = M6.new()
-    assert(count(reg) == 2)
+    living[m2] = true
+    assert(count(living) == 3)
   end
 
   collectgarbage()
   collectgarbage()
 
-  assert(count(reg) == 0)
+  assert(count(living) == 1)
+
+end
+
+--
+-- Tests that collected MPUs take their callbacks with them. The callbacks
+-- here refer back to their MPU, as callbacks usually do.
+--
+
+local function test_callbacks_released()
+
+  print('testing that callbacks are released along with their MPU.')
+
+  local function count(tbl)
+    local cnt = 0
+    for _ in pairs(tbl) do
+      cnt = cnt + 1
+    end
+    return cnt
+  end
+
+  local function churn(n)
+    for i = 1, n do
+      local m = M6.new()
+      m:on_write(0x2000, function(mpu, addr, val) m:poke(addr, val, true) end)
+      m:on_read(0x2001, function() return m:a() end)
+      m:on_call(0x3000, function() end)
+      m:at_cycle(1000, function() end)
+      m:every(100, function() end)
+      m:poke(0x2000, i % 256)
+      if i % 1000 == 0 then
+        collectgarbage()
+      end
+    end
+    collectgarbage()
+    collectgarbage()
+  end
+
+  churn(1000)   -- Let the registry reach its steady size.
+  local before = count(debug.getregistry())
+
+  churn(100000)
+  assert(count(debug.getregistry()) == before)
 
 end
 
 ------------------------------------------------------------------------------
 
 test_gc()
+test_callbacks_released()
@@ -0,0 +1,129 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+local function test_jmp_self()
+
+  print('testing JMP * fast-forward')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex '4c 00 06')  -- JMP *
+  mpu:pc(0x600)
+
+  local reason, count = mpu:run { instructions = 100000000 }
+  assert(reason == 'budget' and count == 100000000)
+  assert(mpu:cycles() == 3 * 100000000)
+
+  reason, count = mpu:run { cycles = 1000 }
+  assert(reason == 'budget' and count == 1002)   -- Stops at the first boundary past 1000.
+
+end
+
+-- Polls $10 till an event clears it:
+--
+--   0600  a5 10     LDA $10
+--   0602  d0 fc     BNE $0600
+--   0604  00        BRK
+--
+local POLL = utils.parse_hex 'a5 10 d0 fc 00'
+
+local function run_poll(hooked)
+  local mpu = M6.new()
+  mpu:pokes(0x600, POLL)
+  mpu:poke(0x10, 1)
+  mpu:pc(0x600)
+  if hooked then
+    -- A read callback makes the loop non-idle, so it really runs.
+    mpu:on_read(0x10, function(mpu, addr)
+      return mpu:peek(addr, true)
+    end)
+  end
+  mpu:at_cycle(100001, function(mpu)
+    mpu:poke(0x10, 0)
+  end)
+  local reason, count = mpu:run {}
+  assert(reason == 'brk')
+  return count, mpu:cycles()
+end
+
+local function test_polling_loop()
+
+  print('testing polling loop fast-forward')
+
+  local count, cycles = run_poll(false)
+  local count2, cycles2 = run_poll(true)
+  assert(count == count2 and cycles == cycles2)
+
+end
+
+local function test_wai()
+
+  print('testing WAI')
+
+  -- 0600  cb        WAI
+  -- 0601  a9 01     LDA #1
+  -- 0603  00        BRK
+  --
+  -- 0700  a2 05     LDX #5     (NMI handler)
+  -- 0702  40        RTI
+  local mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex 'cb a9 01 00')
+  mpu:pokes(0x700, utils.parse_hex 'a2 05 40')
+  mpu:pokew(0xfffa, 0x700)
+  mpu:pc(0x600)
+
+  local woken
+  mpu:at_cycle(5000, function(mpu)
+    woken = mpu:cycles()
+    mpu:nmi()
+  end)
+
+  assert(mpu:run {} == 'brk')
+  assert(woken == 5000)
+  assert(mpu:a() == 1 and mpu:x() == 5)
+
+  -- With nothing to wake it up, WAI returns to the caller.
+  mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex 'cb a9 01 00')  -- WAI; LDA #1; BRK
+  mpu:pc(0x600)
+  mpu:p(0x04)                                      -- I set
+  local reason, count = mpu:run {}
+  assert(reason == 'waiting' and count == 1)
+  assert(mpu:pc() == 0x601)
+  assert(mpu:run {} == 'waiting')   -- Still waiting.
+  mpu:irq()                         -- Masked, but ends the wait anyway.
+  assert(mpu:run {} == 'brk')
+  assert(mpu:a() == 1)
+
+  -- A cycles budget runs out while waiting.
+  mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex 'cb')
+  mpu:pc(0x600)
+  local before = mpu:cycles()
+  assert(mpu:run { cycles = 1000 } == 'budget')
+  assert(mpu:cycles() == before + 1000)
+
+end
+
+local function test_stp()
+
+  print('testing STP')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex 'e8 db')  -- INX; STP
+  mpu:pc(0x600)
+  local reason, count = mpu:run {}
+  assert(reason == 'halted' and count == 1)
+  assert(mpu:pc() == 0x601)
+
+end
+
+------------------------------------------------------------------------------
+
+test_jmp_self()
+test_polling_loop()
+test_wai()
+test_stp()
@@ -0,0 +1,191 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+local ENGINES = { "interpret", "predecode", "block" }
+
+local function test_map()
+
+  print('testing map()')
+
+  local mpu = M6.new()
+  mpu:backing(0x10000 * 4)
+  assert(mpu:backing() == 0x40000)
+
+  mpu:backing_pokes(0x100, 'bank A')
+  mpu:backing_pokes(0x200, 'bank B')
+
+  mpu:map(0x80, 0x100)
+  assert(mpu:peeks(0x8000, 6) == 'bank A')
+
+  -- Writes go to the bank...
+  mpu:pokes(0x8000, 'B')
+  mpu:map(0x80, 0x200)
+  assert(mpu:peeks(0x8000, 6) == 'bank B')
+  mpu:map(0x80, 0x100)
+  assert(mpu:peeks(0x8000, 6) == 'Bank A')
+  assert(mpu:backing_peeks(0x100, 6) == 'Bank A')
+
+  -- ...and the store to the pages mapped to it.
+  mpu:backing_pokes(0x105, 'Z')
+  assert(mpu:peeks(0x8000, 6) == 'Bank Z')
+
+  -- The same bank mapped twice.
+  mpu:map(0x90, 0x100)
+  mpu:poke(0x9000, ('T'):byte())
+  assert(mpu:peeks(0x8000, 6) == 'Tank Z')
+
+  -- Unmapping keeps the contents.
+  mpu:map(0x80, nil)
+  mpu:poke(0x8000, ('X'):byte())
+  assert(mpu:peeks(0x9000, 6) == 'Tank Z')
+  assert(mpu:peeks(0x8000, 6) == 'Xank Z')
+
+  assert(not pcall(mpu.map, mpu, 0x80, 0x101))       -- Unaligned.
+  assert(not pcall(mpu.map, mpu, 0x80, 0x40000))     -- Past the end.
+  assert(not pcall(mpu.map, mpu, 0xff, 0, 2))        -- Past page 0xff.
+
+end
+
+local function test_mirror()
+
+  print('testing mirror()')
+
+  local mpu = M6.new()
+
+  -- 2KB mirrored over $0000-$1FFF.
+  for i = 1, 3 do
+    mpu:mirror(i * 8, 0, 8)
+  end
+
+  --   0600  a9 2a     LDA #42
+  --   0602  8d 34 12  STA $1234
+  --   0605  ee 34 0a  INC $0a34
+  --   0608  00        BRK
+  mpu:pokes(0x600, utils.parse_hex 'a9 2a 8d 34 12 ee 34 0a 00', true)
+  mpu:pc(0x600)
+  assert(mpu:run {} == 'brk')
+  for _, addr in ipairs { 0x0234, 0x0a34, 0x1234, 0x1a34 } do
+    assert(mpu:peek(addr) == 43)
+  end
+
+  -- The program is mirrored too (it was poked directly before, so we
+  -- poke it again to see it everywhere).
+  mpu:pokes(0x600, utils.parse_hex 'a9 2a 8d 34 12 ee 34 0a 00')
+  assert(mpu:peeks(0x1600, 9) == mpu:peeks(0x600, 9))
+
+  mpu:mirror(0x18, nil, 8)
+  mpu:poke(0x0234, 1)
+  assert(mpu:peek(0x1a34) == 43 and mpu:peek(0x1234) == 1)
+
+end
+
+local function test_bank_latch()
+
+  print('testing bank_latch()')
+
+  -- Three 256-byte banks at $8000, each with a routine that loads its
+  -- bank number into A and returns. The main program calls bank 2, then
+  -- bank 1, adding the results:
+  --
+  --   0600  a9 02     LDA #2
+  --   0602  8d 00 df  STA $df00
+  --   0605  20 00 80  JSR $8000
+  --   0608  85 10     STA $10
+  --   060a  a9 01     LDA #1
+  --   060c  8d 00 df  STA $df00
+  --   060f  20 00 80  JSR $8000
+  --   0612  18        CLC
+  --   0613  65 10     ADC $10
+  --   0615  00        BRK
+  local prog = utils.parse_hex [[
+    a9 02 8d 00 df 20 00 80 85 10 a9 01 8d 00 df 20 00 80 18 65 10 00
+  ]]
+
+  for _, engine in ipairs(ENGINES) do
+    local mpu = M6.new { engine = engine }
+    mpu:backing(0x300)
+    for bank = 0, 2 do
+      mpu:backing_pokes(bank * 0x100, utils.parse_hex(('a9 %02x 60'):format(bank * 10)))
+    end
+    mpu:bank_latch(0xdf00, 0x80, 1)
+    mpu:map(0x80, 0)
+
+    mpu:pokes(0x600, prog)
+    mpu:pc(0x600)
+    assert(mpu:run {} == 'brk')
+    assert(mpu:a() == 30)
+    assert(mpu:peek(0xdf00) == 0)     -- The latch isn't memory.
+
+    -- Switching from the code being switched out.
+    mpu:backing_pokes(0x000, utils.parse_hex 'a9 02 8d 00 df ea 00')    -- LDA #2; STA $DF00; NOP; BRK
+    mpu:backing_pokes(0x205, utils.parse_hex 'e8 00')                   -- INX; BRK
+    mpu:map(0x80, 0)
+    mpu:pc(0x8000)
+    mpu:x(0)
+    assert(mpu:run {} == 'brk')
+    assert(mpu:x() == 1)
+
+    -- Banks that don't exist are ignored.
+    mpu:poke(0xdf00, 9)
+    assert(mpu:peek(0x8005) == 0xe8)
+
+    mpu:bank_latch(0xdf00, nil)
+    mpu:poke(0xdf00, 0)
+    assert(mpu:peek(0x8005) == 0xe8 and mpu:peek(0xdf00) == 0)
+  end
+
+end
+
+local function test_latch_mirroring()
+
+  print('testing latch that makes a mirror')
+
+  -- Switching bank 1 in at $8000 makes it mirror $9000, which already has
+  -- bank 1. The callback on $8010 is replaced by the mirroring, yet the
+  -- store right after the switch must reach $9010:
+  --
+  --   0600  a9 01     LDA #1
+  --   0602  8d 00 df  STA $df00
+  --   0605  a9 42     LDA #$42
+  --   0607  8d 10 80  STA $8010
+  --   060a  00        BRK
+  local prog = utils.parse_hex 'a9 01 8d 00 df a9 42 8d 10 80 00'
+
+  for _, engine in ipairs(ENGINES) do
+    local mpu = M6.new { engine = engine }
+    local calls = 0
+    mpu:backing(0x200)
+    mpu:bank_latch(0xdf00, 0x80, 1)
+    mpu:map(0x80, 0)
+    mpu:map(0x90, 0x100)
+    mpu:on_write(0x8010, function() calls = calls + 1 end)
+
+    mpu:pokes(0x600, prog)
+    mpu:pc(0x600)
+    -- From a coroutine, with more on its stack than the MPU.
+    local co = coroutine.wrap(function(m, opts) return m:run(opts) end)
+    assert(co(mpu, { instructions = 10 }) == 'brk')
+    assert(mpu:peek(0x9010) == 0x42)
+    assert(calls == 0)
+
+    -- Callbacks installed afterwards live on; the replaced one is gone.
+    mpu:on_write(0x8020, function() calls = calls + 1 end)
+    mpu:poke(0xdf00, 0)
+    mpu:poke(0x8020, 1)
+    mpu:poke(0x8010, 1)
+    assert(calls == 1)
+    assert(mpu:peek(0x9010) == 0x42)
+  end
+
+end
+
+------------------------------------------------------------------------------
+
+test_map()
+test_mirror()
+test_bank_latch()
+test_latch_mirroring()
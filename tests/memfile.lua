@@ -0,0 +1,122 @@
+
+local M6 = require('M6502')
+
+------------------------------------------------------------------------------
+
+local function write_file(path, s)
+  local f = assert(io.open(path, 'wb'))
+  f:write(s)
+  f:close()
+end
+
+local function read_file(path)
+  local f = assert(io.open(path, 'rb'))
+  local s = f:read('*a')
+  f:close()
+  return s
+end
+
+local function test_private()
+
+  print('testing memory_file, private')
+
+  local path = os.tmpname()
+  local image = ('\1'):rep(0x600) .. 'code' .. ('\2'):rep(0x10000 - 0x604) .. 'bank'
+  image = image .. ('\3'):rep(0x200 - 4)
+  write_file(path, image)
+
+  local mpu = M6.new { memory_file = path }
+  assert(mpu:peeks(0x600, 4) == 'code')
+  assert(mpu:peek(0xffff) == 2)
+
+  -- What follows the first 64KB is the backing store.
+  assert(mpu:backing() == 0x200)
+  assert(mpu:backing_peeks(0, 4) == 'bank')
+  mpu:map(0x80, 0)
+  assert(mpu:peeks(0x8000, 4) == 'bank')
+  assert(not pcall(mpu.backing, mpu, 0x400))
+
+  -- Writes don't reach the file.
+  mpu:pokes(0x600, 'CODE')
+  mpu:backing_pokes(0, 'BANK')
+  assert(read_file(path) == image)
+
+  -- Clones have memory of their own.
+  local fork = mpu:clone()
+  fork:poke(0x600, 0)
+  assert(mpu:peeks(0x600, 4) == 'CODE')
+
+  mpu = nil
+  fork = nil
+  collectgarbage()
+
+  -- Too small.
+  write_file(path, ('\0'):rep(100))
+  assert(not pcall(M6.new, { memory_file = path }))
+
+  os.remove(path)
+  assert(not pcall(M6.new, { memory_file = path }))     -- Missing.
+
+end
+
+local function test_shared()
+
+  print('testing memory_file, shared')
+
+  local path = os.tmpname()
+  write_file(path, 'abc')
+
+  local mpu = M6.new { memory_file = path, mode = "shared" }
+  assert(mpu:peeks(0, 4) == 'abc\0')
+  assert(#read_file(path) == 0x10000)                   -- Grown.
+
+  -- The program's writes show in the file as they happen.
+  mpu:pokes(0x600, '\169\065\141\000\002\000')         -- LDA #'A'; STA $0200; BRK
+  mpu:pc(0x600)
+  mpu:run {}
+  assert(read_file(path):sub(0x201, 0x201) == 'A')
+
+  assert(not pcall(M6.new, { memory_file = path, mode = "bogus" }))
+
+  mpu = nil
+  collectgarbage()
+  os.remove(path)
+
+end
+
+local function test_shared_polling()
+
+  print('testing memory_file, shared, polled by the program')
+
+  if package.config:sub(1, 1) ~= '/' then
+    return      -- We need a shell to write the file behind our back.
+  end
+
+  local path = os.tmpname()
+  local mpu = M6.new { memory_file = path, mode = "shared" }
+
+  -- Polls $10 till another process clears it:
+  --
+  --   0600  a5 10     LDA $10
+  --   0602  d0 fc     BNE $0600
+  --   0604  00        BRK
+  mpu:pokes(0x600, '\165\016\208\252\000')
+  mpu:poke(0x10, 1)
+  mpu:pc(0x600)
+  os.execute(("(sleep 0.2; printf '\\000' | dd of=%s bs=1 seek=16 conv=notrunc 2>/dev/null) &"):format(path))
+
+  -- Were the loop skipped, as on private memory, the budget would be used
+  -- up at once.
+  assert(mpu:run { cycles = 2e9 } == 'brk')
+
+  mpu = nil
+  collectgarbage()
+  os.remove(path)
+
+end
+
+------------------------------------------------------------------------------
+
+test_private()
+test_shared()
+test_shared_polling()
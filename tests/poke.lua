@@ -47,6 +47,64 @@ local function test_pokes(direct)
   assert(mpu:peeks(0xfffc, 9999, direct) == 'Hell')
 end
 
+local function test_fill(direct)
+  print('testing fill()')
+  mpu:fill(0x2000, 0x300, 0xaa, direct)
+  assert(mpu:peeks(0x1fff, 0x302, direct) == '\0' .. ('\170'):rep(0x300) .. '\0')
+  mpu:fill(0xfffe, 100, 1, direct)      -- Trimmed at the end of memory.
+  assert(mpu:peeks(0xfffe, 2, direct) == '\1\1')
+  mpu:fill(0x2000, 0, 0, direct)        -- Nothing to do.
+  assert(mpu:peek(0x2000, direct) == 0xaa)
+end
+
+local function test_copy(direct)
+  print('testing copy()')
+  mpu:pokes(0x3000, 'abcdef', direct)
+  mpu:copy(0x3002, 0x3000, 4, direct)   -- Overlapping, forwards.
+  assert(mpu:peeks(0x3000, 6, direct) == 'ababcd')
+  mpu:copy(0x3000, 0x3001, 5, direct)   -- Overlapping, backwards.
+  assert(mpu:peeks(0x3000, 6, direct) == 'babcdd')
+  mpu:copy(0xfffe, 0x3000, 10, direct)  -- Trimmed at the end of memory.
+  assert(mpu:peeks(0xfffe, 2, direct) == 'ba')
+end
+
+-- Bulk operations only call callbacks where they're installed, even when
+-- the callbacks change as they go.
+local function test_bulk_with_callbacks()
+
+  print('testing pokes()/peeks()/fill()/copy() with callbacks')
+
+  local mpu = require('M6502').new()
+  local log = {}
+
+  mpu:on_write(0x4101, function(mpu, addr, val)
+    log[#log + 1] = ('w%x=%d'):format(addr, val)
+    mpu:on_write(0x4103, function(mpu, addr, val)    -- Installed mid-way.
+      log[#log + 1] = ('w%x=%d'):format(addr, val)
+    end)
+  end)
+  mpu:on_read(0x4102, function(mpu, addr)
+    log[#log + 1] = ('r%x'):format(addr)
+    return 99
+  end)
+
+  mpu:pokes(0x40ff, '\1\2\3\4\5\6')
+  assert(table.concat(log, ' ') == 'w4101=3 w4103=5')
+  assert(mpu:peeks(0x40ff, 6, true) == '\1\2\0\4\0\6')
+  assert(mpu:peeks(0x40ff, 6) == '\1\2\0\99\0\6')
+
+  log = {}
+  mpu:fill(0x4100, 3, 7)
+  assert(table.concat(log, ' ') == 'w4101=7')
+  assert(mpu:peeks(0x4100, 4, true) == '\7\0\7\0')
+
+  log = {}
+  mpu:copy(0x4101, 0x4100, 3)   -- Reads 7, 0, 99; then writes them.
+  assert(table.concat(log, ' ') == 'r4102 w4101=7 w4103=99')
+  assert(mpu:peeks(0x4100, 4, true) == '\7\0\0\0')
+
+end
+
 ------------------------------------------------------------------------------
 
 test_poke()
@@ -55,3 +113,8 @@ test_pokew()
 test_pokew(true)
 test_pokes()
 test_pokes(true)
+test_fill()
+test_fill(true)
+test_copy()
+test_copy(true)
+test_bulk_with_callbacks()
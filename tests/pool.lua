@@ -0,0 +1,102 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+-- Counts up in $10, and calls $0800 when done:
+--
+--   0600  e6 10     INC $10
+--   0602  a5 10     LDA $10
+--   0604  c9 05     CMP #5
+--   0606  d0 f8     BNE $0600
+--   0608  20 00 08  JSR $0800
+--   060b  00        BRK
+--
+local PROG = utils.parse_hex 'e6 10 a5 10 c9 05 d0 f8 20 00 08 00'
+
+local function test_pool()
+
+  print('testing pool()')
+
+  local template = M6.new { engine = "predecode" }
+  template:pokes(0x600, PROG)
+  template:pc(0x600)
+  local calls = 0
+  template:on_call(0x800, function(mpu)
+    calls = calls + 1
+    return 0x60   -- RTS
+  end)
+
+  local pool = M6.pool { template = template, size = 2 }
+
+  local seen = {}
+  for i = 1, 5 do
+    local mpu = pool:acquire()
+    assert(mpu:pc() == 0x600 and mpu:peek(0x10) == 0)
+    assert(mpu:run {} == 'brk')
+    assert(mpu:peek(0x10) == 5)
+    assert(calls == i)
+
+    -- Messing with an MPU doesn't affect the next one to use it.
+    mpu:on_call(0x800, nil)
+    mpu:protect(0x600, 0x6ff, "ro")
+    mpu:pokes(0x600, 'xxxx', true)
+
+    seen[mpu] = true
+    pool:release(mpu)
+  end
+  assert(next(seen) and not next(seen, next(seen)))   -- It's the same MPU every time.
+
+  assert(template:peek(0x10) == 0)
+
+  -- Changes to the template show in MPUs acquired later.
+  template:poke(0x10, 3)
+  local mpu = pool:acquire()
+  assert(mpu:peek(0x10) == 3)
+
+  -- When empty, the pool makes new MPUs.
+  local a, b = pool:acquire(), pool:acquire()
+  assert(a ~= b and a ~= mpu and b:peek(0x10) == 3)
+
+  pool:release(a)
+  assert(not pcall(pool.release, pool, a))     -- Twice.
+  assert(not pcall(pool.release, pool, {}))
+  assert(not pcall(M6.pool, { template = {} }))
+  assert(not pcall(M6.pool, { template = template, size = -1 }))
+
+end
+
+local function test_foreign_mpus()
+
+  print('testing pool:release() refuses MPUs from elsewhere')
+
+  local template = M6.new()
+  template:poke(0x200, 0x99)
+  local pool = M6.pool { template = template, size = 1 }
+  local other_pool = M6.pool { template = template, size = 1 }
+
+  -- Reusing these would overwrite memory that isn't the pool's: another
+  -- CPU's, or a file's.
+  local owner = M6.new()
+  owner:poke(0x200, 0x11)
+  local sharer = M6.new { share_memory_with = owner }
+
+  local mpu = pool:acquire()
+  for _, foreign in ipairs { M6.new(), sharer, template, mpu:clone(), other_pool:acquire() } do
+    local ok, err = pcall(pool.release, pool, foreign)
+    assert(not ok and err:find("doesn't come from this pool"))
+  end
+
+  pool:release(mpu)
+  mpu = pool:acquire()
+  assert(mpu:peek(0x200) == 0x99)
+  assert(owner:peek(0x200) == 0x11)
+
+end
+
+------------------------------------------------------------------------------
+
+test_pool()
+test_foreign_mpus()
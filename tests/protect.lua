@@ -0,0 +1,53 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+local function test_protect()
+
+  print('testing protect()')
+
+  local mpu = M6.new()
+  mpu:protect(0xc000, 0xffff, "ro")
+
+  -- Direct pokes load the ROM.
+  mpu:pokes(0xc000, 'ROM', true)
+  assert(mpu:peeks(0xc000, 3) == 'ROM')
+
+  -- Other writes are ignored, and counted.
+  mpu:poke(0xc000, 0)
+  mpu:pokes(0xc001, 'xx')
+  assert(mpu:peeks(0xc000, 3) == 'ROM')
+  assert(mpu:violations() == 3)
+
+  --   0600  a9 58     LDA #'X'
+  --   0602  8d 00 c0  STA $c000
+  --   0605  ee 01 c0  INC $c001
+  --   0608  8d ff bf  STA $bfff
+  --   060b  00        BRK
+  mpu:pokes(0x600, utils.parse_hex 'a9 58 8d 00 c0 ee 01 c0 8d ff bf 00')
+  mpu:pc(0x600)
+  assert(mpu:run {} == 'brk')
+  assert(mpu:peeks(0xc000, 3) == 'ROM')
+  assert(mpu:peek(0xbfff) == ('X'):byte())
+  assert(mpu:violations() == 5)
+
+  mpu:violations(0)
+  assert(mpu:violations() == 0)
+
+  -- Writable again.
+  mpu:protect(0xc000, 0xc000, "rw")
+  mpu:poke(0xc000, ('T'):byte())
+  mpu:poke(0xc001, ('T'):byte())
+  assert(mpu:peeks(0xc000, 3) == 'TOM')
+  assert(mpu:violations() == 1)
+
+  assert(not pcall(mpu.protect, mpu, 0, 1, "rx"))
+
+end
+
+------------------------------------------------------------------------------
+
+test_protect()
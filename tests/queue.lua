@@ -0,0 +1,108 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+-- Prints "HELLO" to a console at $F001:
+--
+--   0600  a2 00     LDX #0
+--   0602  bd 00 07  LDA $0700,X
+--   0605  f0 06     BEQ $060d
+--   0607  8d 01 f0  STA $f001
+--   060a  e8        INX
+--   060b  d0 f5     BNE $0602
+--   060d  00        BRK
+local PROG = utils.parse_hex 'a2 00 bd 00 07 f0 06 8d 01 f0 e8 d0 f5 00'
+
+local function test_drain_writes()
+
+  print('testing queue_writes() and drain_writes()')
+
+  local first_list
+
+  for _, engine in ipairs { "interpret", "predecode", "block" } do
+    local mpu = M6.new { engine = engine }
+    mpu:pokes(0x600, PROG)
+    mpu:pokes(0x700, 'HELLO\0')
+    mpu:pc(0x600)
+    mpu:queue_writes(0xf000, 0xf0ff)
+
+    assert(mpu:run {} == 'brk')
+    assert(mpu:peek(0xf001) == ('O'):byte())   -- Memory is written as usual.
+
+    local list, lost = mpu:drain_writes()
+    assert(#list == 5 * 3 and lost == 0)
+    for i = 1, 5 do
+      assert(list[i * 3 - 1] == 0xf001)
+      assert(list[i * 3] == ('HELLO'):byte(i))
+      assert(i == 1 or list[i * 3 - 2] > list[i * 3 - 5])
+    end
+    -- All the engines agree on the cycles.
+    local s = table.concat(list, ',')
+    assert(not first_list or s == first_list)
+    first_list = s
+
+    -- Draining empties the queue.
+    assert(#mpu:drain_writes() == 0)
+
+    -- Again, as a string.
+    mpu:pc(0x600)
+    mpu:run {}
+    mpu:poke(0xf002, ('!'):byte())
+    assert(mpu:drain_writes('values') == 'HELLO!')
+
+    -- Direct pokes, and addresses no longer queued, aren't recorded.
+    mpu:queue_writes(0xf002, 0xf0ff, false)
+    mpu:poke(0xf001, 1, true)
+    mpu:poke(0xf002, 2)
+    assert(mpu:drain_writes('values') == '')
+    assert(mpu:peek(0xf002) == 2)
+  end
+
+end
+
+local function test_queue_size()
+
+  print('testing the size of write queues')
+
+  -- Writes $F001 forever:
+  --
+  --   0600  8d 01 f0  STA $f001
+  --   0603  e8        INX
+  --   0604  8a        TXA
+  --   0605  4c 00 06  JMP $0600
+  local mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex '8d 01 f0 e8 8a 4c 00 06')
+  mpu:pc(0x600)
+  mpu:queue_writes(0xf001, 0xf001, true, 100)
+
+  mpu:run { instructions = 4 * 250 }
+  assert(mpu:peek(0xf001) == 249)       -- Memory is written even when full.
+  local values, lost = mpu:drain_writes('values')
+  assert(#values == 100 and lost == 150)
+  assert(values:byte(1) == 0 and values:byte(100) == 99)   -- The first ones are kept.
+
+  -- Draining makes room again.
+  mpu:run { instructions = 4 * 10 }
+  values, lost = mpu:drain_writes('values')
+  assert(#values == 10 and lost == 0)
+
+  -- Without a size, the queue still doesn't grow forever.
+  mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex '8d 01 f0 e8 8a 4c 00 06')
+  mpu:pc(0x600)
+  mpu:queue_writes(0xf001, 0xf001)
+  mpu:run { instructions = 4 * 100000 }
+  values, lost = mpu:drain_writes('values')
+  assert(#values == 65536 and lost == 100000 - 65536)
+
+  assert(not pcall(mpu.queue_writes, mpu, 0xf001, 0xf001, true, 0))
+
+end
+
+------------------------------------------------------------------------------
+
+test_drain_writes()
+test_queue_size()
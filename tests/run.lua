@@ -0,0 +1,138 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+-- An endless loop, incrementing X:
+--
+--   0600  e8        INX
+--   0601  4c 00 06  JMP $0600
+--
+local LOOP = utils.parse_hex 'e8 4c 00 06'
+
+local function test_instructions_budget()
+
+  print('testing run{instructions=N}')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, LOOP)
+  mpu:pc(0x600)
+
+  local reason, count = mpu:run { instructions = 5 }
+  assert(reason == 'budget' and count == 5)
+  assert(mpu:x() == 3)     -- INX, JMP, INX, JMP, INX
+  assert(mpu:pc() == 0x601)
+
+  -- We can resume where we stopped.
+  reason, count = mpu:run { instructions = 1 }
+  assert(reason == 'budget' and count == 1)
+  assert(mpu:pc() == 0x600)
+
+end
+
+local function test_cycles_budget()
+
+  print('testing run{cycles=N}')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, LOOP)
+  mpu:pc(0x600)
+
+  local reason, count = mpu:run { cycles = 100 }
+  assert(reason == 'budget')
+  assert(count >= 100 and count < 110)    -- We stop at an instruction boundary.
+
+end
+
+local function test_brk()
+
+  print('testing stopping at BRK')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex 'a9 07 00 00')  -- LDA #7; BRK
+  mpu:pc(0x600)
+
+  local reason, count = mpu:run {}
+  assert(reason == 'brk' and count == 2)
+  assert(mpu:a() == 7)
+  assert(mpu:pc() == 0x604)
+
+  -- BRK's pushes are undone, and interrupts aren't left masked, so a
+  -- program resumed after "brk" (here, many times) runs as before.
+  --
+  --   0600  e8        INX
+  --   0601  00 00     BRK
+  --   0603  4c 00 06  JMP $0600
+  mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex 'e8 00 00 4c 00 06')
+  mpu:pc(0x600)
+  mpu:p(0x01)                     -- C set, I clear
+  for _ = 1, 100 do
+    assert(mpu:run { instructions = 1000 } == 'brk')
+  end
+  assert(mpu:x() == 100)
+  assert(mpu:s() == 0xff)
+  assert(mpu:p() % 8 < 4 and mpu:p() % 2 == 1)   -- I clear, C set
+
+end
+
+local function test_illegal()
+
+  print('testing stopping at an illegal instruction')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, utils.parse_hex 'e8 02')  -- INX; <illegal>
+  mpu:pc(0x600)
+
+  local reason, count = mpu:run { instructions = 100 }
+  assert(reason == 'illegal' and count == 1)
+  assert(mpu:pc() == 0x601)
+
+end
+
+local function test_stop()
+
+  print('testing mpu:stop()')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, LOOP)
+  mpu:pc(0x600)
+
+  mpu:on_write(0x10, function(mpu)
+    mpu:stop()
+  end)
+  mpu:pokes(0x604, utils.parse_hex '85 10')  -- STA $10
+  mpu:pokes(0x601, utils.parse_hex '4c 04 06') -- JMP $0604
+
+  local reason, count = mpu:run { instructions = 100 }
+  assert(reason == 'stopped' and count == 3)
+  assert(mpu:pc() == 0x606)
+
+end
+
+local function test_step()
+
+  print('testing step()')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, LOOP)
+  mpu:pc(0x600)
+
+  local reason, pc, a, x, y, p, s = mpu:step()
+  assert(reason == 'budget' and pc == 0x601 and x == 1 and s == 0xff)
+
+  reason, pc, a, x = mpu:step(4)
+  assert(reason == 'budget' and pc == 0x601 and x == 3)
+
+end
+
+------------------------------------------------------------------------------
+
+test_instructions_budget()
+test_cycles_budget()
+test_brk()
+test_illegal()
+test_stop()
+test_step()
@@ -0,0 +1,173 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+local ENGINES = { "interpret", "predecode", "block" }
+
+local function test_shared_memory()
+
+  print('testing new{share_memory_with=}')
+
+  local cpu = M6.new()
+  local cop = M6.new { share_memory_with = cpu }
+  local third = M6.new { share_memory_with = cop }
+
+  cpu:poke(0x1234, 0x56)
+  assert(cop:peek(0x1234) == 0x56 and third:peek(0x1234) == 0x56)
+  third:pokes(0x2000, 'hello')
+  assert(cpu:peeks(0x2000, 5) == 'hello')
+
+  -- Registers and callbacks aren't shared.
+  cpu:pc(0x600)
+  assert(cop:pc() == 0)
+  local seen
+  cop:on_write(0x10, function() seen = true end)
+  cpu:poke(0x10, 1)
+  assert(not seen)
+
+  -- A program on one MPU writes where the other reads.
+  --
+  --   0600  a9 2a     LDA #$2a
+  --   0602  85 10     STA $10
+  --   0604  00        BRK
+  cpu:pokes(0x600, utils.parse_hex 'a9 2a 85 10 00')
+  cpu:run {}
+  assert(third:peek(0x10) == 0x2a)
+
+  -- Clones have memory of their own.
+  local fork = cop:clone()
+  fork:poke(0x2000, 0x99)
+  assert(cpu:peek(0x2000) == 0x68 and fork:peek(0x2000) == 0x99)
+
+end
+
+local function test_code_patched_by_other()
+
+  print('testing code patched by an MPU sharing memory')
+
+  -- The first MPU runs "LDA #n; BRK" at $0600; the second, between
+  -- runs, patches n (so the first's decoded instructions are stale).
+  --
+  --   0700  a9 07     LDA #7
+  --   0702  8d 01 06  STA $0601
+  --   0705  00        BRK
+  for _, engine in ipairs(ENGINES) do
+    for _, engine2 in ipairs(ENGINES) do
+      local cpu = M6.new { engine = engine }
+      local cop = M6.new { engine = engine2, share_memory_with = cpu }
+      cpu:pokes(0x600, utils.parse_hex 'a9 01 00')
+      cop:pokes(0x700, utils.parse_hex 'a9 07 8d 01 06 00')
+
+      cpu:pc(0x600)
+      assert(cpu:run {} == 'brk' and cpu:a() == 1)
+
+      cop:pc(0x700)
+      assert(cop:run {} == 'brk')
+
+      cpu:pc(0x600)
+      assert(cpu:run {} == 'brk' and cpu:a() == 7)
+
+      -- Pokes from Lua too.
+      cop:poke(0x601, 0x09, true)
+      cpu:pc(0x600)
+      assert(cpu:run {} == 'brk' and cpu:a() == 9)
+    end
+  end
+
+end
+
+local function test_lifetime()
+
+  print('testing the lifetime of shared memory')
+
+  -- The owner goes away first (as far as we're concerned).
+  local cpu = M6.new { engine = "predecode" }
+  local cop = M6.new { engine = "predecode", share_memory_with = cpu }
+  local third = M6.new { share_memory_with = cop }
+  cpu:poke(0x1000, 0x42)
+  local ref = setmetatable({ cpu }, { __mode = 'v' })
+  cpu = nil
+  collectgarbage()
+  collectgarbage()
+  assert(ref[1], "the owner must stay alive")
+
+  cop = nil
+  collectgarbage()
+  collectgarbage()
+  assert(ref[1])
+  assert(third:peek(0x1000) == 0x42)
+  third:poke(0x1001, 0x43)
+
+  third = nil
+  collectgarbage()
+  collectgarbage()
+  assert(not ref[1])
+
+  -- Many short-lived sharers.
+  local owner = M6.new { engine = "block" }
+  for i = 1, 200 do
+    local s = M6.new { engine = "predecode", share_memory_with = owner }
+    s:poke(0x2000 + i, i % 256)
+    if i % 50 == 0 then
+      collectgarbage()
+    end
+  end
+  collectgarbage()
+  assert(owner:peek(0x2000 + 123) == 123)
+  owner:poke(0x2000, 1)   -- Nobody left to tell.
+
+end
+
+local function test_errors()
+
+  print('testing new{share_memory_with=} errors')
+
+  assert(not pcall(M6.new, { share_memory_with = {} }))
+  assert(not pcall(M6.new, { share_memory_with = M6.new(), memory_file = "x" }))
+
+end
+
+local function test_pool()
+
+  print('testing pools and MPUs sharing memory')
+
+  -- A pool must not reuse an MPU sharing memory: it would copy the
+  -- template over the other MPU's memory.
+  local a = M6.new()
+  a:poke(0x200, 0x11)
+  local b = M6.new { share_memory_with = a }
+  local template = M6.new()
+  template:poke(0x200, 0x99)
+  local pool = M6.pool { template = template, size = 1 }
+
+  local x = pool:acquire()
+  assert(not pcall(pool.release, pool, b))
+  pool:release(x)
+  local y = pool:acquire()
+  assert(a:peek(0x200) == 0x11 and y:peek(0x200) == 0x99)
+
+  -- MPUs from a pool based on a sharer have memory of their own.
+  pool = M6.pool { template = b, size = 1 }
+  x = pool:acquire()
+  x:poke(0x200, 0x22)
+  pool:release(x)
+  x = pool:acquire()
+  assert(a:peek(0x200) == 0x11 and x:peek(0x200) == 0x11)
+
+  a, b = nil, nil
+  collectgarbage()
+  collectgarbage()
+  assert(y:peek(0x200) == 0x99 and x:peek(0x200) == 0x11)
+
+end
+
+------------------------------------------------------------------------------
+
+test_shared_memory()
+test_code_patched_by_other()
+test_lifetime()
+test_errors()
+test_pool()
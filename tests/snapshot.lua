@@ -0,0 +1,273 @@
+
+local M6 = require('M6502')
+
+local utils = require('M6502.utils')
+
+------------------------------------------------------------------------------
+
+local ENGINES = { "interpret", "predecode", "block" }
+
+-- An endless loop:
+--
+--   0600  e8        INX
+--   0601  4c 00 06  JMP $0600
+--
+local LOOP = utils.parse_hex 'e8 4c 00 06'
+
+local function state(mpu)
+  return table.concat({ mpu:dump(), mpu:cycles(), mpu:peeks(0, 0x10000, true) }, "\n")
+end
+
+local function test_save_restore()
+
+  print('testing save() and restore()')
+
+  for _, engine in ipairs(ENGINES) do
+    local mpu = M6.new { engine = engine }
+    mpu:pokes(0x600, LOOP)
+    mpu:pc(0x600)
+    mpu:run { instructions = 11 }
+
+    local blob = mpu:save()
+    local saved = state(mpu)
+
+    mpu:run { instructions = 100 }
+    mpu:fill(0x2000, 0x1000, 0xee)
+    mpu:pokes(0x600, utils.parse_hex 'c8')   -- INX --> INY
+    mpu:a(1)
+    mpu:s(0x10)
+    assert(state(mpu) ~= saved)
+
+    mpu:restore(blob)
+    assert(state(mpu) == saved)
+
+    -- And it runs the restored code, not what's left in the engine's cache.
+    mpu:run { instructions = 2 }
+    assert(mpu:x() == 7 and mpu:y() == 0)
+
+    -- Restoring again, and into another MPU.
+    mpu:restore(blob)
+    assert(state(mpu) == saved)
+    local other = M6.new()
+    other:restore(blob)
+    assert(state(other) == saved)
+  end
+
+end
+
+local function test_protection()
+
+  print('testing snapshots with protected memory')
+
+  local mpu = M6.new()
+  mpu:protect(0xc000, 0xcfff, "ro")
+  mpu:poke(0xc000, 1)
+  local blob = mpu:save()
+
+  mpu:protect(0xc000, 0xcfff, "rw")
+  mpu:protect(0x1000, 0x1000, "ro")
+  mpu:poke(0xc000, 2)
+  mpu:violations(0)
+
+  mpu:restore(blob)
+  assert(mpu:violations() == 1)
+  mpu:poke(0xc000, 3)
+  mpu:poke(0x1000, 4)
+  assert(mpu:peek(0xc000) == 0 and mpu:peek(0x1000) == 4)
+  assert(mpu:violations() == 2)
+
+end
+
+local function test_mapping()
+
+  print('testing snapshots with mapped memory')
+
+  local mpu = M6.new()
+  mpu:backing(0x1000)
+  mpu:backing_pokes(0, 'bank 0')
+  mpu:backing_pokes(0x100, 'bank 1')
+  mpu:bank_latch(0xdf00, 0x80, 1)
+  mpu:map(0x80, 0)
+  mpu:mirror(0x90, 0x80)
+  local blob = mpu:save()
+
+  mpu:poke(0xdf00, 1)
+  mpu:poke(0x8000, ('B'):byte())
+  assert(mpu:peeks(0x8000, 6) == 'Bank 1')
+  mpu:bank_latch(0xdf00, nil)
+  mpu:mirror(0x90, nil)
+  mpu:backing(0x200)
+
+  mpu:restore(blob)
+  assert(mpu:backing() == 0x1000)
+  assert(mpu:peeks(0x8000, 6) == 'bank 0')
+  mpu:poke(0x9000, ('T'):byte())          -- Mirrored again.
+  assert(mpu:peeks(0x8000, 6) == 'Tank 0')
+  mpu:poke(0xdf00, 1)                     -- The latch is back.
+  assert(mpu:peeks(0x8000, 6) == 'bank 1')
+  mpu:poke(0xdf00, 0)
+  assert(mpu:peeks(0x8000, 6) == 'Tank 0')
+
+  -- A snapshot without mapping undoes it.
+  local plain = M6.new()
+  local mpu2 = M6.new()
+  mpu2:restore(blob)
+  mpu2:restore(plain:save())
+  mpu2:poke(0x9000, 1)
+  assert(mpu2:peek(0x8000) == 0)
+
+end
+
+local function test_events()
+
+  print('testing snapshots with timed events')
+
+  local mpu = M6.new()
+  mpu:pokes(0x600, LOOP)
+  mpu:pc(0x600)
+
+  local fired = {}
+  local once = mpu:at_cycle(100, function(mpu, cycle) fired[#fired + 1] = 'once' end)
+  mpu:every(150, function(mpu, cycle) fired[#fired + 1] = 'every' .. cycle end)
+  local blob = mpu:save()
+
+  mpu:run { cycles = 200 }
+  assert(table.concat(fired, ' ') == 'once every150')
+  mpu:at_cycle(1000, function() error("scheduled after the save") end)
+
+  -- The one-shot event comes back, and the periodic one is re-timed.
+  fired = {}
+  mpu:restore(blob)
+  mpu:run { cycles = 1100 }
+  assert(table.concat(fired, ' ') == 'once every150 every300 every450 every600 every750 every900 every1050')
+
+  -- Ids are kept.
+  mpu:restore(blob)
+  assert(mpu:cancel(once))
+
+  -- Another MPU has no functions for these events, so it skips them.
+  local other = M6.new()
+  other:restore(blob)
+  fired = {}
+  other:pokes(0x600, LOOP)
+  other:run { cycles = 1000 }
+  assert(#fired == 0)
+
+end
+
+local function test_bad_snapshots()
+
+  print('testing restore() with bad snapshots')
+
+  local mpu = M6.new()
+  mpu:poke(0x10, 42)
+  local blob = M6.new():save()
+
+  for _, bad in ipairs {
+    '',
+    'hello world',
+    blob:sub(1, 100),
+    blob .. 'x',
+    blob:sub(1, 6) .. '\99\0' .. blob:sub(9),   -- Version 99.
+  } do
+    assert(not pcall(mpu.restore, mpu, bad))
+  end
+
+  assert(mpu:peek(0x10) == 42)   -- Untouched.
+
+end
+
+local function test_clone()
+
+  print('testing clone()')
+
+  for _, engine in ipairs(ENGINES) do
+    local mpu = M6.new { engine = engine }
+    mpu:pokes(0x600, LOOP)
+    mpu:pc(0x600)
+    mpu:protect(0xc000, 0xc0ff, "ro")
+    local writes = {}
+    mpu:on_write(0x10, function(mpu, addr, val) writes[#writes + 1] = val end)
+    local fired = 0
+    mpu:every(100, function() fired = fired + 1 end)
+    mpu:run { instructions = 11 }
+
+    local fork = mpu:clone()
+    assert(state(fork) == state(mpu))
+
+    -- Callbacks and events come along.
+    fork:poke(0x10, 5)
+    assert(writes[1] == 5)
+    fork:poke(0xc000, 1)
+    assert(fork:peek(0xc000) == 0 and fork:violations() == 1)
+    fork:run { cycles = 1000 }
+    assert(fired == 10)
+
+    -- But the two are independent.
+    local saved = state(mpu)
+    fork:pokes(0x600, utils.parse_hex 'c8')     -- INX --> INY
+    fork:on_write(0x10, nil)
+    fork:protect(0xc000, 0xc0ff, "rw")
+    assert(state(mpu) == saved)
+    mpu:poke(0x10, 6)
+    mpu:poke(0xc000, 2)
+    assert(writes[2] == 6 and mpu:peek(0xc000) == 0)
+
+    -- Each runs its own code.
+    fork:run { instructions = 2 }
+    mpu:run { instructions = 2 }
+    assert(fork:y() == 1 and mpu:y() == 0)
+  end
+
+  -- The clone outlives the original.
+  local mpu = M6.new()
+  local fired = 0
+  mpu:every(10, function() fired = fired + 1 end)
+  local fork = mpu:clone()
+  mpu = nil
+  collectgarbage()
+  collectgarbage()
+  fork:pokes(0x600, LOOP)
+  fork:pc(0x600)
+  fork:run { cycles = 100 }
+  assert(fired == 10)
+
+end
+
+local function test_foreign_events()
+
+  print('testing snapshots with events from other MPUs')
+
+  -- An MPU that has saved has functions for its events' ids...
+  local other = M6.new()
+  other:pokes(0x600, LOOP)
+  other:at_cycle(100, function() error("bound to a foreign event") end)
+  other:save()
+
+  -- ...which must not get bound to another MPU's events with the same ids.
+  local mpu = M6.new()
+  local fired = 0
+  mpu:at_cycle(100, function() fired = fired + 1 end)
+  other:restore(mpu:save())
+  other:pc(0x600)
+  other:run { cycles = 1000 }
+  assert(fired == 0)
+
+  -- Serials aren't small counters, which a blob saved in another process
+  -- would likely repeat.
+  -- (It's the 8 bytes after the magic and the version, low byte first.)
+  local a, b = M6.new():save():sub(9, 16), M6.new():save():sub(9, 16)
+  assert(a ~= b)
+  assert(a:sub(5) ~= '\0\0\0\0' or b:sub(5) ~= '\0\0\0\0')
+
+end
+
+------------------------------------------------------------------------------
+
+test_save_restore()
+test_protection()
+test_mapping()
+test_events()
+test_bad_snapshots()
+test_clone()
+test_foreign_events()